@@ -1,7 +1,9 @@
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <scfg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +12,7 @@
 #include <wayland-client.h>
 
 #include "config.h"
+#include "log.h"
 
 static bool parse_int(int *dst, const char *str) {
 	char *end;
@@ -22,35 +25,82 @@ static bool parse_int(int *dst, const char *str) {
 	return true;
 }
 
+// Parses a number of seconds, or of milliseconds with a "ms" suffix
+static bool parse_duration_ms(int *dst, const char *str) {
+	char *end;
+	errno = 0;
+	double v = strtod(str, &end);
+	if (errno != 0 || end == str || v < 0) {
+		return false;
+	}
+	if (strcmp(end, "ms") != 0) {
+		if (end[0] != '\0' && strcmp(end, "s") != 0) {
+			return false;
+		}
+		v *= 1000;
+	}
+	if (v > INT_MAX) {
+		return false;
+	}
+	*dst = v;
+	return true;
+}
+
+// Parses a refresh rate in Hz, with an optional "Hz" suffix, to mHz
+static bool parse_refresh(int *dst, const char *str) {
+	char *end;
+	errno = 0;
+	float v = strtof(str, &end);
+	if (errno != 0 || (end[0] != '\0' && strcmp(end, "Hz") != 0) ||
+			str[0] == '\0' || v < 0) {
+		return false;
+	}
+	*dst = v * 1000;
+	return true;
+}
+
 static bool parse_mode(struct kanshi_profile_output *output, char *str) {
+	static const struct {
+		const char *name;
+		enum kanshi_mode_policy policy;
+	} policies[] = {
+		{ "preferred", KANSHI_MODE_PREFERRED },
+		{ "max-resolution", KANSHI_MODE_MAX_RESOLUTION },
+		{ "max-refresh", KANSHI_MODE_MAX_REFRESH },
+	};
+	for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		if (strcmp(str, policies[i].name) == 0) {
+			if (output->mode.custom) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid output mode: --custom requires a mode, not '%s'", str);
+				return false;
+			}
+			output->mode.policy = policies[i].policy;
+			return true;
+		}
+	}
+
 	const char *width = strtok(str, "x");
 	const char *height = strtok(NULL, "@");
 	const char *refresh = strtok(NULL, "");
 
 	if (width == NULL || height == NULL) {
-		fprintf(stderr, "invalid output mode: missing width/height\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output mode: missing width/height");
 		return false;
 	}
 
 	if (!parse_int(&output->mode.width, width)) {
-		fprintf(stderr, "invalid output mode: invalid width\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output mode: invalid width");
 		return false;
 	}
 	if (!parse_int(&output->mode.height, height)) {
-		fprintf(stderr, "invalid output mode: invalid height\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output mode: invalid height");
 		return false;
 	}
 
-	if (refresh != NULL) {
-		char *end;
-		errno = 0;
-		float v = strtof(refresh, &end);
-		if (errno != 0 || (end[0] != '\0' && strcmp(end, "Hz") != 0) ||
-				str[0] == '\0') {
-			fprintf(stderr, "invalid output mode: invalid refresh rate\n");
-			return false;
-		}
-		output->mode.refresh = v * 1000;
+	if (refresh != NULL && !parse_refresh(&output->mode.refresh, refresh)) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output mode: invalid refresh rate");
+		return false;
 	}
 
 	return true;
@@ -61,16 +111,16 @@ static bool parse_position(struct kanshi_profile_output *output, char *str) {
 	const char *y = strtok(NULL, "");
 
 	if (x == NULL || y == NULL) {
-		fprintf(stderr, "invalid output position: missing x/y\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output position: missing x/y");
 		return false;
 	}
 
 	if (!parse_int(&output->position.x, x)) {
-		fprintf(stderr, "invalid output position: invalid x\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output position: invalid x");
 		return false;
 	}
 	if (!parse_int(&output->position.y, y)) {
-		fprintf(stderr, "invalid output position: invalid y\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output position: invalid y");
 		return false;
 	}
 
@@ -122,6 +172,138 @@ static bool parse_bool(bool *dst, const char *str) {
 	return true;
 }
 
+static const char *pattern_fields[] = {
+	[KANSHI_PATTERN_NAME] = "name",
+	[KANSHI_PATTERN_MAKE] = "make",
+	[KANSHI_PATTERN_MODEL] = "model",
+	[KANSHI_PATTERN_SERIAL] = "serial",
+};
+
+// Returns the length of the field name if str is a pattern criteria, 0
+// otherwise
+static size_t pattern_field_len(const char *str,
+		enum kanshi_output_pattern_field *field) {
+	for (size_t i = 0; i < sizeof(pattern_fields) / sizeof(pattern_fields[0]); i++) {
+		size_t len = strlen(pattern_fields[i]);
+		if (strncmp(str, pattern_fields[i], len) == 0 &&
+				(str[len] == '=' || str[len] == '~')) {
+			if (field != NULL) {
+				*field = i;
+			}
+			return len;
+		}
+	}
+	return 0;
+}
+
+static bool is_output_pattern(const char *str) {
+	return pattern_field_len(str, NULL) > 0;
+}
+
+static char *glob_to_regex(const char *glob) {
+	char *str = NULL;
+	size_t str_size = 0;
+	FILE *f = open_memstream(&str, &str_size);
+	fprintf(f, "^");
+	for (size_t i = 0; glob[i] != '\0'; i++) {
+		char ch = glob[i];
+		if (ch == '*') {
+			fprintf(f, ".*");
+		} else if (ch == '?') {
+			fprintf(f, ".");
+		} else if (ch == '[') {
+			// Copy the bracket expression, a leading ']' is part of the set
+			size_t j = i + 1;
+			fprintf(f, "[");
+			if (glob[j] == '!') {
+				fprintf(f, "^");
+				j++;
+			}
+			if (glob[j] == ']') {
+				fprintf(f, "]");
+				j++;
+			}
+			for (; glob[j] != '\0' && glob[j] != ']'; j++) {
+				fprintf(f, "%c", glob[j]);
+			}
+			if (glob[j] != ']') {
+				fclose(f);
+				free(str);
+				return NULL;
+			}
+			fprintf(f, "]");
+			i = j;
+		} else {
+			if (ch == '\\' && glob[i + 1] != '\0') {
+				ch = glob[++i];
+			}
+			if (strchr(".[]^$+(){}|\\*?", ch) != NULL) {
+				fprintf(f, "\\");
+			}
+			fprintf(f, "%c", ch);
+		}
+	}
+	fprintf(f, "$");
+	fclose(f);
+	return str;
+}
+
+static bool parse_output_pattern(struct kanshi_output_pattern *pattern,
+		const char *str) {
+	size_t len = pattern_field_len(str, &pattern->field);
+	char op = str[len];
+	const char *value = &str[len + 1];
+
+	int ret;
+	if (op == '=') {
+		if (strpbrk(value, "*?[\\") == NULL) {
+			pattern->literal = strdup(value);
+			return true;
+		}
+		char *regex = glob_to_regex(value);
+		if (regex == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL,
+				"invalid output pattern '%s': unterminated '['",
+				str);
+			return false;
+		}
+		ret = regcomp(&pattern->regex, regex, REG_EXTENDED | REG_NOSUB);
+		free(regex);
+	} else {
+		ret = regcomp(&pattern->regex, value, REG_EXTENDED | REG_NOSUB);
+	}
+	if (ret != 0) {
+		char msg[256];
+		regerror(ret, &pattern->regex, msg, sizeof(msg));
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output pattern '%s': %s", str, msg);
+		return false;
+	}
+	return true;
+}
+
+static bool parse_profile_output_patterns(struct kanshi_profile_output *output,
+		char **params, size_t params_len) {
+	output->patterns = calloc(params_len, sizeof(*output->patterns));
+	for (size_t i = 0; i < params_len; i++) {
+		if (!parse_output_pattern(&output->patterns[i], params[i])) {
+			return false;
+		}
+		output->patterns_len++;
+	}
+
+	// Use the whole criteria as the output name in messages
+	char *str = NULL;
+	size_t str_size = 0;
+	FILE *f = open_memstream(&str, &str_size);
+	for (size_t i = 0; i < params_len; i++) {
+		fprintf(f, "%s%s", i > 0 ? " " : "", params[i]);
+	}
+	fclose(f);
+	free(output->name);
+	output->name = str;
+	return true;
+}
+
 static ssize_t parse_profile_output_param(struct kanshi_profile_output *output,
 		const char *name, char **params, size_t params_len) {
 	if (strcmp(name, "enable") == 0) {
@@ -135,8 +317,8 @@ static ssize_t parse_profile_output_param(struct kanshi_profile_output *output,
 	}
 
 	if (params_len == 0) {
-		fprintf(stderr, "output directive '%s' requires at least one param\n",
-			name);
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"output directive '%s' requires at least one param", name);
 		return -1;
 	}
 
@@ -145,13 +327,36 @@ static ssize_t parse_profile_output_param(struct kanshi_profile_output *output,
 	size_t n = 1;
 	if (strcmp(name, "mode") == 0) {
 		key = KANSHI_OUTPUT_MODE;
-		if (strcmp(value, "--custom") == 0) {
-			output->mode.custom = true;
-			if (params_len < 2) {
-				fprintf(stderr, "output directive 'mode' is missing param\n");
+		output->mode = (struct kanshi_output_mode){
+			.refresh_tolerance = KANSHI_REFRESH_TOLERANCE,
+		};
+		while (value[0] == '-' && value[1] == '-') {
+			bool has_arg = strcmp(value, "--tolerance") == 0;
+			if (strcmp(value, "--custom") == 0) {
+				output->mode.custom = true;
+			} else if (!has_arg) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"unknown output mode option '%s'", value);
+				return -1;
+			}
+			if (params_len < n + 1 + has_arg) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL, "output directive 'mode' is missing param");
+				return -1;
+			}
+			if (has_arg && !parse_refresh(&output->mode.refresh_tolerance,
+					params[n])) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid output mode: invalid tolerance");
 				return -1;
 			}
-			value = params[1];
+			// Refresh rates are in mHz, a smaller tolerance would match nothing
+			if (has_arg && output->mode.refresh_tolerance < 1) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid output mode: tolerance must be at least 0.001Hz");
+				return -1;
+			}
+			n += has_arg;
+			value = params[n];
 			n++;
 		}
 		if (!parse_mode(output, value)) {
@@ -165,32 +370,32 @@ static ssize_t parse_profile_output_param(struct kanshi_profile_output *output,
 	} else if (strcmp(name, "scale") == 0) {
 		key = KANSHI_OUTPUT_SCALE;
 		if (!parse_float(&output->scale, value)) {
-			fprintf(stderr, "invalid output scale\n");
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output scale");
 			return -1;
 		}
 	} else if (strcmp(name, "transform") == 0) {
 		key = KANSHI_OUTPUT_TRANSFORM;
 		if (!parse_transform(&output->transform, value)) {
-			fprintf(stderr, "invalid output transform\n");
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output transform");
 			return -1;
 		}
 	} else if (strcmp(name, "adaptive_sync") == 0) {
 		key = KANSHI_OUTPUT_ADAPTIVE_SYNC;
 		if (!parse_bool(&output->adaptive_sync, value)) {
-			fprintf(stderr, "invalid output adaptive_sync\n");
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output adaptive_sync");
 			return -1;
 		}
 	} else if (strcmp(name, "alias") == 0) {
 		if (value[0] != '$') {
-			fprintf(stderr, "invalid output alias '%s', must start with $\n", value);
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "invalid output alias '%s', must start with $", value);
 			return -1;
 		} else {
 			output->alias = strdup(value);
 			return n;
 		}
 	} else {
-		fprintf(stderr,
-			"unknown directive '%s' in profile output '%s'\n",
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"unknown directive '%s' in profile output '%s'",
 			name, output->name);
 		return false;
 	}
@@ -199,25 +404,45 @@ static ssize_t parse_profile_output_param(struct kanshi_profile_output *output,
 	return n;
 }
 
+static void destroy_output(struct kanshi_profile_output *output);
+
 static struct kanshi_profile_output *parse_profile_output(
 		struct scfg_directive *dir) {
 	if (dir->params_len == 0) {
-		fprintf(stderr, "directive 'output': expected at least one param\n");
-		fprintf(stderr, "(on line %d)\n", dir->lineno);
+		kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+			.line = dir->lineno,
+		}, "directive 'output': expected at least one param");
 		return NULL;
 	}
 
 	struct kanshi_profile_output *output = calloc(1, sizeof(*output));
+	wl_list_init(&output->link);
 
 	output->name = strdup(dir->params[0]);
 
 	size_t i = 1;
+	if (is_output_pattern(dir->params[0])) {
+		while (i < dir->params_len && is_output_pattern(dir->params[i])) {
+			i++;
+		}
+		if (!parse_profile_output_patterns(output, dir->params, i)) {
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.line = dir->lineno,
+			}, "invalid directive 'output'");
+			destroy_output(output);
+			return NULL;
+		}
+	}
+
 	while (i < dir->params_len) {
 		const char *name = dir->params[i];
 		ssize_t n = parse_profile_output_param(output, name,
 			&dir->params[i + 1], dir->params_len - i - 1);
 		if (n < 0) {
-			fprintf(stderr, "(on line %d)\n", dir->lineno);
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.line = dir->lineno,
+			}, "invalid directive 'output'");
+			destroy_output(output);
 			return NULL;
 		}
 		i += 1 + n;
@@ -229,10 +454,14 @@ static struct kanshi_profile_output *parse_profile_output(
 		ssize_t n = parse_profile_output_param(output, child->name,
 			child->params, child->params_len);
 		if (n < 0) {
-			fprintf(stderr, "(on line %d)\n", child->lineno);
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.line = child->lineno,
+			}, "invalid directive 'output'");
+			destroy_output(output);
 			return NULL;
 		} else if ((size_t)n != child->params_len) {
-			fprintf(stderr, "directive 'output': only one directive per line is allowed in output blocks\n");
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "directive 'output': only one directive per line is allowed in output blocks");
+			destroy_output(output);
 			return NULL;
 		}
 	}
@@ -242,9 +471,35 @@ static struct kanshi_profile_output *parse_profile_output(
 
 static struct kanshi_profile_command *parse_profile_exec(
 		struct scfg_directive *dir) {
-	if (dir->params_len == 0) {
-		fprintf(stderr, "directive 'exec': expected at least one param\n");
-		fprintf(stderr, "(on line %d)\n", dir->lineno);
+	size_t first = 0;
+	int once_per_ms = 0;
+	bool json = false;
+	bool wait = false;
+	while (first < dir->params_len) {
+		const char *param = dir->params[first];
+		if (strcmp(param, "--once-per") == 0) {
+			if (first + 1 == dir->params_len ||
+					!parse_duration_ms(&once_per_ms, dir->params[first + 1])) {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'exec': --once-per expects a duration");
+				return NULL;
+			}
+			first += 2;
+		} else if (strcmp(param, "--json") == 0) {
+			json = true;
+			first++;
+		} else if (strcmp(param, "--wait") == 0) {
+			wait = true;
+			first++;
+		} else {
+			break;
+		}
+	}
+	if (dir->params_len == first) {
+		kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+			.line = dir->lineno,
+		}, "directive 'exec': expected at least one param");
 		return NULL;
 	}
 
@@ -257,9 +512,9 @@ static struct kanshi_profile_command *parse_profile_exec(
 	char *str = NULL;
 	size_t str_size = 0;
 	FILE *f = open_memstream(&str, &str_size);
-	for (size_t i = 0; i < dir->params_len; i++) {
+	for (size_t i = first; i < dir->params_len; i++) {
 		const char *param = dir->params[i];
-		if (i > 0) {
+		if (i > first) {
 			fprintf(f, " ");
 		}
 		for (size_t j = 0; param[j] != '\0'; j++) {
@@ -274,17 +529,95 @@ static struct kanshi_profile_command *parse_profile_exec(
 
 	struct kanshi_profile_command *command = calloc(1, sizeof(*command));
 	command->command = str;
+	command->once_per_ms = once_per_ms;
+	command->json = json;
+	command->wait = wait;
 	return command;
 }
 
+static uint64_t hash_string(const char *str) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; str[i] != '\0'; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+// Returns the slot of key, or the empty slot where it would be inserted
+static struct kanshi_output_table_entry *output_table_slot(
+		const struct kanshi_output_table *table, const char *key) {
+	size_t mask = table->cap - 1;
+	for (size_t i = hash_string(key) & mask;; i = (i + 1) & mask) {
+		struct kanshi_output_table_entry *entry = &table->entries[i];
+		if (entry->key == NULL || strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+}
+
+static struct kanshi_profile_output *output_table_get(
+		const struct kanshi_output_table *table, const char *key) {
+	if (table->len == 0) {
+		return NULL;
+	}
+	return output_table_slot(table, key)->output;
+}
+
+// Adds output under key, unless the key is already taken. Returns false on
+// allocation failure.
+static bool output_table_add(struct kanshi_output_table *table,
+		const char *key, struct kanshi_profile_output *output) {
+	// Keep the load factor under 1/2
+	if (2 * (table->len + 1) > table->cap) {
+		size_t cap = table->cap > 0 ? 2 * table->cap : 16;
+		struct kanshi_output_table grown = {
+			.entries = calloc(cap, sizeof(grown.entries[0])),
+			.cap = cap,
+		};
+		if (grown.entries == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			return false;
+		}
+		for (size_t i = 0; i < table->cap; i++) {
+			const struct kanshi_output_table_entry *entry = &table->entries[i];
+			if (entry->key != NULL) {
+				*output_table_slot(&grown, entry->key) = *entry;
+			}
+		}
+		grown.len = table->len;
+		free(table->entries);
+		*table = grown;
+	}
+
+	struct kanshi_output_table_entry *entry = output_table_slot(table, key);
+	if (entry->key == NULL) {
+		*entry = (struct kanshi_output_table_entry){
+			.key = key,
+			.output = output,
+		};
+		table->len++;
+	}
+	return true;
+}
+
+static void output_table_finish(struct kanshi_output_table *table) {
+	free(table->entries);
+	*table = (struct kanshi_output_table){0};
+}
+
 static struct kanshi_profile *parse_profile(struct scfg_directive *dir) {
 	struct kanshi_profile *profile = calloc(1, sizeof(*profile));
+	wl_list_init(&profile->link);
 	wl_list_init(&profile->outputs);
 	wl_list_init(&profile->commands);
 
 	if (dir->params_len > 1) {
-		fprintf(stderr, "directive 'profile': expected zero or one param\n");
-		fprintf(stderr, "(on line %d)\n", dir->lineno);
+		kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+			.line = dir->lineno,
+		}, "directive 'profile': expected zero or one param");
+		destroy_profile(profile);
 		return NULL;
 	}
 	if (dir->params_len > 0) {
@@ -300,75 +633,118 @@ static struct kanshi_profile *parse_profile(struct scfg_directive *dir) {
 		profile->name = strdup(generated_name);
 	}
 
+	// Outputs of the profile by name, to detect duplicates
+	struct kanshi_output_table outputs = {0};
+	// Pattern outputs are inserted right before this one
+	struct wl_list *first_wildcard = &profile->outputs;
+	unsigned int group = 0;
+	size_t group_len = 0;
 	for (size_t i = 0; i < dir->children.directives_len; i++) {
 		struct scfg_directive *child = &dir->children.directives[i];
 
 		if (strcmp(child->name, "output") == 0) {
 			struct kanshi_profile_output *output = parse_profile_output(child);
 			if (output == NULL) {
-				return NULL;
+				goto error;
 			}
 
 			// Disallow defining aliases in profile scope
 			if (output->alias != NULL) {
-				fprintf(stderr, "directive 'output': output aliases can only be defined in global scope\n");
-				fprintf(stderr, "(on line %d)\n", dir->lineno);
-				return NULL;
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': output aliases can only be defined in global scope");
+				destroy_output(output);
+				goto error;
 			}
 
 			// Check for duplicate outputs in profile
-			struct kanshi_profile_output *other_output;
-			wl_list_for_each(other_output, &profile->outputs, link) {
-				if (strcmp(output->name, other_output->name) == 0) {
-					fprintf(stderr, "directive 'output': duplicate output '%s' in profile\n", output->name);
-					fprintf(stderr, "(on line %d)\n", dir->lineno);
-					return NULL;
-				}
+			if (output_table_get(&outputs, output->name) != NULL) {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': duplicate output '%s' in profile", output->name);
+				destroy_output(output);
+				goto error;
+			}
+			if (!output_table_add(&outputs, output->name, output)) {
+				destroy_output(output);
+				goto error;
 			}
 
-			// Store wildcard outputs at the end of the list
+			// Store wildcard outputs at the end of the list, and pattern
+			// outputs right before them
 			if (strcmp(output->name, "*") == 0) {
 				wl_list_insert(profile->outputs.prev, &output->link);
+				if (first_wildcard == &profile->outputs) {
+					first_wildcard = &output->link;
+				}
+			} else if (output->patterns_len > 0) {
+				wl_list_insert(first_wildcard->prev, &output->link);
 			} else {
 				wl_list_insert(&profile->outputs, &output->link);
 			}
 		} else if (strcmp(child->name, "exec") == 0) {
 			struct kanshi_profile_command *command = parse_profile_exec(child);
 			if (command == NULL) {
-				return NULL;
+				goto error;
+			}
+			if (command->wait && group_len > 0) {
+				group++;
+				group_len = 0;
+			}
+			command->group = group;
+			group_len++;
+			if (command->wait) {
+				group++;
+				group_len = 0;
 			}
 			// Insert commands at the end to preserve order
 			wl_list_insert(profile->commands.prev, &command->link);
+		} else if (strcmp(child->name, "priority") == 0) {
+			if (child->params_len != 1 ||
+					!parse_int(&profile->priority, child->params[0])) {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = child->lineno,
+				}, "directive 'priority': expected an integer");
+				goto error;
+			}
 		} else {
-			fprintf(stderr, "profile '%s': unknown directive '%s'\n",
-				profile->name, child->name);
-			fprintf(stderr, "(on line %d)\n", child->lineno);
-			return NULL;
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.profile = profile->name,
+				.line = child->lineno,
+			}, "unknown directive '%s'", child->name);
+			goto error;
 		}
 	}
 
+	output_table_finish(&outputs);
 	return profile;
+
+error:
+	output_table_finish(&outputs);
+	destroy_profile(profile);
+	return NULL;
 }
 
 static bool parse_config_file(const char *path, struct kanshi_config *config);
 
 static bool parse_include_command(struct scfg_directive *dir, struct kanshi_config *config) {
 	if (dir->params_len != 1) {
-		fprintf(stderr, "directive 'include': expected exactly one parameter\n");
-		fprintf(stderr, "(on line %d)\n", dir->lineno);
+		kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+			.line = dir->lineno,
+		}, "directive 'include': expected exactly one parameter");
 		return false;
 	}
 
 	wordexp_t p;
 	if (wordexp(dir->params[0], &p, WRDE_SHOWERR | WRDE_UNDEF) != 0) {
-		fprintf(stderr, "Could not expand include path: '%s'\n", dir->params[0]);
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "Could not expand include path: '%s'", dir->params[0]);
 		return false;
 	}
 
 	char **w = p.we_wordv;
 	for (size_t idx = 0; idx < p.we_wordc; idx++) {
 		if (!parse_config_file(w[idx], config)) {
-			fprintf(stderr, "Could not parse included config: '%s'\n", w[idx]);
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "Could not parse included config: '%s'", w[idx]);
 			wordfree(&p);
 			return false;
 		}
@@ -395,36 +771,83 @@ static bool _parse_config(struct scfg_block *block, struct kanshi_config *config
 
 			// Disallow using wildcard outputs in global scope
 			if (strcmp(output_default->name, "*") == 0) {
-				fprintf(stderr, "directive 'output': wildcard outputs can only be used in profile scope\n");
-				fprintf(stderr, "(on line %d)\n", dir->lineno);
-				return NULL;
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': wildcard outputs can only be used in profile scope");
+				destroy_output(output_default);
+				return false;
+			}
+
+			// Disallow using patterns in global scope
+			if (output_default->patterns_len > 0) {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': output patterns can only be used in profile scope");
+				destroy_output(output_default);
+				return false;
 			}
 
 			// Disallow using aliases in global scope
 			if (output_default->name[0] == '$') {
-				fprintf(stderr, "directive 'output': output aliases can only be used in profile scope\n");
-				fprintf(stderr, "(on line %d)\n", dir->lineno);
-				return NULL;
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': output aliases can only be used in profile scope");
+				destroy_output(output_default);
+				return false;
 			}
 
 			// Check for duplicate outputs in global scope
-			struct kanshi_profile_output *other_output;
-			wl_list_for_each(other_output, &config->output_defaults, link) {
-				if (strcmp(output_default->name, other_output->name) == 0) {
-					fprintf(stderr, "directive 'output': duplicate output '%s' in global scope\n", output_default->name);
-					fprintf(stderr, "(on line %d)\n", dir->lineno);
-					return NULL;
-				}
+			if (output_table_get(&config->defaults_by_name,
+					output_default->name) != NULL) {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'output': duplicate output '%s' in global scope", output_default->name);
+				destroy_output(output_default);
+				return false;
 			}
 
+			// The first output default with an alias defines it. The
+			// config owns the output from now on, even on error
 			wl_list_insert(config->output_defaults.prev, &output_default->link);
+			if (!output_table_add(&config->defaults_by_name,
+					output_default->name, output_default) ||
+					(output_default->alias != NULL &&
+					!output_table_add(&config->defaults_by_alias,
+					output_default->alias, output_default))) {
+				return false;
+			}
 		} else if (strcmp(dir->name, "include") == 0) {
 			if (!parse_include_command(dir, config)) {
 				return false;
 			}
+		} else if (strcmp(dir->name, "profile_selection") == 0) {
+			const char *value = dir->params_len == 1 ? dir->params[0] : "";
+			if (strcmp(value, "first") == 0) {
+				config->profile_selection = KANSHI_SELECTION_FIRST;
+			} else if (strcmp(value, "best") == 0) {
+				config->profile_selection = KANSHI_SELECTION_BEST;
+			} else {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'profile_selection': expected 'first' or 'best'");
+				return false;
+			}
+		} else if (strcmp(dir->name, "apply_strategy") == 0) {
+			const char *value = dir->params_len == 1 ? dir->params[0] : "";
+			if (strcmp(value, "atomic") == 0) {
+				config->apply_strategy = KANSHI_APPLY_ATOMIC;
+			} else if (strcmp(value, "staged") == 0) {
+				config->apply_strategy = KANSHI_APPLY_STAGED;
+			} else {
+				kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+					.line = dir->lineno,
+				}, "directive 'apply_strategy': expected 'atomic' or 'staged'");
+				return false;
+			}
 		} else {
-			fprintf(stderr, "unknown directive '%s'\n", dir->name);
-			fprintf(stderr, "(on line %d)\n", dir->lineno);
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.line = dir->lineno,
+			}, "unknown directive '%s'", dir->name);
 			return false;
 		}
 	}
@@ -435,12 +858,13 @@ static bool _parse_config(struct scfg_block *block, struct kanshi_config *config
 static bool parse_config_file(const char *path, struct kanshi_config *config) {
 	struct scfg_block block = {0};
 	if (scfg_load_file(&block, path) != 0) {
-		fprintf(stderr, "failed to parse config file\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to parse config file");
 		return false;
 	}
 
 	if (!_parse_config(&block, config)) {
-		fprintf(stderr, "failed to parse config file\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to parse config file");
+		scfg_block_finish(&block);
 		return false;
 	}
 
@@ -472,33 +896,191 @@ static void apply_output_defaults(struct kanshi_profile_output *profile_output,
 	profile_output->fields |= output_default->fields;
 }
 
+static bool resolve_profile_output_defaults(struct kanshi_config *config,
+		struct kanshi_profile *profile) {
+	struct kanshi_profile_output *profile_output;
+	wl_list_for_each(profile_output, &profile->outputs, link) {
+		struct kanshi_profile_output *output_default;
+		if (profile_output->name[0] == '$') {
+			// check if profile output uses an alias
+			output_default = output_table_get(&config->defaults_by_alias,
+				profile_output->name);
+			if (output_default != NULL) {
+				free(profile_output->name);
+				profile_output->name = strdup(output_default->name);
+			}
+		} else {
+			output_default = output_table_get(&config->defaults_by_name,
+				profile_output->name);
+		}
+
+		// apply output defaults
+		if (output_default != NULL) {
+			apply_output_defaults(profile_output, output_default);
+		}
+
+		if (profile_output->name[0] == '$') {
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.profile = profile->name,
+			}, "use of undefined output alias '%s'", profile_output->name);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static bool resolve_output_defaults(struct kanshi_config *config) {
 	struct kanshi_profile *profile;
 	wl_list_for_each(profile, &config->profiles, link) {
-		struct kanshi_profile_output *profile_output;
-		wl_list_for_each(profile_output, &profile->outputs, link) {
-			struct kanshi_profile_output *output_default;
-			wl_list_for_each(output_default, &config->output_defaults, link) {
-				// check if profile output uses an alias
-				if (output_default->alias != NULL && strcmp(profile_output->name, output_default->alias) == 0) {
-					free(profile_output->name);
-					profile_output->name = strdup(output_default->name);
-				}
+		if (!resolve_profile_output_defaults(config, profile)) {
+			return false;
+		}
+	}
 
-				// apply output defaults
-				if (strcmp(profile_output->name, output_default->name) == 0) {
-					apply_output_defaults(profile_output, output_default);
-					break;
-				}
-			}
+	return true;
+}
 
-			if (profile_output->name[0] == '$') {
-				fprintf(stderr, "profile '%s': use of undefined output alias '%s'\n", profile->name, profile_output->name);
-				return false;
+struct profile_entry {
+	struct kanshi_profile *profile;
+	size_t outputs_len;
+	size_t order;
+};
+
+static int compare_profile_entries(const void *a, const void *b) {
+	const struct profile_entry *entry_a = a, *entry_b = b;
+	const struct kanshi_profile *profile_a = entry_a->profile;
+	const struct kanshi_profile *profile_b = entry_b->profile;
+	if (profile_a->priority != profile_b->priority) {
+		return profile_a->priority > profile_b->priority ? -1 : 1;
+	}
+	if (profile_a->max_score != profile_b->max_score) {
+		return profile_a->max_score > profile_b->max_score ? -1 : 1;
+	}
+	// Keep config order for ties
+	return entry_a->order < entry_b->order ? -1 : 1;
+}
+
+static int compare_profile_names(const void *a, const void *b) {
+	const struct profile_entry *entry_a = a, *entry_b = b;
+	int cmp = strcmp(entry_a->profile->name, entry_b->profile->name);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return entry_a->order < entry_b->order ? -1 : 1;
+}
+
+static void build_profile_index(struct kanshi_config *config) {
+	size_t profiles_len = wl_list_length(&config->profiles);
+	struct profile_entry *entries = calloc(profiles_len, sizeof(*entries));
+
+	size_t i = 0;
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &config->profiles, link) {
+		size_t outputs_len = 0;
+		profile->max_score = 0;
+		struct kanshi_profile_output *output;
+		wl_list_for_each(output, &profile->outputs, link) {
+			if (strcmp(output->name, "*") == 0) {
+				profile->max_score += KANSHI_MATCH_WILDCARD;
+			} else if (output->patterns_len > 0) {
+				profile->max_score += KANSHI_MATCH_PATTERN;
+			} else {
+				profile->max_score += KANSHI_MATCH_IDENTIFIER;
 			}
+			outputs_len++;
+		}
+		if (outputs_len >= config->buckets_len) {
+			config->buckets_len = outputs_len + 1;
+		}
+
+		entries[i].profile = profile;
+		entries[i].outputs_len = outputs_len;
+		entries[i].order = i;
+		i++;
+	}
+
+	qsort(entries, profiles_len, sizeof(*entries), compare_profile_entries);
+
+	config->buckets = calloc(config->buckets_len, sizeof(*config->buckets));
+	for (i = 0; i < profiles_len; i++) {
+		config->buckets[entries[i].outputs_len].len++;
+	}
+	for (i = 0; i < config->buckets_len; i++) {
+		struct kanshi_profile_bucket *bucket = &config->buckets[i];
+		bucket->profiles = calloc(bucket->len, sizeof(*bucket->profiles));
+		bucket->len = 0;
+	}
+	for (i = 0; i < profiles_len; i++) {
+		struct kanshi_profile_bucket *bucket =
+			&config->buckets[entries[i].outputs_len];
+		bucket->profiles[bucket->len++] = entries[i].profile;
+	}
+
+	qsort(entries, profiles_len, sizeof(*entries), compare_profile_names);
+	config->profiles_by_name =
+		calloc(profiles_len, sizeof(*config->profiles_by_name));
+	config->profiles_len = profiles_len;
+	for (i = 0; i < profiles_len; i++) {
+		config->profiles_by_name[i] = entries[i].profile;
+	}
+
+	free(entries);
+}
+
+struct kanshi_profile **find_profiles(struct kanshi_config *config,
+		const char *name, size_t *len) {
+	// Lower bound of name
+	size_t lo = 0, hi = config->profiles_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(config->profiles_by_name[mid]->name, name) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	size_t end = lo;
+	while (end < config->profiles_len &&
+			strcmp(config->profiles_by_name[end]->name, name) == 0) {
+		end++;
+	}
+	*len = end - lo;
+	return *len > 0 ? &config->profiles_by_name[lo] : NULL;
+}
+
+bool find_profile_list(struct kanshi_config *config,
+		const char *const *names, size_t names_len,
+		struct kanshi_profile ***profiles, size_t *len) {
+	size_t total = 0;
+	for (size_t i = 0; i < names_len; i++) {
+		size_t found_len;
+		if (find_profiles(config, names[i], &found_len) != NULL) {
+			total += found_len;
 		}
 	}
 
+	*profiles = NULL;
+	*len = 0;
+	if (total == 0) {
+		return true;
+	}
+	*profiles = calloc(total, sizeof(**profiles));
+	if (*profiles == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		return false;
+	}
+	for (size_t i = 0; i < names_len; i++) {
+		size_t found_len;
+		struct kanshi_profile **found =
+			find_profiles(config, names[i], &found_len);
+		if (found == NULL) {
+			continue;
+		}
+		memcpy(&(*profiles)[*len], found, found_len * sizeof(**profiles));
+		*len += found_len;
+	}
 	return true;
 }
 
@@ -510,26 +1092,71 @@ struct kanshi_config *parse_config(const char *path) {
 	wl_list_init(&config->output_defaults);
 	wl_list_init(&config->profiles);
 
-	if (!parse_config_file(path, config)) {
-		free(config);
+	if (!parse_config_file(path, config) ||
+			!resolve_output_defaults(config)) {
+		destroy_config(config);
 		return NULL;
 	}
 
-	if (!resolve_output_defaults(config)) {
-		free(config);
-		return NULL;
-	}
+	build_profile_index(config);
 
 	return config;
 }
 
+struct kanshi_profile *parse_inline_profile(struct kanshi_config *config,
+		const char *name, struct scfg_block *outputs) {
+	char *params[] = { (char *)name };
+	struct scfg_directive dir = {
+		.name = (char *)"profile",
+		.params = params,
+		.params_len = 1,
+		.children = *outputs,
+	};
+	struct kanshi_profile *profile = parse_profile(&dir);
+	if (profile == NULL) {
+		return NULL;
+	}
+	if (!resolve_profile_output_defaults(config, profile)) {
+		destroy_profile(profile);
+		return NULL;
+	}
+	return profile;
+}
+
 static void destroy_output(struct kanshi_profile_output *output) {
+	for (size_t i = 0; i < output->patterns_len; i++) {
+		struct kanshi_output_pattern *pattern = &output->patterns[i];
+		if (pattern->literal != NULL) {
+			free(pattern->literal);
+		} else {
+			regfree(&pattern->regex);
+		}
+	}
+	free(output->patterns);
 	free(output->name);
 	free(output->alias);
 	wl_list_remove(&output->link);
 	free(output);
 }
 
+void destroy_profile(struct kanshi_profile *profile) {
+	struct kanshi_profile_output *output, *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &profile->outputs, link) {
+		destroy_output(output);
+	}
+
+	struct kanshi_profile_command *cmd, *cmd_tmp;
+	wl_list_for_each_safe(cmd, cmd_tmp, &profile->commands, link) {
+		free(cmd->command);
+		wl_list_remove(&cmd->link);
+		free(cmd);
+	}
+
+	free(profile->name);
+	wl_list_remove(&profile->link);
+	free(profile);
+}
+
 void destroy_config(struct kanshi_config *config) {
 	struct kanshi_profile_output *output_default, *tmp_output_default;
 	wl_list_for_each_safe(output_default, tmp_output_default, &config->output_defaults, link) {
@@ -538,22 +1165,16 @@ void destroy_config(struct kanshi_config *config) {
 
 	struct kanshi_profile *profile, *profile_tmp;
 	wl_list_for_each_safe(profile, profile_tmp, &config->profiles, link) {
-		struct kanshi_profile_output *output, *output_tmp;
-		wl_list_for_each_safe(output, output_tmp, &profile->outputs, link) {
-			destroy_output(output);
-		}
-
-		struct kanshi_profile_command *cmd, *cmd_tmp;
-		wl_list_for_each_safe(cmd, cmd_tmp, &profile->commands, link) {
-			free(cmd->command);
-			wl_list_remove(&cmd->link);
-			free(cmd);
-		}
+		destroy_profile(profile);
+	}
 
-		free(profile->name);
-		wl_list_remove(&profile->link);
-		free(profile);
+	for (size_t i = 0; i < config->buckets_len; i++) {
+		free(config->buckets[i].profiles);
 	}
+	free(config->buckets);
+	free(config->profiles_by_name);
+	output_table_finish(&config->defaults_by_name);
+	output_table_finish(&config->defaults_by_alias);
 
 	free(config);
 }
@@ -0,0 +1,48 @@
+#include <stdio.h>
+
+#include "control.h"
+
+void kanshi_control_write_word(FILE *f, const char *word) {
+	for (const char *c = word; *c != '\0'; c++) {
+		switch (*c) {
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case ' ':
+		case '\\':
+			fputc('\\', f);
+			fputc(*c, f);
+			break;
+		default:
+			fputc(*c, f);
+		}
+	}
+}
+
+char *kanshi_control_next_word(char **line) {
+	char *src = *line;
+	while (*src == ' ') {
+		src++;
+	}
+	if (*src == '\0') {
+		*line = src;
+		return NULL;
+	}
+
+	char *word = src, *dst = src;
+	while (*src != '\0' && *src != ' ') {
+		if (*src == '\\' && src[1] != '\0') {
+			src++;
+			*dst++ = *src == 'n' ? '\n' : *src;
+			src++;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	if (*src == ' ') {
+		src++;
+	}
+	*dst = '\0';
+	*line = src;
+	return word;
+}
@@ -0,0 +1,493 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "control.h"
+#include "ipc.h"
+#include "kanshi.h"
+#include "log.h"
+
+#define MAX_CLIENTS 32
+// Stop reading requests from clients which don't read their replies
+#define MAX_OUTPUT_SIZE (64 * 1024)
+
+struct kanshi_control_server {
+	struct kanshi_state *state;
+	int listen_fd;
+	char *path;
+	struct wl_list clients;
+	size_t clients_len;
+};
+
+struct control_client {
+	struct kanshi_control_server *server;
+	struct wl_list link;
+	int fd; // -1 once the connection is closed
+
+	char in[KANSHI_CONTROL_LINE_MAX];
+	size_t in_len;
+	char *out;
+	size_t out_len, out_cap;
+
+	bool busy; // waiting for a reload or switch to complete
+	bool switching; // the request in progress is a switch
+	bool processing; // inside process_requests()
+	bool eof; // the client won't send more requests
+};
+
+static int set_nonblock_cloexec(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFD);
+	if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+static void close_client(struct control_client *client) {
+	if (client->fd < 0) {
+		return;
+	}
+	kanshi_remove_fd(client->server->state->ctx, client->fd);
+	close(client->fd);
+	client->fd = -1;
+}
+
+static void destroy_client(struct control_client *client) {
+	close_client(client);
+	wl_list_remove(&client->link);
+	client->server->clients_len--;
+	free(client->out);
+	free(client);
+}
+
+// A client with a request in progress is referenced by the apply callback,
+// it's only destroyed once the callback has run
+static bool maybe_destroy_client(struct control_client *client) {
+	bool done = client->eof && client->out_len == 0 &&
+		memchr(client->in, '\n', client->in_len) == NULL;
+	if ((client->fd >= 0 && !done) || client->busy || client->processing) {
+		return false;
+	}
+	destroy_client(client);
+	return true;
+}
+
+static void update_events(struct control_client *client) {
+	if (client->fd < 0) {
+		return;
+	}
+	short events = 0;
+	if (!client->busy && !client->eof &&
+			client->in_len < sizeof(client->in) &&
+			client->out_len < MAX_OUTPUT_SIZE) {
+		events |= POLLIN;
+	}
+	if (client->out_len > 0) {
+		events |= POLLOUT;
+	}
+	kanshi_update_fd(client->server->state->ctx, client->fd, events);
+}
+
+static void flush_output(struct control_client *client) {
+	size_t written = 0;
+	while (client->fd >= 0 && written < client->out_len) {
+		ssize_t n = send(client->fd, client->out + written,
+			client->out_len - written, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				close_client(client);
+			}
+			break;
+		}
+		written += (size_t)n;
+	}
+	if (client->fd < 0) {
+		client->out_len = 0;
+		return;
+	}
+	memmove(client->out, client->out + written, client->out_len - written);
+	client->out_len -= written;
+}
+
+static void append_output(struct control_client *client, const char *data,
+		size_t size) {
+	if (client->fd < 0) {
+		return;
+	}
+	if (client->out_len + size > client->out_cap) {
+		size_t cap = client->out_cap ? client->out_cap : 256;
+		while (cap < client->out_len + size) {
+			cap *= 2;
+		}
+		char *out = realloc(client->out, cap);
+		if (out == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "realloc: %s", strerror(errno));
+			close_client(client);
+			return;
+		}
+		client->out = out;
+		client->out_cap = cap;
+	}
+	memcpy(client->out + client->out_len, data, size);
+	client->out_len += size;
+}
+
+static void send_reply(struct control_client *client, const char *line) {
+	append_output(client, line, strlen(line));
+	append_output(client, "\n", 1);
+	flush_output(client);
+}
+
+static void send_error(struct control_client *client, const char *name) {
+	char line[128];
+	snprintf(line, sizeof(line), "error %s", name);
+	send_reply(client, line);
+}
+
+static void process_requests(struct control_client *client);
+
+static void request_done(void *data, enum kanshi_apply_result result,
+		struct kanshi_profile *profile) {
+	struct control_client *client = data;
+	client->busy = false;
+
+	switch (result) {
+	case KANSHI_APPLY_SUCCEEDED: {
+		char *line = NULL;
+		size_t line_size = 0;
+		FILE *f = open_memstream(&line, &line_size);
+		if (f == NULL) {
+			close_client(client);
+			break;
+		}
+		fputs("ok", f);
+		// The profile is NULL if the config has been reloaded in the meantime
+		if (client->switching && profile != NULL) {
+			fputc(' ', f);
+			kanshi_control_write_word(f, profile->name);
+		}
+		fclose(f);
+		send_reply(client, line);
+		free(line);
+		break;
+	}
+	case KANSHI_APPLY_FAILED:
+		send_error(client, "ProfileNotApplied");
+		break;
+	case KANSHI_APPLY_TIMED_OUT:
+		send_error(client, "ProfileTimedOut");
+		break;
+	case KANSHI_APPLY_NOT_MATCHED:
+		send_error(client, "ProfileNotMatched");
+		break;
+	case KANSHI_APPLY_SUPERSEDED:
+		send_error(client, "ProfileSuperseded");
+		break;
+	}
+
+	if (!client->processing) {
+		process_requests(client);
+	}
+}
+
+static void handle_switch(struct control_client *client, char *args) {
+	struct kanshi_state *state = client->server->state;
+
+	const char *names[KANSHI_CONTROL_LINE_MAX / 2];
+	size_t names_len = 0;
+	char *name;
+	while ((name = kanshi_control_next_word(&args)) != NULL) {
+		names[names_len++] = name;
+	}
+	if (names_len == 0) {
+		send_error(client, "InvalidRequest");
+		return;
+	}
+
+	struct kanshi_profile **candidates;
+	size_t candidates_len;
+	if (!find_profile_list(state->ctx->config, names, names_len,
+			&candidates, &candidates_len)) {
+		send_error(client, "InternalError");
+		return;
+	}
+	if (candidates_len == 0) {
+		send_error(client, "ProfileNotFound");
+		return;
+	}
+
+	client->busy = true;
+	client->switching = true;
+	if (!kanshi_switch_any(state, candidates, candidates_len,
+			request_done, client)) {
+		client->busy = false;
+		send_error(client, "ProfileNotMatched");
+	}
+	free(candidates);
+}
+
+static void handle_status(struct control_client *client) {
+	struct kanshi_state *state = client->server->state;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *f = open_memstream(&line, &line_size);
+	if (f == NULL) {
+		close_client(client);
+		return;
+	}
+	fputs("ok current=", f);
+	if (state->current_profile != NULL) {
+		kanshi_control_write_word(f, state->current_profile->name);
+	}
+	fputs(" pending=", f);
+	if (state->pending_profile != NULL) {
+		kanshi_control_write_word(f, state->pending_profile->name);
+	}
+	fprintf(f, " heads=%d", wl_list_length(&state->heads));
+	fprintf(f, " retries=%" PRIu64 " retries_exhausted=%" PRIu64
+		" retry_attempts=%u", state->retries, state->retries_exhausted,
+		state->retry_attempts);
+	fclose(f);
+	send_reply(client, line);
+	free(line);
+}
+
+static void handle_request(struct control_client *client, char *line) {
+	struct kanshi_state *state = client->server->state;
+
+	char *command = kanshi_control_next_word(&line);
+	if (command == NULL) {
+		return;
+	}
+
+	client->switching = false;
+	if (strcmp(command, "reload") == 0) {
+		client->busy = true;
+		if (!kanshi_reload_config(state, request_done, client)) {
+			client->busy = false;
+			send_error(client, "ProfileNotMatched");
+		}
+	} else if (strcmp(command, "switch") == 0) {
+		handle_switch(client, line);
+	} else if (strcmp(command, "status") == 0) {
+		handle_status(client);
+	} else {
+		send_error(client, "UnknownCommand");
+	}
+}
+
+static void process_requests(struct control_client *client) {
+	client->processing = true;
+	while (!client->busy && client->fd >= 0 &&
+			client->out_len < MAX_OUTPUT_SIZE) {
+		char *end = memchr(client->in, '\n', client->in_len);
+		if (end == NULL) {
+			if (client->in_len == sizeof(client->in)) {
+				send_error(client, "RequestTooLong");
+				close_client(client);
+			}
+			break;
+		}
+
+		size_t line_len = (size_t)(end - client->in);
+		char line[KANSHI_CONTROL_LINE_MAX];
+		memcpy(line, client->in, line_len);
+		line[line_len] = '\0';
+		memmove(client->in, end + 1, client->in_len - line_len - 1);
+		client->in_len -= line_len + 1;
+
+		handle_request(client, line);
+	}
+	client->processing = false;
+
+	if (!maybe_destroy_client(client)) {
+		update_events(client);
+	}
+}
+
+static void handle_client(void *data, int fd, short revents) {
+	struct control_client *client = data;
+
+	if (revents & POLLOUT) {
+		flush_output(client);
+	}
+
+	if (revents & POLLIN) {
+		while (client->fd >= 0 && client->in_len < sizeof(client->in)) {
+			ssize_t n = read(fd, client->in + client->in_len,
+				sizeof(client->in) - client->in_len);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN) {
+					close_client(client);
+				}
+				break;
+			}
+			if (n == 0) {
+				client->eof = true;
+				break;
+			}
+			client->in_len += (size_t)n;
+		}
+	} else if (revents & (POLLHUP | POLLERR)) {
+		// Nothing more can be read nor written
+		close_client(client);
+	}
+
+	process_requests(client);
+}
+
+static void handle_listen(void *data, int fd, short revents) {
+	struct kanshi_control_server *server = data;
+
+	while (true) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"accept on control socket failed: %s", strerror(errno));
+			}
+			return;
+		}
+		if (server->clients_len >= MAX_CLIENTS ||
+				set_nonblock_cloexec(client_fd) < 0) {
+			close(client_fd);
+			continue;
+		}
+
+		struct control_client *client = calloc(1, sizeof(*client));
+		if (client == NULL) {
+			close(client_fd);
+			continue;
+		}
+		client->server = server;
+		client->fd = client_fd;
+		if (!kanshi_add_fd(server->state->ctx, client_fd, POLLIN,
+				handle_client, client)) {
+			close(client_fd);
+			free(client);
+			continue;
+		}
+		wl_list_insert(&server->clients, &client->link);
+		server->clients_len++;
+	}
+}
+
+int kanshi_init_control(struct kanshi_state *state) {
+	char path[PATH_MAX];
+	if (get_control_address(path, sizeof(path), state->name) < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"control socket disabled, kanshictl won't be able to connect");
+		return 0;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "control socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (socket_in_use(&addr)) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "couldn't listen on control "
+				"socket %s, is the kanshi daemon already running?", path);
+			return -1;
+		}
+		// Remove a stale socket left behind by a previous instance
+		unlink(path);
+	}
+
+	struct kanshi_control_server *server = calloc(1, sizeof(*server));
+	if (server == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "calloc: %s", strerror(errno));
+		return -1;
+	}
+	server->state = state;
+	wl_list_init(&server->clients);
+	server->path = strdup(path);
+	if (server->path == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "strdup: %s", strerror(errno));
+		goto error;
+	}
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->listen_fd < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to create control socket: %s", strerror(errno));
+		goto error;
+	}
+	if (set_nonblock_cloexec(server->listen_fd) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fcntl failed on control socket: %s", strerror(errno));
+		goto error_fd;
+	}
+	if (bind(server->listen_fd, (void *)&addr, sizeof(addr)) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to bind control socket %s: %s", path, strerror(errno));
+		goto error_fd;
+	}
+	if (listen(server->listen_fd, MAX_CLIENTS) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to listen on control socket: %s", strerror(errno));
+		goto error_unlink;
+	}
+	if (!kanshi_add_fd(state->ctx, server->listen_fd, POLLIN, handle_listen,
+			server)) {
+		goto error_unlink;
+	}
+
+	state->control_server = server;
+	return 0;
+
+error_unlink:
+	unlink(path);
+error_fd:
+	close(server->listen_fd);
+error:
+	free(server->path);
+	free(server);
+	return -1;
+}
+
+void kanshi_finish_control(struct kanshi_state *state) {
+	struct kanshi_control_server *server = state->control_server;
+	if (server == NULL) {
+		return;
+	}
+
+	struct control_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &server->clients, link) {
+		destroy_client(client);
+	}
+	kanshi_remove_fd(state->ctx, server->listen_fd);
+	close(server->listen_fd);
+	unlink(server->path);
+	free(server->path);
+	free(server);
+	state->control_server = NULL;
+}
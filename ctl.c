@@ -1,39 +1,508 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if KANSHI_HAS_VARLINK
 #include <varlink.h>
+#endif
 
+#include "control.h"
 #include "ipc.h"
+#include "status.h"
 
 static void usage(void) {
 	fprintf(stderr, "Usage: kanshictl [command]\n"
 		"\n"
 		"Commands:\n"
-		"  reload            Reload the configuration file\n"
-		"  switch <profile>  Switch to another profile\n");
+		"  reload                 Reload the configuration file\n"
+		"  switch <profile>...    Switch to the first matching profile\n"
+		"  status                 Print the current and pending profiles\n"
+		"  peek                   Print the profiles and outputs without\n"
+		"                         contacting the daemon\n"
+		"  batch [<request>...]   Send requests given as arguments or on stdin\n"
+		"  apply <outputs>        Apply a profile given as a JSON array of outputs\n"
+		"  log                    Print recent daemon log messages\n");
 }
 
+// Error names are shared by the varlink interface and the control socket
+static void print_error(const char *error) {
+	if (strcmp(error, "ProfileNotFound") == 0) {
+		fprintf(stderr, "Profile not found\n");
+	} else if (strcmp(error, "ProfileNotMatched") == 0) {
+		fprintf(stderr, "Profile does not match the current output configuration\n");
+	} else if (strcmp(error, "ProfileNotApplied") == 0) {
+		fprintf(stderr, "Profile could not be applied by the compositor\n");
+	} else if (strcmp(error, "InvalidProfile") == 0) {
+		fprintf(stderr, "Invalid profile\n");
+	} else if (strcmp(error, "ProfileSuperseded") == 0) {
+		fprintf(stderr, "Request superseded by a newer one before being applied\n");
+	} else if (strcmp(error, "ProfileTimedOut") == 0) {
+		fprintf(stderr, "Compositor did not answer the configuration in time\n");
+	} else {
+		fprintf(stderr, "Error: %s\n", error);
+	}
+}
+
+struct control_connection {
+	int fd;
+	char buf[KANSHI_CONTROL_LINE_MAX];
+	size_t len;
+};
+
+static bool control_connect(struct control_connection *conn) {
+	char path[PATH_MAX];
+	if (get_control_address(path, sizeof(path), NULL) < 0) {
+		return false;
+	}
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	conn->len = 0;
+	conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0) {
+		return false;
+	}
+	if (connect(conn->fd, (void *)&addr, sizeof(addr)) < 0) {
+		close(conn->fd);
+		return false;
+	}
+	return true;
+}
+
+static bool control_send(struct control_connection *conn, int argc,
+		char *argv[]) {
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *f = open_memstream(&line, &line_size);
+	if (f == NULL) {
+		return false;
+	}
+	for (int i = 0; i < argc; i++) {
+		if (i > 0) {
+			fputc(' ', f);
+		}
+		kanshi_control_write_word(f, argv[i]);
+	}
+	fputc('\n', f);
+	fclose(f);
+
+	const char *data = line;
+	size_t size = line_size;
+	while (size > 0) {
+		ssize_t n = send(conn->fd, data, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "failed to send request: %s\n", strerror(errno));
+			free(line);
+			return false;
+		}
+		data += n;
+		size -= (size_t)n;
+	}
+	free(line);
+	return true;
+}
+
+// Returns the next buffered reply line, valid until the next call, or NULL
+// if there's no complete line
+static char *control_next_line(struct control_connection *conn) {
+	static char line[KANSHI_CONTROL_LINE_MAX];
+	char *end = memchr(conn->buf, '\n', conn->len);
+	if (end == NULL) {
+		return NULL;
+	}
+	size_t line_len = (size_t)(end - conn->buf);
+	memcpy(line, conn->buf, line_len);
+	line[line_len] = '\0';
+	conn->len -= line_len + 1;
+	memmove(conn->buf, end + 1, conn->len);
+	return line;
+}
+
+static bool control_read(struct control_connection *conn) {
+	if (conn->len == sizeof(conn->buf)) {
+		fprintf(stderr, "reply too long\n");
+		return false;
+	}
+	while (true) {
+		ssize_t n = read(conn->fd, conn->buf + conn->len,
+			sizeof(conn->buf) - conn->len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			fprintf(stderr, "connection to kanshi closed\n");
+			return false;
+		}
+		conn->len += (size_t)n;
+		return true;
+	}
+}
+
+static char *control_receive(struct control_connection *conn) {
+	char *line;
+	while ((line = control_next_line(conn)) == NULL) {
+		if (!control_read(conn)) {
+			return NULL;
+		}
+	}
+	return line;
+}
+
+// Prints the result of a request, returns false if it failed
+static bool print_control_reply(const char *command, char *reply,
+		bool print_profile) {
+	char *status = kanshi_control_next_word(&reply);
+	if (status != NULL && strcmp(status, "error") == 0) {
+		char *error = kanshi_control_next_word(&reply);
+		print_error(error != NULL ? error : "");
+		return false;
+	}
+	if (status == NULL || strcmp(status, "ok") != 0) {
+		fprintf(stderr, "Invalid reply\n");
+		return false;
+	}
+
+	char *word;
+	if (strcmp(command, "switch") == 0) {
+		word = kanshi_control_next_word(&reply);
+		if (print_profile && word != NULL) {
+			printf("%s\n", word);
+		}
+	} else if (strcmp(command, "status") == 0) {
+		while ((word = kanshi_control_next_word(&reply)) != NULL) {
+			char *value = strchr(word, '=');
+			if (value != NULL) {
+				*value++ = '\0';
+				printf("%s: %s\n", word, value);
+			}
+		}
+	}
+	return true;
+}
+
+static int run_control_command(struct control_connection *conn, int argc,
+		char *argv[]) {
+	char *reply;
+	if (!control_send(conn, argc, argv) ||
+			(reply = control_receive(conn)) == NULL) {
+		close(conn->fd);
+		return EXIT_FAILURE;
+	}
+	bool ok = print_control_reply(argv[0], reply, argc > 2);
+	close(conn->fd);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct batch {
+	struct control_connection *conn;
+	// Requests not sent yet
+	char *out;
+	size_t out_len, out_cap;
+	// Incomplete line read from stdin
+	char in[KANSHI_CONTROL_LINE_MAX];
+	size_t in_len;
+	size_t pending; // requests waiting for a reply
+	bool failed;
+};
+
+static bool batch_queue(struct batch *batch, const char *line, size_t len) {
+	// The daemon doesn't reply to blank lines
+	size_t i = 0;
+	while (i < len && line[i] == ' ') {
+		i++;
+	}
+	if (i == len) {
+		return true;
+	}
+	if (len >= KANSHI_CONTROL_LINE_MAX) {
+		fprintf(stderr, "request too long\n");
+		return false;
+	}
+	if (batch->out_len + len + 1 > batch->out_cap) {
+		size_t cap = batch->out_cap ? batch->out_cap : 1024;
+		while (cap < batch->out_len + len + 1) {
+			cap *= 2;
+		}
+		char *out = realloc(batch->out, cap);
+		if (out == NULL) {
+			fprintf(stderr, "realloc failed\n");
+			return false;
+		}
+		batch->out = out;
+		batch->out_cap = cap;
+	}
+	memcpy(batch->out + batch->out_len, line, len);
+	batch->out[batch->out_len + len] = '\n';
+	batch->out_len += len + 1;
+	batch->pending++;
+	return true;
+}
+
+// Reads requests from stdin, returns false on error and sets *eof once
+// everything has been read
+static bool batch_read_stdin(struct batch *batch, bool *eof) {
+	ssize_t n = read(STDIN_FILENO, batch->in + batch->in_len,
+		sizeof(batch->in) - batch->in_len);
+	if (n < 0) {
+		if (errno == EINTR) {
+			return true;
+		}
+		fprintf(stderr, "failed to read stdin: %s\n", strerror(errno));
+		return false;
+	}
+	if (n == 0) {
+		*eof = true;
+		bool ok = batch_queue(batch, batch->in, batch->in_len);
+		batch->in_len = 0;
+		return ok;
+	}
+	batch->in_len += (size_t)n;
+
+	char *start = batch->in, *end;
+	while ((end = memchr(start, '\n',
+			batch->in_len - (size_t)(start - batch->in))) != NULL) {
+		if (!batch_queue(batch, start, (size_t)(end - start))) {
+			return false;
+		}
+		start = end + 1;
+	}
+	batch->in_len -= (size_t)(start - batch->in);
+	memmove(batch->in, start, batch->in_len);
+	// A full buffer without a newline can't hold a valid request
+	return batch_queue(batch, batch->in,
+		batch->in_len == sizeof(batch->in) ? batch->in_len : 0);
+}
+
+// Sends each argument, or each line of stdin if there are none, as a request
+// and prints the replies in order, while they're coming
+static int run_batch(struct control_connection *conn, int argc, char *argv[]) {
+	struct batch batch = { .conn = conn };
+	bool input_done = argc > 0, shut = false;
+	for (int i = 0; i < argc; i++) {
+		if (!batch_queue(&batch, argv[i], strlen(argv[i]))) {
+			goto error;
+		}
+	}
+
+	while (!input_done || batch.out_len > 0 || batch.pending > 0) {
+		if (input_done && batch.out_len == 0 && !shut) {
+			shutdown(conn->fd, SHUT_WR);
+			shut = true;
+		}
+
+		struct pollfd fds[] = {
+			{ .fd = conn->fd, .events = POLLIN },
+			// Stop reading stdin while the daemon doesn't keep up
+			{ .fd = input_done || batch.out_len > 65536 ? -1 : STDIN_FILENO,
+				.events = POLLIN },
+		};
+		if (batch.out_len > 0) {
+			fds[0].events |= POLLOUT;
+		}
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			goto error;
+		}
+
+		if (fds[1].revents != 0 && !batch_read_stdin(&batch, &input_done)) {
+			goto error;
+		}
+		if (fds[0].revents & POLLOUT) {
+			ssize_t n = send(conn->fd, batch.out, batch.out_len,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "failed to send request: %s\n",
+					strerror(errno));
+				goto error;
+			}
+			if (n > 0) {
+				batch.out_len -= (size_t)n;
+				memmove(batch.out, batch.out + n, batch.out_len);
+			}
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (!control_read(conn)) {
+				goto error;
+			}
+			char *reply;
+			while ((reply = control_next_line(conn)) != NULL) {
+				if (strncmp(reply, "ok", 2) != 0) {
+					batch.failed = true;
+				}
+				printf("%s\n", reply);
+				fflush(stdout);
+				batch.pending--;
+			}
+		}
+	}
+
+	free(batch.out);
+	close(conn->fd);
+	return batch.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+error:
+	free(batch.out);
+	close(conn->fd);
+	return EXIT_FAILURE;
+}
+
+static const char *transform_names[] = {
+	"normal", "90", "180", "270",
+	"flipped", "flipped-90", "flipped-180", "flipped-270",
+};
+
+// Reads the status file published by the daemon, see status.h
+static int run_peek(void) {
+	char path[PATH_MAX];
+	if (get_status_address(path, sizeof(path), NULL) < 0) {
+		return EXIT_FAILURE;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s: %s\n"
+			"Is the kanshi daemon running?\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct kanshi_status)) {
+		fprintf(stderr, "Invalid status file\n");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	const struct kanshi_status *shared = mmap(NULL, sizeof(*shared), PROT_READ,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct kanshi_status status;
+	bool ok = kanshi_status_read(shared, &status);
+	munmap((void *)shared, sizeof(*shared));
+	if (!ok) {
+		fprintf(stderr, "Invalid status file\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("current: %s\n", status.current_profile);
+	printf("pending: %s\n", status.pending_profile);
+	for (uint32_t i = 0; i < status.heads_len; i++) {
+		const struct kanshi_status_head *head = &status.heads[i];
+		if (!head->enabled) {
+			printf("%s: disabled\n", head->name);
+			continue;
+		}
+		const char *transform = "unknown";
+		if (head->transform >= 0 && (size_t)head->transform <
+				sizeof(transform_names) / sizeof(transform_names[0])) {
+			transform = transform_names[head->transform];
+		}
+		printf("%s: %" PRId32 "x%" PRId32 "@%.3fHz at %" PRId32 ",%" PRId32
+			" scale %g transform %s%s\n", head->name, head->width,
+			head->height, (double)head->refresh / 1000, head->x, head->y,
+			head->scale, transform,
+			head->adaptive_sync ? " adaptive-sync" : "");
+	}
+	return EXIT_SUCCESS;
+}
+
+#if KANSHI_HAS_VARLINK
 static long handle_call_done(VarlinkConnection *connection, const char *error,
 		VarlinkObject *parameters, uint64_t flags, void *userdata) {
 	if (error != NULL) {
-		if (strcmp(error, "fr.emersion.kanshi.ProfileNotFound") == 0) {
-			fprintf(stderr, "Profile not found\n");
-		} else if (strcmp(error, "fr.emersion.kanshi.ProfileNotMatched") == 0) {
-			fprintf(stderr, "Profile does not match the current output configuration\n");
-		} else if (strcmp(error, "fr.emersion.kanshi.ProfileNotApplied") == 0) {
-			fprintf(stderr, "Profile could not be applied by the compositor\n");
+		const char *prefix = "fr.emersion.kanshi.";
+		if (strcmp(error, "org.varlink.service.InvalidParameter") == 0) {
+			fprintf(stderr, "Invalid outputs\n");
+		} else if (strncmp(error, prefix, strlen(prefix)) == 0) {
+			print_error(error + strlen(prefix));
 		} else {
-			fprintf(stderr, "Error: %s\n", error);
+			print_error(error);
 		}
 		exit(EXIT_FAILURE);
 	}
 	return varlink_connection_close(connection);
 }
 
+// userdata is non-NULL when several profiles were given
+static long handle_switch_done(VarlinkConnection *connection,
+		const char *error, VarlinkObject *parameters, uint64_t flags,
+		void *userdata) {
+	const char *profile;
+	if (error == NULL && userdata != NULL &&
+			varlink_object_get_string(parameters, "profile", &profile) == 0) {
+		printf("%s\n", profile);
+	}
+	return handle_call_done(connection, error, parameters, flags, userdata);
+}
+
+static long handle_log_done(VarlinkConnection *connection, const char *error,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	if (error != NULL) {
+		return handle_call_done(connection, error, parameters, flags, userdata);
+	}
+
+	VarlinkArray *entries;
+	if (varlink_object_get_array(parameters, "entries", &entries) < 0) {
+		fprintf(stderr, "Invalid reply\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned long n = varlink_array_get_n_elements(entries);
+	for (unsigned long i = 0; i < n; i++) {
+		VarlinkObject *entry;
+		if (varlink_array_get_object(entries, i, &entry) < 0) {
+			continue;
+		}
+		double time = 0;
+		const char *level = "", *message = "", *value;
+		int64_t num;
+		varlink_object_get_float(entry, "time", &time);
+		varlink_object_get_string(entry, "level", &level);
+		varlink_object_get_string(entry, "message", &message);
+		printf("%.6f %s: %s", time, level, message);
+		if (varlink_object_get_string(entry, "profile", &value) == 0) {
+			printf(" profile=\"%s\"", value);
+		}
+		if (varlink_object_get_string(entry, "head", &value) == 0) {
+			printf(" head=\"%s\"", value);
+		}
+		if (varlink_object_get_int(entry, "serial", &num) == 0) {
+			printf(" serial=%lld", (long long)num);
+		}
+		if (varlink_object_get_int(entry, "line", &num) == 0) {
+			printf(" line=%lld", (long long)num);
+		}
+		printf("\n");
+	}
+
+	int64_t dropped;
+	if (varlink_object_get_int(parameters, "dropped", &dropped) == 0 &&
+			dropped > 0) {
+		printf("%lld messages could not be written to the daemon's stderr\n",
+			(long long)dropped);
+	}
+	return varlink_connection_close(connection);
+}
+
 static int set_blocking(int fd) {
 	int flags = fcntl(fd, F_GETFL);
 	if (flags == -1) {
@@ -66,19 +535,10 @@ static int wait_for_event(VarlinkConnection *connection) {
 	return 0;
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		usage();
-		return EXIT_FAILURE;
-	}
-	if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
-		usage();
-		return EXIT_SUCCESS;
-	}
-
+static int run_varlink_command(int argc, char *argv[]) {
 	VarlinkConnection *connection;
 	char address[PATH_MAX];
-	if (get_ipc_address(address, sizeof(address)) < 0) {
+	if (get_ipc_address(address, sizeof(address), NULL) < 0) {
 		return EXIT_FAILURE;
 	}
 	if (varlink_connection_new(&connection, address) != 0) {
@@ -88,6 +548,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	const char *command = argv[1];
+	bool multiple = argc > 3;
 	long ret;
 	if (strcmp(command, "reload") == 0) {
 		ret = varlink_connection_call(connection,
@@ -97,14 +558,48 @@ int main(int argc, char *argv[]) {
 			usage();
 			return EXIT_FAILURE;
 		}
-		const char *profile = argv[2];
 
 		VarlinkObject *params = NULL;
 		varlink_object_new(&params);
-		varlink_object_set_string(params, "profile", profile);
+		if (multiple) {
+			VarlinkArray *profiles = NULL;
+			varlink_array_new(&profiles);
+			for (int i = 2; i < argc; i++) {
+				varlink_array_append_string(profiles, argv[i]);
+			}
+			varlink_object_set_array(params, "profiles", profiles);
+			varlink_array_unref(profiles);
+		} else {
+			varlink_object_set_string(params, "profile", argv[2]);
+		}
+		ret = varlink_connection_call(connection, "fr.emersion.kanshi.Switch",
+			params, 0, handle_switch_done, multiple ? &multiple : NULL);
+		varlink_object_unref(params);
+	} else if (strcmp(command, "apply") == 0) {
+		if (argc < 3) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		char *json = NULL;
+		size_t json_size = 0;
+		FILE *f = open_memstream(&json, &json_size);
+		fprintf(f, "{\"outputs\": %s}", argv[2]);
+		fclose(f);
+		VarlinkObject *params = NULL;
+		long result = varlink_object_new_from_json(&params, json);
+		free(json);
+		if (result < 0) {
+			fprintf(stderr, "invalid JSON outputs: %s\n",
+				varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
 		ret = varlink_connection_call(connection,
-			"fr.emersion.kanshi.Switch", params, 0, handle_call_done, NULL);
+			"fr.emersion.kanshi.Apply", params, 0, handle_call_done, NULL);
 		varlink_object_unref(params);
+	} else if (strcmp(command, "log") == 0) {
+		ret = varlink_connection_call(connection,
+			"fr.emersion.kanshi.Log", NULL, 0, handle_log_done, NULL);
 	} else {
 		fprintf(stderr, "invalid command: %s\n", argv[1]);
 		usage();
@@ -118,3 +613,64 @@ int main(int argc, char *argv[]) {
 
 	return wait_for_event(connection);
 }
+#endif
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		usage();
+		return EXIT_SUCCESS;
+	}
+
+	const char *command = argv[1];
+	if (strcmp(command, "switch") == 0 && argc < 3) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (strcmp(command, "batch") == 0) {
+		struct control_connection conn;
+		if (!control_connect(&conn)) {
+			fprintf(stderr, "Couldn't connect to kanshi.\n"
+				"Is the kanshi daemon running?\n");
+			return EXIT_FAILURE;
+		}
+		return run_batch(&conn, argc - 2, argv + 2);
+	}
+	if (strcmp(command, "peek") == 0) {
+		return run_peek();
+	}
+	// These are served on the control socket, which has less overhead than
+	// varlink and is available without it
+	if (strcmp(command, "reload") == 0 || strcmp(command, "switch") == 0 ||
+			strcmp(command, "status") == 0) {
+		struct control_connection conn;
+		if (control_connect(&conn)) {
+			return run_control_command(&conn, argc - 1, argv + 1);
+		}
+#if KANSHI_HAS_VARLINK
+		// Daemons predating the control socket only speak varlink
+		if (strcmp(command, "status") != 0) {
+			return run_varlink_command(argc, argv);
+		}
+#endif
+		fprintf(stderr, "Couldn't connect to kanshi.\n"
+			"Is the kanshi daemon running?\n");
+		return EXIT_FAILURE;
+	}
+
+#if KANSHI_HAS_VARLINK
+	return run_varlink_command(argc, argv);
+#else
+	if (strcmp(command, "apply") == 0 || strcmp(command, "log") == 0) {
+		fprintf(stderr, "%s requires kanshictl to be built with varlink "
+			"support\n", command);
+	} else {
+		fprintf(stderr, "invalid command: %s\n", command);
+		usage();
+	}
+	return EXIT_FAILURE;
+#endif
+}
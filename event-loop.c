@@ -1,13 +1,18 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "exec.h"
 #include "kanshi.h"
+#include "log.h"
 
 #if KANSHI_HAS_VARLINK
 #include <varlink.h>
@@ -16,22 +21,26 @@
 static int set_pipe_flags(int fd) {
 	int flags = fcntl(fd, F_GETFL);
 	if (flags == -1) {
-		perror("fnctl F_GETFL failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl F_GETFL failed: %s", strerror(errno));
 		return -1;
 	}
 	flags |= O_NONBLOCK;
 	if (fcntl(fd, F_SETFL, flags) == -1) {
-		perror("fnctl F_SETFL failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl F_SETFL failed: %s", strerror(errno));
 		return -1;
 	}
 	flags = fcntl(fd, F_GETFD);
 	if (flags == -1) {
-		perror("fnctl F_GETFD failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl F_GETFD failed: %s", strerror(errno));
 		return -1;
 	}
 	flags |= O_CLOEXEC;
 	if (fcntl(fd, F_SETFD, flags) == -1) {
-		perror("fnctl F_SETFD failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl F_SETFD failed: %s", strerror(errno));
 		return -1;
 	}
 	return 0;
@@ -45,18 +54,187 @@ static void signal_handler(int signum) {
 	}
 }
 
-enum readfds_type {
-	FD_WAYLAND,
-	FD_SIGNAL,
+static volatile sig_atomic_t child_exited = 0;
+
+static void sigchld_handler(int signum) {
+	int saved_errno = errno;
+	child_exited = 1;
+	// A full pipe already wakes up the loop, which then reaps the commands
+	if (write(signal_pipefds[1], &signum, sizeof(signum)) == -1 &&
+			errno != EAGAIN) {
+		abort();
+	}
+	errno = saved_errno;
+}
+
+bool kanshi_add_fd(struct kanshi_context *ctx, int fd, short events,
+		kanshi_fd_handler_func func, void *data) {
+	if (ctx->fd_handlers_len == ctx->fd_handlers_cap) {
+		size_t cap = ctx->fd_handlers_cap ? ctx->fd_handlers_cap * 2 : 8;
+		struct kanshi_fd_handler *handlers =
+			realloc(ctx->fd_handlers, cap * sizeof(*handlers));
+		if (handlers == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "realloc: %s", strerror(errno));
+			return false;
+		}
+		ctx->fd_handlers = handlers;
+		ctx->fd_handlers_cap = cap;
+	}
+	ctx->fd_handlers[ctx->fd_handlers_len++] = (struct kanshi_fd_handler){
+		.fd = fd,
+		.events = events,
+		.func = func,
+		.data = data,
+	};
+	return true;
+}
+
+static struct kanshi_fd_handler *find_fd_handler(struct kanshi_context *ctx,
+		int fd) {
+	for (size_t i = 0; i < ctx->fd_handlers_len; i++) {
+		if (ctx->fd_handlers[i].fd == fd) {
+			return &ctx->fd_handlers[i];
+		}
+	}
+	return NULL;
+}
+
+void kanshi_update_fd(struct kanshi_context *ctx, int fd, short events) {
+	struct kanshi_fd_handler *handler = find_fd_handler(ctx, fd);
+	if (handler != NULL) {
+		handler->events = events;
+	}
+}
+
+void kanshi_remove_fd(struct kanshi_context *ctx, int fd) {
+	struct kanshi_fd_handler *handler = find_fd_handler(ctx, fd);
+	if (handler == NULL) {
+		return;
+	}
+	size_t i = handler - ctx->fd_handlers;
+	memmove(&ctx->fd_handlers[i], &ctx->fd_handlers[i + 1],
+		(ctx->fd_handlers_len - i - 1) * sizeof(*handler));
+	ctx->fd_handlers_len--;
+}
+
+void kanshi_timer_init(struct kanshi_timer *timer, kanshi_timer_func func,
+		void *data) {
+	*timer = (struct kanshi_timer){
+		.func = func,
+		.data = data,
+	};
+	wl_list_init(&timer->link);
+}
+
+void kanshi_timer_arm(struct kanshi_context *ctx, struct kanshi_timer *timer,
+		int timeout_ms) {
+	kanshi_timer_disarm(timer);
+	clock_gettime(CLOCK_MONOTONIC, &timer->deadline);
+	timer->deadline.tv_sec += timeout_ms / 1000;
+	timer->deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (timer->deadline.tv_nsec >= 1000000000) {
+		timer->deadline.tv_sec++;
+		timer->deadline.tv_nsec -= 1000000000;
+	}
+	wl_list_insert(&ctx->timers, &timer->link);
+	timer->armed = true;
+}
+
+void kanshi_timer_disarm(struct kanshi_timer *timer) {
+	if (!timer->armed) {
+		return;
+	}
+	wl_list_remove(&timer->link);
+	wl_list_init(&timer->link);
+	timer->armed = false;
+}
+
+static bool timer_expired(const struct kanshi_timer *timer,
+		const struct timespec *now) {
+	return timer->deadline.tv_sec < now->tv_sec ||
+		(timer->deadline.tv_sec == now->tv_sec &&
+		timer->deadline.tv_nsec <= now->tv_nsec);
+}
+
+// Returns the poll() timeout until the next deadline, -1 if no timer is armed
+static int next_timeout(struct kanshi_context *ctx) {
+	if (wl_list_empty(&ctx->timers)) {
+		return -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t timeout = INT_MAX;
+	struct kanshi_timer *timer;
+	wl_list_for_each(timer, &ctx->timers, link) {
+		int64_t ns = (int64_t)(timer->deadline.tv_sec - now.tv_sec) *
+			1000000000 + (timer->deadline.tv_nsec - now.tv_nsec);
+		// Round up, so that the timer has expired when poll() returns
+		int64_t ms = ns <= 0 ? 0 : (ns + 999999) / 1000000;
+		if (ms < timeout) {
+			timeout = ms;
+		}
+	}
+	return (int)timeout;
+}
+
+static void dispatch_timers(struct kanshi_context *ctx) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bool fired;
+	do {
+		fired = false;
+		struct kanshi_timer *timer;
+		wl_list_for_each(timer, &ctx->timers, link) {
+			if (timer_expired(timer, &now)) {
+				kanshi_timer_disarm(timer);
+				timer->func(timer->data);
+				// The callback may have armed or disarmed other timers
+				fired = true;
+				break;
+			}
+		}
+	} while (fired);
+}
+
 #if KANSHI_HAS_VARLINK
-	FD_VARLINK,
+#define FDS_PER_DISPLAY 2 // Wayland display and varlink service
+#else
+#define FDS_PER_DISPLAY 1
 #endif
-	FD_COUNT,
-};
 
-int kanshi_main_loop(struct kanshi_state *state) {
+// Returns false if the display can't be read from, in which case no read has
+// been prepared
+static bool prepare_display(struct kanshi_state *state) {
+	while (wl_display_prepare_read(state->display) != 0) {
+		if (wl_display_dispatch_pending(state->display) == -1) {
+			return false;
+		}
+	}
+
+	int ret;
+	while (true) {
+		ret = wl_display_flush(state->display);
+		if (ret != -1 || errno != EAGAIN) {
+			break;
+		}
+	}
+	if (ret < 0 && errno != EPIPE) {
+		wl_display_cancel_read(state->display);
+		return false;
+	}
+	return true;
+}
+
+static void display_failed(struct kanshi_state *state) {
+	kanshi_log(KANSHI_LOG_ERROR, NULL, "lost connection to display %s: %s",
+		state->name != NULL ? state->name : "(default)", strerror(errno));
+	state->failed = true;
+}
+
+int kanshi_main_loop(struct kanshi_context *ctx) {
 	if (pipe(signal_pipefds) == -1) {
-		perror("read from signalfd failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"read from signalfd failed: %s", strerror(errno));
 		return EXIT_FAILURE;
 	}
 	if (set_pipe_flags(signal_pipefds[0]) == -1) {
@@ -74,65 +252,138 @@ int kanshi_main_loop(struct kanshi_state *state) {
 	sigaction(SIGQUIT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGHUP, &action, NULL);
+	// Profile commands are reaped from the loop, don't interrupt other
+	// system calls for them
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	action.sa_handler = sigchld_handler;
+	sigaction(SIGCHLD, &action, NULL);
+	// Commands may have exited before the handler was installed
+	kanshi_exec_reap(ctx);
 
-	struct pollfd readfds[FD_COUNT] = {0};
-	readfds[FD_WAYLAND].fd = wl_display_get_fd(state->display);
-	readfds[FD_WAYLAND].events = POLLIN;
-	readfds[FD_SIGNAL].fd = signal_pipefds[0];
-	readfds[FD_SIGNAL].events = POLLIN;
-#if KANSHI_HAS_VARLINK
-	readfds[FD_VARLINK].fd = varlink_service_get_fd(state->service);
-	readfds[FD_VARLINK].events = POLLIN;
-#endif
+	// The signal pipe first, followed by FDS_PER_DISPLAY entries per display
+	// and one entry per registered handler
+	struct pollfd *readfds = NULL;
+	size_t readfds_cap = 0;
+	int ret_code = EXIT_SUCCESS;
+	struct kanshi_state *state, *tmp;
 
-	while (state->running) {
-		while (wl_display_prepare_read(state->display) != 0) {
-			if (wl_display_dispatch_pending(state->display) == -1) {
-				return EXIT_FAILURE;
+	while (ctx->running) {
+		size_t displays_len = (size_t)wl_list_length(&ctx->displays);
+		size_t handlers_start = 1 + displays_len * FDS_PER_DISPLAY;
+		size_t nfds = handlers_start + ctx->fd_handlers_len;
+		if (nfds > readfds_cap) {
+			struct pollfd *fds = realloc(readfds, nfds * sizeof(*fds));
+			if (fds == NULL) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"realloc: %s", strerror(errno));
+				ret_code = EXIT_FAILURE;
+				goto out;
 			}
+			readfds = fds;
+			readfds_cap = nfds;
 		}
-
-		int ret;
-
-		while (true) {
-			ret = wl_display_flush(state->display);
-			if (ret != -1 || errno != EAGAIN) {
-				break;
-			}
+		readfds[0] = (struct pollfd){
+			.fd = signal_pipefds[0],
+			.events = POLLIN,
+		};
+		size_t i = 1;
+		wl_list_for_each(state, &ctx->displays, link) {
+			readfds[i++] = (struct pollfd){
+				.fd = wl_display_get_fd(state->display),
+				.events = POLLIN,
+			};
+#if KANSHI_HAS_VARLINK
+			readfds[i++] = (struct pollfd){
+				.fd = varlink_service_get_fd(state->service),
+				.events = POLLIN,
+			};
+#endif
+		}
+		for (i = 0; i < ctx->fd_handlers_len; i++) {
+			readfds[handlers_start + i] = (struct pollfd){
+				.fd = ctx->fd_handlers[i].fd,
+				.events = ctx->fd_handlers[i].events,
+			};
 		}
 
-		if (ret < 0 && errno != EPIPE) {
-			goto read_error;
+		i = 1;
+		wl_list_for_each(state, &ctx->displays, link) {
+			if (!prepare_display(state)) {
+				display_failed(state);
+				// Don't wait on a display we can't read from
+				readfds[i].fd = -1;
+			}
+			i += FDS_PER_DISPLAY;
 		}
 
+		int ret;
 		do {
-			ret = poll(readfds, sizeof(readfds) / sizeof(readfds[0]), -1);
+			ret = poll(readfds, nfds, next_timeout(ctx));
 		} while (ret == -1 && errno == EINTR);
 		/* will only be -1 if errno wasn't EINTR */
 		if (ret == -1) {
-			goto read_error;
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "poll failed: %s",
+				strerror(errno));
+			wl_list_for_each(state, &ctx->displays, link) {
+				if (!state->failed) {
+					wl_display_cancel_read(state->display);
+				}
+			}
+			ret_code = EXIT_FAILURE;
+			goto out;
 		}
 
-		if (wl_display_read_events(state->display) == -1) {
-			return EXIT_FAILURE;
+		i = 1;
+		wl_list_for_each(state, &ctx->displays, link) {
+			struct pollfd *fds = &readfds[i];
+			i += FDS_PER_DISPLAY;
+			if (state->failed) {
+				continue;
+			}
+			if (fds[0].revents == 0) {
+				wl_display_cancel_read(state->display);
+			} else if (wl_display_read_events(state->display) == -1) {
+				display_failed(state);
+			}
 		}
 
 #if KANSHI_HAS_VARLINK
-		if (readfds[FD_VARLINK].revents & POLLIN) {
-			long result = varlink_service_process_events(state->service);
-			if (result != 0) {
-				fprintf(stderr, "varlink_service_process_events failed: %s\n",
-						varlink_error_string(-result));
-				return EXIT_FAILURE;
+		i = 1;
+		wl_list_for_each(state, &ctx->displays, link) {
+			struct pollfd *fds = &readfds[i];
+			i += FDS_PER_DISPLAY;
+			if (fds[1].revents & POLLIN) {
+				long result = varlink_service_process_events(state->service);
+				if (result != 0) {
+					kanshi_log(KANSHI_LOG_ERROR, NULL,
+						"varlink_service_process_events failed: %s",
+							varlink_error_string(-result));
+					ret_code = EXIT_FAILURE;
+					goto out;
+				}
 			}
 		}
 #endif
 
-		if (readfds[FD_SIGNAL].revents & POLLIN) {
+		for (i = handlers_start; i < nfds; i++) {
+			if (readfds[i].revents == 0) {
+				continue;
+			}
+			// Handlers may remove themselves or others while dispatching
+			struct kanshi_fd_handler *handler =
+				find_fd_handler(ctx, readfds[i].fd);
+			if (handler != NULL) {
+				handler->func(handler->data, readfds[i].fd, readfds[i].revents);
+			}
+		}
+
+		dispatch_timers(ctx);
+
+		if (readfds[0].revents & POLLIN) {
 			for (;;) {
 				int signum;
 				ssize_t s
-					= read(readfds[FD_SIGNAL].fd, &signum, sizeof(signum));
+					= read(readfds[0].fd, &signum, sizeof(signum));
 				if (s == 0) {
 					break;
 				}
@@ -140,32 +391,62 @@ int kanshi_main_loop(struct kanshi_state *state) {
 					if (errno == EAGAIN) {
 						break;
 					}
-					perror("read from signal pipe failed");
-					return EXIT_FAILURE;
+					kanshi_log(KANSHI_LOG_ERROR, NULL,
+						"read from signal pipe failed: %s", strerror(errno));
+					ret_code = EXIT_FAILURE;
+					goto out;
 				}
 				if (s < (ssize_t) sizeof(signum)) {
-					fprintf(stderr, "read too few bytes from signal pipe\n");
-					return EXIT_FAILURE;
+					kanshi_log(KANSHI_LOG_ERROR, NULL,
+						"read too few bytes from signal pipe");
+					ret_code = EXIT_FAILURE;
+					goto out;
 				}
 				switch (signum) {
+				case SIGCHLD:
+					break;
 				case SIGHUP:
+					// Reloading applies to all displays
+					state = wl_container_of(ctx->displays.next, state, link);
 					kanshi_reload_config(state, NULL, NULL);
 					break;
 				default:
 					/* exiting after signal considered successful */
-					return EXIT_SUCCESS;
+					goto out;
 				}
 			}
 		}
+		if (child_exited) {
+			child_exited = 0;
+			kanshi_exec_reap(ctx);
+		}
 
-		if (wl_display_dispatch_pending(state->display) == -1) {
-			return EXIT_FAILURE;
+		wl_list_for_each(state, &ctx->displays, link) {
+			if (!state->failed &&
+					wl_display_dispatch_pending(state->display) == -1) {
+				display_failed(state);
+			}
 		}
-	}
 
-	return EXIT_SUCCESS;
+		// Keep serving the other displays when one goes away
+		bool destroyed = false;
+		wl_list_for_each_safe(state, tmp, &ctx->displays, link) {
+			if (state->failed) {
+				kanshi_destroy_display(state);
+				destroyed = true;
+			}
+		}
+		if (wl_list_empty(&ctx->displays)) {
+			ret_code = EXIT_FAILURE;
+			goto out;
+		}
+		if (destroyed) {
+			// The other displays may only have been waiting for this one
+			kanshi_check_ready(ctx);
+		}
+	}
 
-read_error:
-	wl_display_cancel_read(state->display);
-	return EXIT_FAILURE;
+out:
+	free(readfds);
+	return ret_code;
 }
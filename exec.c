@@ -0,0 +1,666 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "exec.h"
+#include "kanshi.h"
+#include "libkanshi.h"
+#include "log.h"
+#include "metrics.h"
+
+// Time after which a command still running no longer holds the next ones,
+// so that a command starting a daemon doesn't block the queue
+#define KANSHI_COMMAND_DETACH_MS 10000
+
+// Last run of a rate limited command, by command line
+struct kanshi_command_run {
+	struct wl_list link; // kanshi_state.command_runs
+	struct kanshi_state *state;
+	char *command;
+	bool json;
+	int window_ms;
+	struct timespec last_run; // CLOCK_MONOTONIC
+	// Armed while a run waits for the end of the window
+	struct kanshi_timer deferred;
+};
+
+static const char *transform_names[] = {
+	"normal", "90", "180", "270",
+	"flipped", "flipped-90", "flipped-180", "flipped-270",
+};
+
+static const char *transform_name(int32_t transform) {
+	if (transform < 0 || (size_t)transform >=
+			sizeof(transform_names) / sizeof(transform_names[0])) {
+		return "normal";
+	}
+	return transform_names[transform];
+}
+
+static bool copy_string(char **dst, const char *src) {
+	if (src == NULL) {
+		*dst = NULL;
+		return true;
+	}
+	*dst = strdup(src);
+	return *dst != NULL;
+}
+
+struct kanshi_exec_layout *kanshi_exec_layout_create(
+		struct kanshi_state *state, const struct kanshi_profile *profile,
+		const struct kanshi_head_config *configs) {
+	struct kanshi_exec_layout *layout = calloc(1, sizeof(*layout));
+	if (layout == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		return NULL;
+	}
+	size_t heads_len = wl_list_length(&state->heads);
+	if (heads_len > 0) {
+		layout->outputs = calloc(heads_len, sizeof(layout->outputs[0]));
+		if (layout->outputs == NULL) {
+			goto error;
+		}
+	}
+	if (!copy_string(&layout->profile, profile->name)) {
+		goto error;
+	}
+
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		const struct kanshi_head_config *config =
+			&configs[layout->outputs_len];
+		struct kanshi_exec_output *out =
+			&layout->outputs[layout->outputs_len++];
+		if (!copy_string(&out->name, head->name) ||
+				!copy_string(&out->make, head->make) ||
+				!copy_string(&out->model, head->model) ||
+				!copy_string(&out->serial_number, head->serial_number)) {
+			goto error;
+		}
+
+		// Properties left out of the config keep their current value
+		out->enabled = config->enabled;
+		out->x = head->x;
+		out->y = head->y;
+		out->scale = head->scale;
+		out->transform = head->transform;
+		out->adaptive_sync = head->adaptive_sync;
+		if (!config->enabled) {
+			continue;
+		}
+		if (config->fields & KANSHI_HEAD_CONFIG_CUSTOM_MODE) {
+			out->width = config->custom_mode.width;
+			out->height = config->custom_mode.height;
+			out->refresh = config->custom_mode.refresh;
+		} else if (config->fields & KANSHI_HEAD_CONFIG_MODE) {
+			out->width = head->modes[config->mode].width;
+			out->height = head->modes[config->mode].height;
+			out->refresh = head->modes[config->mode].refresh;
+		} else if (head->mode != NULL) {
+			out->width = head->mode->width;
+			out->height = head->mode->height;
+			out->refresh = head->mode->refresh;
+		}
+		if (config->fields & KANSHI_HEAD_CONFIG_POSITION) {
+			out->x = config->x;
+			out->y = config->y;
+		}
+		if (config->fields & KANSHI_HEAD_CONFIG_SCALE) {
+			out->scale = config->scale;
+		}
+		if (config->fields & KANSHI_HEAD_CONFIG_TRANSFORM) {
+			out->transform = config->transform;
+		}
+		if (config->fields & KANSHI_HEAD_CONFIG_ADAPTIVE_SYNC) {
+			out->adaptive_sync = config->adaptive_sync;
+		}
+	}
+	return layout;
+
+error:
+	kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+	kanshi_exec_layout_destroy(layout);
+	return NULL;
+}
+
+void kanshi_exec_layout_destroy(struct kanshi_exec_layout *layout) {
+	if (layout == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < layout->outputs_len; i++) {
+		struct kanshi_exec_output *out = &layout->outputs[i];
+		free(out->name);
+		free(out->make);
+		free(out->model);
+		free(out->serial_number);
+	}
+	free(layout->outputs);
+	free(layout->profile);
+	free(layout);
+}
+
+static void set_output_env(size_t i, const char *key, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void set_output_env(size_t i, const char *key, const char *fmt, ...) {
+	char name[64], value[256];
+	snprintf(name, sizeof(name), "KANSHI_OUTPUT_%zu_%s", i, key);
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(value, sizeof(value), fmt, args);
+	va_end(args);
+	setenv(name, value, 1);
+}
+
+// Called in the child process, right before running the command
+static void set_layout_env(struct kanshi_state *state) {
+	if (state->name != NULL) {
+		setenv("WAYLAND_DISPLAY", state->name, 1);
+	}
+	const struct kanshi_exec_layout *layout = state->exec_layout;
+	if (layout == NULL) {
+		return;
+	}
+
+	setenv("KANSHI_PROFILE", layout->profile, 1);
+	char len[32];
+	snprintf(len, sizeof(len), "%zu", layout->outputs_len);
+	setenv("KANSHI_OUTPUTS_LEN", len, 1);
+	for (size_t i = 0; i < layout->outputs_len; i++) {
+		const struct kanshi_exec_output *out = &layout->outputs[i];
+		set_output_env(i, "NAME", "%s", out->name != NULL ? out->name : "");
+		set_output_env(i, "MAKE", "%s", out->make != NULL ? out->make : "");
+		set_output_env(i, "MODEL", "%s", out->model != NULL ? out->model : "");
+		set_output_env(i, "SERIAL", "%s",
+			out->serial_number != NULL ? out->serial_number : "");
+		set_output_env(i, "ENABLED", "%d", out->enabled);
+		if (out->width > 0 && out->height > 0) {
+			set_output_env(i, "MODE", "%" PRId32 "x%" PRId32 "@%.3fHz",
+				out->width, out->height, out->refresh / 1000.0);
+		} else {
+			set_output_env(i, "MODE", "%s", "");
+		}
+		set_output_env(i, "POSITION", "%" PRId32 ",%" PRId32, out->x, out->y);
+		set_output_env(i, "SCALE", "%g", out->scale);
+		set_output_env(i, "TRANSFORM", "%s", transform_name(out->transform));
+		set_output_env(i, "ADAPTIVE_SYNC", "%d", out->adaptive_sync);
+	}
+}
+
+static void write_json_string(FILE *f, const char *str) {
+	if (str == NULL) {
+		fputs("null", f);
+		return;
+	}
+	fputc('"', f);
+	for (const unsigned char *ch = (const unsigned char *)str; *ch != '\0';
+			ch++) {
+		if (*ch == '"' || *ch == '\\') {
+			fprintf(f, "\\%c", *ch);
+		} else if (*ch < 0x20) {
+			fprintf(f, "\\u%04x", *ch);
+		} else {
+			fputc(*ch, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void write_layout_json(FILE *f, const struct kanshi_exec_layout *layout) {
+	fputs("{\"profile\":", f);
+	write_json_string(f, layout->profile);
+	fputs(",\"outputs\":[", f);
+	for (size_t i = 0; i < layout->outputs_len; i++) {
+		const struct kanshi_exec_output *out = &layout->outputs[i];
+		if (i > 0) {
+			fputc(',', f);
+		}
+		fputs("{\"name\":", f);
+		write_json_string(f, out->name);
+		fputs(",\"make\":", f);
+		write_json_string(f, out->make);
+		fputs(",\"model\":", f);
+		write_json_string(f, out->model);
+		fputs(",\"serial\":", f);
+		write_json_string(f, out->serial_number);
+		fprintf(f, ",\"enabled\":%s,\"mode\":",
+			out->enabled ? "true" : "false");
+		if (out->width > 0 && out->height > 0) {
+			fprintf(f, "{\"width\":%" PRId32 ",\"height\":%" PRId32
+				",\"refresh\":%.3f}", out->width, out->height,
+				out->refresh / 1000.0);
+		} else {
+			fputs("null", f);
+		}
+		fprintf(f, ",\"position\":{\"x\":%" PRId32 ",\"y\":%" PRId32 "}"
+			",\"scale\":%g,\"transform\":\"%s\",\"adaptive_sync\":%s}",
+			out->x, out->y, out->scale, transform_name(out->transform),
+			out->adaptive_sync ? "true" : "false");
+	}
+	fputs("]}\n", f);
+}
+
+// Returns an unlinked file holding the layout as JSON, positioned at its
+// start, or -1. Each command gets its own file, so that they don't share the
+// file offset.
+static int open_layout_json(const struct kanshi_exec_layout *layout) {
+	if (layout == NULL) {
+		return -1;
+	}
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/kanshi-layout.XXXXXX",
+			dir != NULL ? dir : "/tmp") >= (int)sizeof(path)) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "layout file path too long");
+		return -1;
+	}
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to create %s: %s", path,
+			strerror(errno));
+		return -1;
+	}
+	unlink(path);
+
+	char *json = NULL;
+	size_t json_size = 0;
+	FILE *f = open_memstream(&json, &json_size);
+	if (f == NULL) {
+		close(fd);
+		return -1;
+	}
+	write_layout_json(f, layout);
+	fclose(f);
+
+	size_t written = 0;
+	while (written < json_size) {
+		ssize_t n = write(fd, json + written, json_size - written);
+		if (n < 0) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to write the layout: %s",
+				strerror(errno));
+			free(json);
+			close(fd);
+			return -1;
+		}
+		written += n;
+	}
+	free(json);
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+// A command which has been queued, until it exits
+struct kanshi_command_job {
+	struct wl_list link; // kanshi_context.command_jobs, in queue order
+	struct kanshi_context *ctx;
+	struct kanshi_state *state; // NULL once the display is gone
+	char *command;
+	bool json;
+	// The commands of a profile application share a batch, see
+	// kanshi_profile_command.group
+	uint64_t batch;
+	unsigned int group;
+	pid_t pid; // 0 until started
+	// Counts against the concurrency limit and holds the next groups, until
+	// the command exits or KANSHI_COMMAND_DETACH_MS have elapsed
+	bool holding;
+	struct kanshi_timer detach;
+};
+
+static void destroy_job(struct kanshi_command_job *job) {
+	kanshi_timer_disarm(&job->detach);
+	wl_list_remove(&job->link);
+	free(job->command);
+	free(job);
+}
+
+static void schedule_commands(struct kanshi_context *ctx);
+
+static void job_handle_detach(void *data) {
+	struct kanshi_command_job *job = data;
+	job->holding = false;
+	kanshi_log(KANSHI_LOG_DEBUG, NULL, "command '%s' is still running, not "
+		"waiting for it anymore", job->command);
+	schedule_commands(job->ctx);
+}
+
+// Called in the child process
+static void exec_job(struct kanshi_command_job *job) {
+	setsid();
+	sigset_t set;
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	struct sigaction action;
+	sigfillset(&action.sa_mask);
+	action.sa_flags = 0;
+	action.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGQUIT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGCHLD, &action, NULL);
+
+	int json_fd = job->json ? open_layout_json(job->state->exec_layout) : -1;
+	set_layout_env(job->state);
+	if (json_fd >= 0) {
+		char fd_str[16];
+		snprintf(fd_str, sizeof(fd_str), "%d", json_fd);
+		setenv("KANSHI_JSON_FD", fd_str, 1);
+	}
+	execl("/bin/sh", "/bin/sh", "-c", job->command, (void *)NULL);
+	kanshi_log(KANSHI_LOG_ERROR, NULL, "executing command '%s' failed: %s",
+		job->command, strerror(errno));
+	_exit(127);
+}
+
+static bool start_job(struct kanshi_command_job *job) {
+	struct kanshi_state *state = job->state;
+	struct kanshi_log_fields fields = {
+		.display = state->name,
+		.profile = state->exec_layout != NULL ?
+			state->exec_layout->profile : NULL,
+	};
+	kanshi_log(KANSHI_LOG_INFO, &fields, "running command '%s'", job->command);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		exec_job(job);
+	}
+	if (pid < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, &fields,
+			"impossible to fork a new process: %s", strerror(errno));
+		return false;
+	}
+	kanshi_metrics_inc(&job->ctx->metrics, KANSHI_COUNTER_COMMANDS);
+	job->pid = pid;
+	job->holding = true;
+	kanshi_timer_arm(job->ctx, &job->detach, KANSHI_COMMAND_DETACH_MS);
+	return true;
+}
+
+// Returns true if the previous groups of the batch of the job are done
+static bool job_ready(struct kanshi_context *ctx,
+		const struct kanshi_command_job *job) {
+	struct kanshi_command_job *other;
+	wl_list_for_each(other, &ctx->command_jobs, link) {
+		if (other->batch == job->batch && other->group < job->group &&
+				(other->pid == 0 || other->holding)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Start the queued commands which can run, in queue order
+static void schedule_commands(struct kanshi_context *ctx) {
+	int running = 0;
+	struct kanshi_command_job *job, *tmp;
+	wl_list_for_each(job, &ctx->command_jobs, link) {
+		if (job->holding) {
+			running++;
+		}
+	}
+
+	wl_list_for_each_safe(job, tmp, &ctx->command_jobs, link) {
+		if (job->pid != 0) {
+			continue;
+		}
+		if (ctx->max_commands > 0 && running >= ctx->max_commands) {
+			break;
+		}
+		if (!job_ready(ctx, job)) {
+			continue;
+		}
+		if (start_job(job)) {
+			running++;
+		} else {
+			destroy_job(job);
+		}
+	}
+}
+
+static void queue_command(struct kanshi_state *state, const char *command,
+		bool json, uint64_t batch, unsigned int group) {
+	struct kanshi_command_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		return;
+	}
+	job->command = strdup(command);
+	if (job->command == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		free(job);
+		return;
+	}
+	job->ctx = state->ctx;
+	job->state = state;
+	job->json = json;
+	job->batch = batch;
+	job->group = group;
+	kanshi_timer_init(&job->detach, job_handle_detach, job);
+	wl_list_insert(state->ctx->command_jobs.prev, &job->link);
+}
+
+// Drop the commands of the display which haven't started yet, those of a
+// previous profile application are out of date
+static void drop_queued_commands(struct kanshi_state *state) {
+	struct kanshi_command_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &state->ctx->command_jobs, link) {
+		if (job->state != state) {
+			continue;
+		}
+		if (job->pid == 0) {
+			kanshi_log(KANSHI_LOG_DEBUG, &(struct kanshi_log_fields){
+				.display = state->name,
+			}, "dropping command '%s', not started yet", job->command);
+			destroy_job(job);
+		} else {
+			// The command only needs its display until it's started
+			job->state = NULL;
+		}
+	}
+}
+
+void kanshi_exec_reap(struct kanshi_context *ctx) {
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct kanshi_command_job *job, *found = NULL;
+		wl_list_for_each(job, &ctx->command_jobs, link) {
+			if (job->pid == pid) {
+				found = job;
+				break;
+			}
+		}
+		if (found == NULL) {
+			continue;
+		}
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			kanshi_log(KANSHI_LOG_DEBUG, NULL, "command '%s' exited",
+				found->command);
+		} else if (WIFEXITED(status)) {
+			kanshi_log(KANSHI_LOG_WARNING, NULL,
+				"command '%s' exited with status %d", found->command,
+				WEXITSTATUS(status));
+		} else if (WIFSIGNALED(status)) {
+			kanshi_log(KANSHI_LOG_WARNING, NULL,
+				"command '%s' killed by signal %d", found->command,
+				WTERMSIG(status));
+		}
+		destroy_job(found);
+	}
+	schedule_commands(ctx);
+}
+
+void kanshi_exec_destroy_jobs(struct kanshi_context *ctx) {
+	struct kanshi_command_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &ctx->command_jobs, link) {
+		destroy_job(job);
+	}
+}
+
+static int64_t elapsed_ms(const struct timespec *start,
+		const struct timespec *now) {
+	return (int64_t)(now->tv_sec - start->tv_sec) * 1000 +
+		(now->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void destroy_command_run(struct kanshi_command_run *run) {
+	kanshi_timer_disarm(&run->deferred);
+	wl_list_remove(&run->link);
+	free(run->command);
+	free(run);
+}
+
+static bool profile_has_command(const struct kanshi_profile *profile,
+		const char *command) {
+	if (profile == NULL) {
+		return false;
+	}
+	struct kanshi_profile_command *profile_command;
+	wl_list_for_each(profile_command, &profile->commands, link) {
+		if (strcmp(profile_command->command, command) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void command_run_handle_deferred(void *data) {
+	struct kanshi_command_run *run = data;
+	struct kanshi_state *state = run->state;
+	struct kanshi_log_fields fields = {
+		.display = state->name,
+		.profile = state->current_profile != NULL ?
+			state->current_profile->name : NULL,
+	};
+	// Another profile may have been applied in the meantime
+	if (!profile_has_command(state->current_profile, run->command)) {
+		kanshi_log(KANSHI_LOG_DEBUG, &fields, "dropping deferred command "
+			"'%s', its profile isn't applied anymore", run->command);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &run->last_run);
+	queue_command(state, run->command, run->json,
+		++state->ctx->command_batch, 0);
+	schedule_commands(state->ctx);
+}
+
+// Returns the run of the command, and forgets the ones whose window is over
+static struct kanshi_command_run *get_command_run(struct kanshi_state *state,
+		const char *command, const struct timespec *now) {
+	struct kanshi_command_run *run, *tmp, *found = NULL;
+	wl_list_for_each_safe(run, tmp, &state->command_runs, link) {
+		if (strcmp(run->command, command) == 0) {
+			found = run;
+		} else if (!run->deferred.armed &&
+				elapsed_ms(&run->last_run, now) >= run->window_ms) {
+			destroy_command_run(run);
+		}
+	}
+	if (found != NULL) {
+		return found;
+	}
+
+	run = calloc(1, sizeof(*run));
+	if (run == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		return NULL;
+	}
+	run->command = strdup(command);
+	if (run->command == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		free(run);
+		return NULL;
+	}
+	run->state = state;
+	kanshi_timer_init(&run->deferred, command_run_handle_deferred, run);
+	wl_list_insert(&state->command_runs, &run->link);
+	return run;
+}
+
+static void queue_rate_limited_command(struct kanshi_state *state,
+		const struct kanshi_profile_command *command, uint64_t batch,
+		const struct kanshi_log_fields *fields) {
+	unsigned int group = command->group;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct kanshi_command_run *run =
+		get_command_run(state, command->command, &now);
+	if (run == NULL) {
+		queue_command(state, command->command, command->json, batch, group);
+		return;
+	}
+	// The options may have changed with a config reload
+	run->window_ms = command->once_per_ms;
+	run->json = command->json;
+
+	if (run->deferred.armed) {
+		kanshi_metrics_inc(&state->ctx->metrics,
+			KANSHI_COUNTER_COMMANDS_COALESCED);
+		kanshi_log(KANSHI_LOG_DEBUG, fields,
+			"command '%s' is already deferred", command->command);
+		return;
+	}
+
+	bool ran = run->last_run.tv_sec != 0 || run->last_run.tv_nsec != 0;
+	int64_t elapsed = elapsed_ms(&run->last_run, &now);
+	if (!ran || elapsed >= run->window_ms) {
+		run->last_run = now;
+		queue_command(state, command->command, command->json, batch, group);
+		return;
+	}
+
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_COMMANDS_DEFERRED);
+	kanshi_log(KANSHI_LOG_INFO, fields, "command '%s' ran %" PRId64 " ms ago, "
+		"deferring it", command->command, elapsed);
+	kanshi_timer_arm(state->ctx, &run->deferred,
+		(int)(run->window_ms - elapsed));
+}
+
+void kanshi_exec_profile_commands(struct kanshi_state *state,
+		struct kanshi_profile *profile, const struct kanshi_log_fields *fields) {
+	struct kanshi_context *ctx = state->ctx;
+	drop_queued_commands(state);
+
+	uint64_t batch = ++ctx->command_batch;
+	struct kanshi_profile_command *command;
+	wl_list_for_each(command, &profile->commands, link) {
+		if (state->replay != NULL) {
+			kanshi_log(KANSHI_LOG_INFO, fields,
+				"not running command '%s' during replay", command->command);
+			continue;
+		}
+		if (command->once_per_ms > 0) {
+			queue_rate_limited_command(state, command, batch, fields);
+		} else {
+			queue_command(state, command->command, command->json, batch,
+				command->group);
+		}
+	}
+	schedule_commands(ctx);
+}
+
+void kanshi_finish_exec(struct kanshi_state *state) {
+	drop_queued_commands(state);
+	struct kanshi_command_run *run, *tmp;
+	wl_list_for_each_safe(run, tmp, &state->command_runs, link) {
+		destroy_command_run(run);
+	}
+	kanshi_exec_layout_destroy(state->exec_layout);
+	state->exec_layout = NULL;
+}
@@ -1,6 +1,7 @@
 #ifndef KANSHI_CONFIG_H
 #define KANSHI_CONFIG_H
 
+#include <regex.h>
 #include <stdbool.h>
 #include <wayland-client.h>
 
@@ -13,17 +14,53 @@ enum kanshi_output_field {
 	KANSHI_OUTPUT_ADAPTIVE_SYNC = 1 << 5,
 };
 
+enum kanshi_output_pattern_field {
+	KANSHI_PATTERN_NAME,
+	KANSHI_PATTERN_MAKE,
+	KANSHI_PATTERN_MODEL,
+	KANSHI_PATTERN_SERIAL,
+};
+
+enum kanshi_mode_policy {
+	// The mode given by width, height and refresh
+	KANSHI_MODE_EXACT,
+	// The mode advertised as preferred by the head
+	KANSHI_MODE_PREFERRED,
+	// The mode with the most pixels, then the highest refresh rate
+	KANSHI_MODE_MAX_RESOLUTION,
+	// The mode with the highest refresh rate, then the most pixels
+	KANSHI_MODE_MAX_REFRESH,
+};
+
+// Default tolerance when matching a refresh rate, in mHz
+#define KANSHI_REFRESH_TOLERANCE 50
+
+struct kanshi_output_mode {
+	enum kanshi_mode_policy policy;
+	int width, height;
+	int refresh; // mHz
+	// Modes with a refresh rate closer than this to refresh match, in mHz
+	int refresh_tolerance;
+	bool custom;
+};
+
+struct kanshi_output_pattern {
+	enum kanshi_output_pattern_field field;
+	// Set if the pattern has no special characters, regex is unused then
+	char *literal;
+	regex_t regex;
+};
+
 struct kanshi_profile_output {
 	char *name;
+	// Compiled "field=glob" and "field~regex" criteria, all must match
+	struct kanshi_output_pattern *patterns;
+	size_t patterns_len;
 	unsigned int fields; // enum kanshi_output_field
 	struct wl_list link;
 
 	bool enabled;
-	struct {
-		int width, height;
-		int refresh; // mHz
-		bool custom;
-	} mode;
+	struct kanshi_output_mode mode;
 	struct {
 		int x, y;
 	} position;
@@ -33,25 +70,108 @@ struct kanshi_profile_output {
 	char *alias;
 };
 
+// How specific a profile output criteria is, used to rank profiles
+enum kanshi_match_score {
+	KANSHI_MATCH_WILDCARD = 1,
+	KANSHI_MATCH_PATTERN = 2,
+	KANSHI_MATCH_NAME = 3,
+	KANSHI_MATCH_IDENTIFIER = 4,
+};
+
 struct kanshi_profile_command {
 	struct wl_list link;
 	char *command;
+	// The command runs at most once per window, 0 if not rate limited
+	int once_per_ms;
+	// Give the command the applied layout as JSON, see exec.h
+	bool json;
+	// Start once the previous commands of the profile have exited
+	bool wait;
+	// Commands start once the commands of the previous groups have exited.
+	// Each --wait command gets a group to itself.
+	unsigned int group;
 };
 
 struct kanshi_profile {
 	struct wl_list link;
 	char *name;
-	// Wildcard outputs are stored at the end of the list
+	// Pattern outputs are stored after the other ones, and wildcard outputs
+	// at the end of the list
 	struct wl_list outputs;
 	struct wl_list commands;
+	int priority;
+	// Highest score this profile can reach, see enum kanshi_match_score
+	int max_score;
+};
+
+enum kanshi_profile_selection {
+	// Pick the first matching profile in config order
+	KANSHI_SELECTION_FIRST,
+	// Pick the matching profile with the highest priority and score
+	KANSHI_SELECTION_BEST,
+};
+
+enum kanshi_apply_strategy {
+	// Send the whole profile in a single configuration
+	KANSHI_APPLY_ATOMIC,
+	// Disable the outgoing outputs first, then configure the others
+	KANSHI_APPLY_STAGED,
+};
+
+struct kanshi_profile_bucket {
+	// Sorted by decreasing priority, then decreasing max_score
+	struct kanshi_profile **profiles;
+	size_t len;
+};
+
+struct kanshi_output_table_entry {
+	const char *key; // owned by the output
+	struct kanshi_profile_output *output;
+};
+
+// Hash table of profile outputs indexed by a string
+struct kanshi_output_table {
+	struct kanshi_output_table_entry *entries;
+	size_t len, cap; // cap is 0 or a power of two
 };
 
 struct kanshi_config {
 	struct wl_list output_defaults;
+	// Output defaults indexed by name and by alias
+	struct kanshi_output_table defaults_by_name, defaults_by_alias;
 	struct wl_list profiles;
+
+	enum kanshi_profile_selection profile_selection;
+	enum kanshi_apply_strategy apply_strategy;
+	// Profiles indexed by their number of outputs
+	struct kanshi_profile_bucket *buckets;
+	size_t buckets_len;
+	// Profiles sorted by name, then config order
+	struct kanshi_profile **profiles_by_name;
+	size_t profiles_len;
 };
 
 struct kanshi_config *parse_config(const char *path);
 void destroy_config(struct kanshi_config *config);
+// Returns the profiles with the given name in config order, NULL if none
+struct kanshi_profile **find_profiles(struct kanshi_config *config,
+	const char *name, size_t *len);
+// Concatenates the profiles returned by find_profiles() for each name,
+// skipping names which don't exist. Returns false if the array can't be
+// allocated, *len is 0 if none of the names exist. The array must be freed by
+// the caller.
+bool find_profile_list(struct kanshi_config *config,
+	const char *const *names, size_t names_len,
+	struct kanshi_profile ***profiles, size_t *len);
+
+struct scfg_block;
+
+/**
+ * Build a profile from a block of output directives, resolving aliases and
+ * output defaults against config. The profile isn't added to the config.
+ */
+struct kanshi_profile *parse_inline_profile(struct kanshi_config *config,
+	const char *name, struct scfg_block *outputs);
+void destroy_profile(struct kanshi_profile *profile);
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef KANSHI_CONTROL_H
+#define KANSHI_CONTROL_H
+
+#include <stdio.h>
+
+struct kanshi_state;
+
+/**
+ * Line-based control protocol, served on a Unix socket whether or not varlink
+ * support is built in.
+ *
+ * Each request is a line of space-separated words, a backslash escapes the
+ * following character. Requests are answered in order, one line each: "ok"
+ * followed by the result, or "error" followed by the error name.
+ * "InternalError" reports a failure in the daemon, such as an allocation
+ * failure, rather than a problem with the request.
+ *
+ *   reload                 -> ok
+ *   switch <profile>...    -> ok <applied profile>
+ *   status                 -> ok current=<profile> pending=<profile> heads=<n>
+ *                             retries=<n> retries_exhausted=<n>
+ *                             retry_attempts=<n>
+ *
+ * In the status reply, retries counts the cancelled configurations which have
+ * been retried, retries_exhausted those given up on after too many attempts,
+ * and retry_attempts the retries in a row with the current outputs.
+ */
+
+#define KANSHI_CONTROL_LINE_MAX 4096
+
+int kanshi_init_control(struct kanshi_state *state);
+void kanshi_finish_control(struct kanshi_state *state);
+
+// Writes word with spaces, backslashes and newlines escaped
+void kanshi_control_write_word(FILE *f, const char *word);
+// Splits the next word off line and unescapes it in place, NULL at the end
+char *kanshi_control_next_word(char **line);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef KANSHI_EXEC_H
+#define KANSHI_EXEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct kanshi_context;
+struct kanshi_head_config;
+struct kanshi_log_fields;
+struct kanshi_profile;
+struct kanshi_state;
+
+/**
+ * Commands get the profile and the state of each output once the profile is
+ * applied in their environment:
+ *
+ *   KANSHI_PROFILE             name of the profile
+ *   KANSHI_OUTPUTS_LEN         number of outputs
+ *   KANSHI_OUTPUT_<i>_NAME     connector name, for i from 0
+ *   KANSHI_OUTPUT_<i>_MAKE, _MODEL, _SERIAL
+ *   KANSHI_OUTPUT_<i>_ENABLED  1 or 0
+ *   KANSHI_OUTPUT_<i>_MODE     <width>x<height>@<refresh>Hz, empty if unknown
+ *   KANSHI_OUTPUT_<i>_POSITION <x>,<y>
+ *   KANSHI_OUTPUT_<i>_SCALE
+ *   KANSHI_OUTPUT_<i>_TRANSFORM as in the config file
+ *   KANSHI_OUTPUT_<i>_ADAPTIVE_SYNC 1 or 0
+ *
+ * WAYLAND_DISPLAY is set to the display the profile was applied on. Commands
+ * with the --json option also get the same data as a JSON object on the file
+ * descriptor in KANSHI_JSON_FD.
+ */
+struct kanshi_exec_output {
+	char *name, *make, *model, *serial_number;
+	bool enabled;
+	int32_t width, height, refresh; // 0 if unknown
+	int32_t x, y;
+	double scale;
+	int32_t transform; // enum wl_output_transform
+	bool adaptive_sync;
+};
+
+struct kanshi_exec_layout {
+	char *profile;
+	struct kanshi_exec_output *outputs;
+	size_t outputs_len;
+};
+
+// Describe the heads of the state once the profile is applied, configs[i]
+// being the desired state of the i-th head
+struct kanshi_exec_layout *kanshi_exec_layout_create(
+	struct kanshi_state *state, const struct kanshi_profile *profile,
+	const struct kanshi_head_config *configs);
+void kanshi_exec_layout_destroy(struct kanshi_exec_layout *layout);
+
+/**
+ * Queue the exec commands of a profile which has just been applied, with
+ * state->exec_layout as environment, replacing the commands of the display
+ * which haven't started yet.
+ *
+ * Queued commands start from the event loop in order, and run concurrently up
+ * to kanshi_context.max_commands. A --wait command waits for the previous
+ * commands of the profile to exit, and the next commands wait for it. A command with a --once-per window which
+ * already ran during the window is deferred to its end, and runs there once
+ * however many times the profile was applied in the meantime.
+ */
+void kanshi_exec_profile_commands(struct kanshi_state *state,
+	struct kanshi_profile *profile, const struct kanshi_log_fields *fields);
+// Drop the queued and deferred commands, the rate limiting state and the
+// layout
+void kanshi_finish_exec(struct kanshi_state *state);
+// Collect the commands which have exited and start the next ones, on SIGCHLD
+void kanshi_exec_reap(struct kanshi_context *ctx);
+// Forget all commands, running commands are left alone
+void kanshi_exec_destroy_jobs(struct kanshi_context *ctx);
+
+#endif
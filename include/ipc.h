@@ -5,9 +5,18 @@
 
 #include "kanshi.h"
 
+struct sockaddr_un;
+
 int kanshi_init_ipc(struct kanshi_state *state, int listen_fd);
 void kanshi_finish_ipc(struct kanshi_state *state);
 
-int get_ipc_address(char *address, size_t size);
+// display is the Wayland display name, NULL to use WAYLAND_DISPLAY
+int get_ipc_address(char *address, size_t size, const char *display);
+// Path of the socket serving the protocol described in control.h
+int get_control_address(char *path, size_t size, const char *display);
+// Path of the file described in status.h
+int get_status_address(char *path, size_t size, const char *display);
+// Returns true if another process is listening on the socket at addr
+bool socket_in_use(const struct sockaddr_un *addr);
 
 #endif
@@ -2,32 +2,66 @@
 #define KANSHI_KANSHI_H
 
 #include <stdbool.h>
+#include <time.h>
 #include <wayland-client.h>
 
+#include "metrics.h"
+
 struct zwlr_output_manager_v1;
 
+struct kanshi_context;
 struct kanshi_state;
 struct kanshi_head;
+struct kanshi_profile;
+struct kanshi_recorder;
+struct kanshi_replay;
 
 struct kanshi_mode {
 	struct kanshi_head *head;
 	struct zwlr_output_mode_v1 *wlr_mode;
-	struct wl_list link;
 
 	int32_t width, height;
 	int32_t refresh; // mHz
 	bool preferred;
 };
 
+enum kanshi_head_field {
+	KANSHI_HEAD_NAME = 1 << 0,
+	KANSHI_HEAD_DESCRIPTION = 1 << 1,
+	KANSHI_HEAD_PHYSICAL_SIZE = 1 << 2,
+	KANSHI_HEAD_MODES = 1 << 3,
+	KANSHI_HEAD_ENABLED = 1 << 4,
+	KANSHI_HEAD_CURRENT_MODE = 1 << 5,
+	KANSHI_HEAD_POSITION = 1 << 6,
+	KANSHI_HEAD_TRANSFORM = 1 << 7,
+	KANSHI_HEAD_SCALE = 1 << 8,
+	KANSHI_HEAD_MAKE = 1 << 9,
+	KANSHI_HEAD_MODEL = 1 << 10,
+	KANSHI_HEAD_SERIAL_NUMBER = 1 << 11,
+	KANSHI_HEAD_ADAPTIVE_SYNC = 1 << 12,
+};
+
+// Fields which can change the outcome of matching and mode selection
+#define KANSHI_HEAD_MATCH_FIELDS (KANSHI_HEAD_NAME | KANSHI_HEAD_MAKE | \
+	KANSHI_HEAD_MODEL | KANSHI_HEAD_SERIAL_NUMBER | KANSHI_HEAD_MODES)
+
+#define KANSHI_HEAD_STRINGS_INLINE 256
+
 struct kanshi_head {
 	struct kanshi_state *state;
 	struct zwlr_output_head_v1 *wlr_head;
 	struct wl_list link;
 
-	char *name, *description;
-	char *make, *model, *serial_number;
+	// These point into strings, NULL if unset
+	const char *name, *description;
+	const char *make, *model, *serial_number;
+	// Storage for the strings above, strings_inline unless they don't fit
+	char *strings;
+	char strings_inline[KANSHI_HEAD_STRINGS_INLINE];
 	int32_t phys_width, phys_height; // mm
-	struct wl_list modes;
+	// Mode listeners are updated whenever the array is moved
+	struct kanshi_mode *modes;
+	size_t modes_len, modes_cap;
 
 	bool enabled;
 	struct kanshi_mode *mode;
@@ -39,41 +73,235 @@ struct kanshi_head {
 	enum wl_output_transform transform;
 	double scale;
 	bool adaptive_sync;
+
+	// Fields changed since the last done event, enum kanshi_head_field
+	unsigned int dirty;
 };
 
-struct kanshi_state {
+typedef void (*kanshi_fd_handler_func)(void *data, int fd, short revents);
+
+struct kanshi_fd_handler {
+	int fd;
+	short events; // poll(2) events
+	kanshi_fd_handler_func func;
+	void *data;
+};
+
+typedef void (*kanshi_timer_func)(void *data);
+
+// Timers are embedded in the structure they belong to
+struct kanshi_timer {
+	struct wl_list link; // kanshi_context.timers, while armed
+	bool armed;
+	struct timespec deadline; // CLOCK_MONOTONIC
+	kanshi_timer_func func;
+	void *data;
+};
+
+enum kanshi_apply_result {
+	KANSHI_APPLY_SUCCEEDED,
+	// The compositor failed or cancelled the configuration
+	KANSHI_APPLY_FAILED,
+	// The compositor didn't answer the configuration in time
+	KANSHI_APPLY_TIMED_OUT,
+	KANSHI_APPLY_NOT_MATCHED,
+	// A newer request replaced this one before it was sent
+	KANSHI_APPLY_SUPERSEDED,
+};
+
+// profile is the applied profile on success, NULL otherwise or if the config
+// has been reloaded in the meantime
+typedef void (*kanshi_apply_done_func)(void *data,
+	enum kanshi_apply_result result, struct kanshi_profile *profile);
+
+// Request waiting for the configuration in flight to complete
+struct kanshi_apply_request {
+	bool queued;
+	// Candidates tried in order, empty to match the connected heads
+	struct kanshi_profile **profiles;
+	size_t profiles_len;
+	kanshi_apply_done_func callback;
+	void *callback_data;
+};
+
+#define KANSHI_MATCH_CACHE_SIZE 8
+
+// Result of matching profiles against a set of connected heads
+struct kanshi_match_cache_entry {
+	// Fingerprint of the heads identities, sorted by name
+	char *key;
+	size_t key_size;
+	uint64_t hash;
+	uint64_t config_generation;
+	uint64_t last_used;
+
+	struct kanshi_profile *profile; // NULL if no profile matched
+	// Profile output for each head, in fingerprint order
+	struct kanshi_profile_output **outputs;
+};
+
+// State shared by all the displays driven by the process
+struct kanshi_context {
 	bool running;
+
+	struct kanshi_config *config;
+	const char *config_arg;
+	uint64_t config_generation;
+
+	struct wl_list displays; // kanshi_state.link
+
+	// Readiness is notified once the initial configuration of every display
+	// is settled, ready_fd is -1 if unset
+	int ready_fd;
+	// Value of $NOTIFY_SOCKET at startup, NULL if unset. The variable itself
+	// is removed from the environment of the commands.
+	char *notify_socket;
+	bool ready;
+
+	struct kanshi_metrics metrics;
+	struct kanshi_metrics_server *metrics_server;
+
+	// File descriptors polled by the main loop in addition to the Wayland
+	// displays, the signal pipe and the varlink services
+	struct kanshi_fd_handler *fd_handlers;
+	size_t fd_handlers_len, fd_handlers_cap;
+	struct wl_list timers; // kanshi_timer.link
+
+	// Deadline for the compositor to answer a configuration, 0 to wait
+	// forever
+	int apply_timeout_ms;
+
+	// Profile commands, see kanshi_exec_profile_commands()
+	struct wl_list command_jobs;
+	uint64_t command_batch;
+	int max_commands; // commands running at once, 0 for no limit
+};
+
+// Delay before retrying a cancelled configuration, doubled after each retry
+#define KANSHI_RETRY_DELAY_MIN_MS 50
+#define KANSHI_RETRY_DELAY_MAX_MS 5000
+// Retries with the same heads before waiting for the outputs to change
+#define KANSHI_RETRY_ATTEMPTS_MAX 8
+
+// State of a single display
+struct kanshi_state {
+	struct kanshi_context *ctx;
+	struct wl_list link;
+	const char *name; // NULL for the default display
 	struct wl_display *display;
+	struct wl_registry *registry;
 	struct zwlr_output_manager_v1 *output_manager;
+	// The connection was lost or the state is out of sync, the main loop
+	// destroys the state
+	bool failed;
 #if KANSHI_HAS_VARLINK
 	struct VarlinkService *service;
 #endif
-
-	struct kanshi_config *config;
-	const char *config_arg;
+	struct kanshi_control_server *control_server;
+	struct kanshi_status_file *status_file;
 
 	struct wl_list heads;
 	uint32_t serial;
+	// Set when the head set has changed, or when a cancelled configuration
+	// needs to be retried
+	bool needs_match;
+	bool initialized; // a done event has been received
+	// The initial configuration has been applied, has failed, or no profile
+	// matched
+	bool settled;
 	struct kanshi_profile *current_profile;
 	struct kanshi_profile *pending_profile;
+	// At most one configuration is sent at a time, later requests wait in a
+	// single slot where the last one wins
+	struct kanshi_pending_profile *inflight;
+	struct kanshi_apply_request queued;
+	// Profiles received over IPC, freed once nothing refers to them
+	struct wl_list adhoc_profiles;
+
+	struct kanshi_match_cache_entry match_cache[KANSHI_MATCH_CACHE_SIZE];
+	uint64_t match_cache_tick;
+
+	// Retries of cancelled configurations, see schedule_retry()
+	struct kanshi_timer retry_timer;
+	uint32_t retry_serial; // serial of the cancelled configuration
+	unsigned int retry_backoff; // doublings of the delay, reset on success
+	uint64_t retry_head_set; // hash of the heads retry_attempts applies to
+	unsigned int retry_attempts;
+	uint64_t retries, retries_exhausted;
+
+	// Rate limited exec commands, see kanshi_exec_profile_commands()
+	struct wl_list command_runs;
+	// Outputs once the current profile was applied, given to its commands
+	struct kanshi_exec_layout *exec_layout;
+
+	struct kanshi_recorder *recorder;
+	// Non-NULL while replaying a recording instead of talking to a compositor
+	struct kanshi_replay *replay;
 };
 
-typedef void (*kanshi_apply_done_func)(void *data, bool success);
+enum kanshi_apply_stage {
+	// The configuration holds the whole profile
+	KANSHI_STAGE_FINAL,
+	// Staged apply: the configuration disables the outgoing heads
+	KANSHI_STAGE_DISABLE,
+	// Staged apply: waiting for the state of the heads once the outgoing ones
+	// are disabled, to send the rest of the profile
+	KANSHI_STAGE_WAIT,
+};
 
 struct kanshi_pending_profile {
 	uint32_t serial;
 	struct kanshi_state *state;
-	struct kanshi_profile *profile;
+	struct zwlr_output_configuration_v1 *config; // NULL while replaying
+	struct kanshi_profile *profile; // NULL if the config has been reloaded
+	struct timespec start;
+	struct kanshi_timer timeout;
+	struct kanshi_exec_layout *layout; // NULL while replaying
+
+	// Heads already in the requested state are left alone when staged
+	bool staged;
+	enum kanshi_apply_stage stage;
+	// Whether the configuration being sent changes modes, and when it was sent
+	bool modeset;
+	struct timespec sent;
+	double blank_time; // seconds spent by the configurations changing modes
 
 	kanshi_apply_done_func callback;
 	void *callback_data;
 };
 
+// Reloads the config of all displays, the callback reports the outcome for
+// state
 bool kanshi_reload_config(struct kanshi_state *state,
 	kanshi_apply_done_func callback, void *data);
 bool kanshi_switch(struct kanshi_state *state, struct kanshi_profile *profile,
 	kanshi_apply_done_func callback, void *data);
+// Switch to the first of the candidates which matches and can be applied
+bool kanshi_switch_any(struct kanshi_state *state,
+	struct kanshi_profile **profiles, size_t profiles_len,
+	kanshi_apply_done_func callback, void *data);
+// Like kanshi_switch(), for a profile which isn't part of the config. Takes
+// ownership of the profile.
+bool kanshi_apply_adhoc_profile(struct kanshi_state *state,
+	struct kanshi_profile *profile,
+	kanshi_apply_done_func callback, void *data);
+
+// Disconnects from a display and frees its state
+void kanshi_destroy_display(struct kanshi_state *state);
+// Notifies readiness once all displays have settled
+void kanshi_check_ready(struct kanshi_context *ctx);
 
-int kanshi_main_loop(struct kanshi_state *state);
+int kanshi_main_loop(struct kanshi_context *ctx);
+bool kanshi_add_fd(struct kanshi_context *ctx, int fd, short events,
+	kanshi_fd_handler_func func, void *data);
+void kanshi_update_fd(struct kanshi_context *ctx, int fd, short events);
+void kanshi_remove_fd(struct kanshi_context *ctx, int fd);
+void kanshi_timer_init(struct kanshi_timer *timer, kanshi_timer_func func,
+	void *data);
+// Calls the timer function once after timeout_ms, re-arming an armed timer
+// moves its deadline
+void kanshi_timer_arm(struct kanshi_context *ctx, struct kanshi_timer *timer,
+	int timeout_ms);
+void kanshi_timer_disarm(struct kanshi_timer *timer);
 
 #endif
@@ -0,0 +1,97 @@
+#ifndef LIBKANSHI_H
+#define LIBKANSHI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * libkanshi resolves kanshi profiles against a set of outputs, without going
+ * through a Wayland connection. It is meant for compositors which want to
+ * apply kanshi config files themselves.
+ *
+ * Structures passed to and returned by the library are only ever extended at
+ * their end.
+ */
+
+#define LIBKANSHI_API __attribute__((visibility("default")))
+
+struct kanshi_config;
+struct kanshi_profile;
+
+struct kanshi_head_mode {
+	int32_t width, height;
+	int32_t refresh; // mHz
+	bool preferred;
+};
+
+struct kanshi_head_info {
+	const char *name;
+	// NULL if unknown
+	const char *make, *model, *serial_number;
+	bool enabled;
+	const struct kanshi_head_mode *modes;
+	size_t modes_len;
+};
+
+enum kanshi_head_config_field {
+	KANSHI_HEAD_CONFIG_MODE = 1 << 0,
+	KANSHI_HEAD_CONFIG_CUSTOM_MODE = 1 << 1,
+	KANSHI_HEAD_CONFIG_POSITION = 1 << 2,
+	KANSHI_HEAD_CONFIG_SCALE = 1 << 3,
+	KANSHI_HEAD_CONFIG_TRANSFORM = 1 << 4,
+	KANSHI_HEAD_CONFIG_ADAPTIVE_SYNC = 1 << 5,
+};
+
+// Desired state of a head, properties not in fields are left as they are
+struct kanshi_head_config {
+	bool enabled;
+	unsigned int fields; // enum kanshi_head_config_field
+	size_t mode; // index in kanshi_head_info.modes
+	struct {
+		int32_t width, height;
+		int32_t refresh; // mHz, 0 to let the compositor pick
+	} custom_mode;
+	int32_t x, y;
+	double scale;
+	int32_t transform; // enum wl_output_transform
+	bool adaptive_sync;
+};
+
+enum kanshi_resolve_result {
+	KANSHI_RESOLVE_OK,
+	KANSHI_RESOLVE_NO_PROFILE,
+	// The matched profile sets a mode one of the heads doesn't support
+	KANSHI_RESOLVE_UNSUPPORTED_MODE,
+	KANSHI_RESOLVE_TOO_MANY_HEADS,
+};
+
+/**
+ * Parse a config file, returns NULL on error. Errors are written to the
+ * standard error.
+ */
+LIBKANSHI_API struct kanshi_config *kanshi_config_load(const char *path);
+LIBKANSHI_API void kanshi_config_destroy(struct kanshi_config *config);
+
+/**
+ * Pick the profile to apply to the heads and fill configs, an array of
+ * heads_len entries, with the desired state of each head. On success, profile
+ * is set to the matched profile, which is valid until the config is destroyed.
+ */
+LIBKANSHI_API enum kanshi_resolve_result kanshi_config_resolve(
+	struct kanshi_config *config,
+	const struct kanshi_head_info *heads, size_t heads_len,
+	struct kanshi_head_config *configs,
+	const struct kanshi_profile **profile);
+
+LIBKANSHI_API const char *kanshi_profile_get_name(
+	const struct kanshi_profile *profile);
+/**
+ * Call func for each command to run once the profile has been applied, in
+ * config order.
+ */
+LIBKANSHI_API void kanshi_profile_for_each_command(
+	const struct kanshi_profile *profile,
+	void (*func)(void *data, const char *command), void *data);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef KANSHI_LOG_H
+#define KANSHI_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum kanshi_log_level {
+	KANSHI_LOG_ERROR,
+	KANSHI_LOG_WARNING,
+	KANSHI_LOG_INFO,
+	KANSHI_LOG_DEBUG,
+};
+
+// Structured fields attached to a message, unset fields are NULL or 0
+struct kanshi_log_fields {
+	const char *display; // NULL for the default display
+	const char *profile;
+	const char *head;
+	uint32_t serial;
+	int line; // config file line
+};
+
+#define KANSHI_LOG_RING_SIZE 256
+
+struct kanshi_log_entry {
+	struct timespec time; // CLOCK_REALTIME
+	enum kanshi_log_level level;
+	char message[192];
+	char profile[64];
+	char head[64];
+	uint32_t serial;
+	int line;
+};
+
+/**
+ * Set the maximum level written to stderr and make writes to it non-blocking.
+ * Messages which can't be written without blocking are dropped and counted.
+ */
+void kanshi_log_init(enum kanshi_log_level level);
+void kanshi_log_finish(void);
+void kanshi_log(enum kanshi_log_level level,
+	const struct kanshi_log_fields *fields, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+bool kanshi_log_parse_level(const char *str, enum kanshi_log_level *level);
+const char *kanshi_log_level_name(enum kanshi_log_level level);
+uint64_t kanshi_log_dropped(void);
+
+/**
+ * The last KANSHI_LOG_RING_SIZE messages are kept in memory regardless of the
+ * level, index 0 is the oldest one.
+ */
+size_t kanshi_log_ring_len(void);
+const struct kanshi_log_entry *kanshi_log_ring_get(size_t index);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef KANSHI_MATCH_H
+#define KANSHI_MATCH_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "libkanshi.h"
+
+#define KANSHI_HEADS_MAX 64
+
+// matches[i] is set to the profile output for heads[i]
+bool kanshi_match_profile(struct kanshi_profile *profile,
+	const struct kanshi_head_info *heads, size_t heads_len,
+	struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]);
+// Returns the profile to apply according to the profile selection of the
+// config, NULL if none matches
+struct kanshi_profile *kanshi_match(struct kanshi_config *config,
+	const struct kanshi_head_info *heads, size_t heads_len,
+	struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]);
+// Returns the index of the mode to use, -1 if the head doesn't support it
+ssize_t kanshi_match_mode(const struct kanshi_head_mode *modes,
+	size_t modes_len, const struct kanshi_output_mode *mode);
+// Returns false if the head doesn't support the mode of the profile output
+bool kanshi_resolve_head(const struct kanshi_head_info *head,
+	const struct kanshi_profile_output *output,
+	struct kanshi_head_config *config);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef KANSHI_METRICS_H
+#define KANSHI_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct kanshi_context;
+
+enum kanshi_counter {
+	KANSHI_COUNTER_DONE_EVENTS,
+	KANSHI_COUNTER_PROFILE_MATCHES,
+	KANSHI_COUNTER_PROFILE_MISSES,
+	KANSHI_COUNTER_APPLIES_SUCCEEDED,
+	KANSHI_COUNTER_APPLIES_FAILED,
+	KANSHI_COUNTER_APPLIES_CANCELLED,
+	KANSHI_COUNTER_APPLIES_TIMED_OUT,
+	KANSHI_COUNTER_REQUESTS_SUPERSEDED,
+	KANSHI_COUNTER_RETRIES,
+	KANSHI_COUNTER_RETRIES_EXHAUSTED,
+	KANSHI_COUNTER_COMMANDS,
+	KANSHI_COUNTER_COMMANDS_DEFERRED,
+	KANSHI_COUNTER_COMMANDS_COALESCED,
+	KANSHI_COUNTER_RELOADS_SUCCEEDED,
+	KANSHI_COUNTER_RELOADS_FAILED,
+	KANSHI_COUNTER_COUNT,
+};
+
+enum kanshi_histogram {
+	KANSHI_HISTOGRAM_APPLY_LATENCY,
+	KANSHI_HISTOGRAM_RELOAD_DURATION,
+	KANSHI_HISTOGRAM_BLANK_TIME,
+	KANSHI_HISTOGRAM_COUNT,
+};
+
+// Upper bounds in seconds, the +Inf bucket is implicit
+#define KANSHI_HISTOGRAM_BOUNDS \
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5
+#define KANSHI_HISTOGRAM_BUCKETS 11
+
+struct kanshi_histogram_data {
+	uint64_t buckets[KANSHI_HISTOGRAM_BUCKETS]; // not cumulative
+	uint64_t count;
+	double sum;
+};
+
+struct kanshi_metrics {
+	uint64_t counters[KANSHI_COUNTER_COUNT];
+	struct kanshi_histogram_data histograms[KANSHI_HISTOGRAM_COUNT];
+};
+
+void kanshi_metrics_inc(struct kanshi_metrics *metrics,
+	enum kanshi_counter counter);
+void kanshi_metrics_observe(struct kanshi_metrics *metrics,
+	enum kanshi_histogram histogram, double value);
+// Observes the time elapsed since start, taken from CLOCK_MONOTONIC
+void kanshi_metrics_observe_since(struct kanshi_metrics *metrics,
+	enum kanshi_histogram histogram, const struct timespec *start);
+
+/**
+ * Serve the metrics in the Prometheus text format over HTTP on a Unix socket
+ * bound at path.
+ */
+int kanshi_init_metrics(struct kanshi_context *ctx, const char *path);
+void kanshi_finish_metrics(struct kanshi_context *ctx);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef KANSHI_NOTIFY_H
+#define KANSHI_NOTIFY_H
+
+/**
+ * Tell the service manager that kanshi is ready: write a newline to ready_fd
+ * and close it if it isn't negative, and send READY=1 to notify_socket as
+ * described in sd_notify(3) if it isn't NULL.
+ */
+void kanshi_notify_ready(int ready_fd, const char *notify_socket);
+
+#endif
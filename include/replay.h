@@ -0,0 +1,41 @@
+#ifndef KANSHI_REPLAY_H
+#define KANSHI_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kanshi.h"
+#include "wlr-output-management-unstable-v1-client-protocol.h"
+
+struct kanshi_replay_listeners {
+	const struct zwlr_output_manager_v1_listener *output_manager;
+	const struct zwlr_output_head_v1_listener *head;
+	const struct zwlr_output_mode_v1_listener *mode;
+	const struct zwlr_output_configuration_v1_listener *config;
+	// Destroys a configuration left without a recorded reply
+	void (*abandoned)(struct kanshi_pending_profile *pending);
+};
+
+struct kanshi_recorder *kanshi_recorder_create(const char *path);
+void kanshi_recorder_destroy(struct kanshi_recorder *recorder);
+void kanshi_record(struct kanshi_state *state, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void kanshi_record_string(struct kanshi_state *state, const char *event,
+	uint32_t id, const char *value);
+
+/**
+ * Feed a recording made with kanshi_recorder_create() to the listeners. The
+ * speed factor scales the recorded delays, 0 disables them.
+ */
+int kanshi_replay(struct kanshi_state *state, const char *path, double speed,
+	const struct kanshi_replay_listeners *listeners);
+// Returns false and fails the replay if too many configurations are waiting
+// for a reply
+bool kanshi_replay_submit(struct kanshi_state *state,
+	struct kanshi_pending_profile *pending);
+
+static inline void *kanshi_replay_object(uint32_t id) {
+	return (void *)(uintptr_t)id;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef KANSHI_STATUS_H
+#define KANSHI_STATUS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The daemon publishes its status in a file mapped in memory at
+ * $XDG_RUNTIME_DIR/fr.emersion.kanshi.$WAYLAND_DISPLAY.status, so that
+ * clients can read it without talking to the daemon.
+ *
+ * The file holds a struct kanshi_status. seq is odd while the daemon updates
+ * the status: readers copy the status and retry if seq was odd or has changed
+ * in the meantime, see kanshi_status_read(). The file is replaced when the
+ * daemon restarts, readers should reopen it if the magic or version doesn't
+ * match or if seq doesn't change for a long time.
+ */
+
+#define KANSHI_STATUS_MAGIC 0x6b6e7368 // "kshn"
+#define KANSHI_STATUS_VERSION 1
+#define KANSHI_STATUS_HEADS_MAX 32
+#define KANSHI_STATUS_NAME_SIZE 64
+
+struct kanshi_status_head {
+	char name[KANSHI_STATUS_NAME_SIZE];
+	char make[KANSHI_STATUS_NAME_SIZE];
+	char model[KANSHI_STATUS_NAME_SIZE];
+	char serial_number[KANSHI_STATUS_NAME_SIZE];
+	uint8_t enabled;
+	uint8_t adaptive_sync;
+	int32_t width, height; // current mode, 0 if unknown
+	int32_t refresh; // mHz
+	int32_t x, y;
+	int32_t transform; // enum wl_output_transform
+	double scale;
+};
+
+struct kanshi_status {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint32_t seq;
+	uint32_t heads_len;
+	// Empty if none
+	char current_profile[KANSHI_STATUS_NAME_SIZE];
+	char pending_profile[KANSHI_STATUS_NAME_SIZE];
+	// Heads beyond KANSHI_STATUS_HEADS_MAX are left out
+	struct kanshi_status_head heads[KANSHI_STATUS_HEADS_MAX];
+};
+
+/**
+ * Copy a consistent snapshot of a status mapped in memory. Returns false if
+ * the status kept changing, or if it has an unknown format.
+ */
+bool kanshi_status_read(const struct kanshi_status *shared,
+	struct kanshi_status *out);
+
+struct kanshi_state;
+
+// Create the status file, kanshi runs without one if that fails
+void kanshi_init_status(struct kanshi_state *state);
+void kanshi_finish_status(struct kanshi_state *state);
+// Publish the current profiles and heads of the state
+void kanshi_publish_status(struct kanshi_state *state);
+
+#endif
@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "ipc.h"
 
-int get_ipc_address(char *address, size_t size) {
-	const char *wayland_display = getenv("WAYLAND_DISPLAY");
+static int get_socket_path(char *path, size_t size, const char *prefix,
+		const char *suffix, const char *wayland_display) {
+	if (wayland_display == NULL) {
+		wayland_display = getenv("WAYLAND_DISPLAY");
+	}
 	const char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
 	if (!wayland_display || !wayland_display[0]) {
 		fprintf(stderr, "WAYLAND_DISPLAY is not set\n");
@@ -15,6 +21,29 @@ int get_ipc_address(char *address, size_t size) {
 		return -1;
 	}
 
-	return snprintf(address, size, "unix:%s/fr.emersion.kanshi.%s",
-			xdg_runtime_dir, wayland_display);
+	return snprintf(path, size, "%s%s/fr.emersion.kanshi.%s%s",
+			prefix, xdg_runtime_dir, wayland_display, suffix);
+}
+
+int get_ipc_address(char *address, size_t size, const char *display) {
+	return get_socket_path(address, size, "unix:", "", display);
+}
+
+int get_control_address(char *path, size_t size, const char *display) {
+	return get_socket_path(path, size, "", ".ctl", display);
+}
+
+int get_status_address(char *path, size_t size, const char *display) {
+	return get_socket_path(path, size, "", ".status", display);
+}
+
+bool socket_in_use(const struct sockaddr_un *addr) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+	bool in_use = connect(fd, (const struct sockaddr *)addr,
+		sizeof(*addr)) == 0;
+	close(fd);
+	return in_use;
 }
@@ -1,12 +1,17 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <scfg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <varlink.h>
 
 #include "config.h"
 #include "kanshi.h"
 #include "ipc.h"
+#include "log.h"
+#include "match.h"
 
 static long reply_error(VarlinkCall *call, const char *name) {
 	VarlinkObject *params = NULL;
@@ -19,12 +24,55 @@ static long reply_error(VarlinkCall *call, const char *name) {
 	return ret;
 }
 
-static void apply_profile_done(void *data, bool success) {
+static void reply_applied(VarlinkCall *call, struct kanshi_profile *profile) {
+	VarlinkObject *out = NULL;
+	if (varlink_object_new(&out) < 0) {
+		return;
+	}
+	// The profile may have been dropped by a config reload
+	varlink_object_set_string(out, "profile",
+		profile != NULL ? profile->name : "");
+	varlink_call_reply(call, out, 0);
+	varlink_object_unref(out);
+}
+
+static void reply_apply_error(VarlinkCall *call,
+		enum kanshi_apply_result result) {
+	switch (result) {
+	case KANSHI_APPLY_SUCCEEDED:
+		break;
+	case KANSHI_APPLY_FAILED:
+		reply_error(call, "fr.emersion.kanshi.ProfileNotApplied");
+		break;
+	case KANSHI_APPLY_TIMED_OUT:
+		reply_error(call, "fr.emersion.kanshi.ProfileTimedOut");
+		break;
+	case KANSHI_APPLY_NOT_MATCHED:
+		reply_error(call, "fr.emersion.kanshi.ProfileNotMatched");
+		break;
+	case KANSHI_APPLY_SUPERSEDED:
+		reply_error(call, "fr.emersion.kanshi.ProfileSuperseded");
+		break;
+	}
+}
+
+static void apply_profile_done(void *data, enum kanshi_apply_result result,
+		struct kanshi_profile *profile) {
 	VarlinkCall *call = data;
-	if (success) {
+	if (result == KANSHI_APPLY_SUCCEEDED) {
 		varlink_call_reply(call, NULL, 0);
 	} else {
-		reply_error(call, "fr.emersion.kanshi.ProfileNotApplied");
+		reply_apply_error(call, result);
+	}
+}
+
+static void switch_done(void *data, enum kanshi_apply_result result,
+		struct kanshi_profile *profile) {
+	VarlinkCall *call = data;
+	if (result == KANSHI_APPLY_SUCCEEDED) {
+		reply_applied(call, profile);
+	} else {
+		reply_apply_error(call, result);
 	}
 }
 
@@ -41,43 +89,238 @@ static long handle_switch(VarlinkService *service, VarlinkCall *call,
 		VarlinkObject *parameters, uint64_t flags, void *userdata) {
 	struct kanshi_state *state = userdata;
 
+	// Either a single profile name, or a list of names tried in order
 	const char *profile_name;
+	const char **names = &profile_name;
+	size_t names_len = 1;
+	VarlinkArray *array;
 	if (varlink_object_get_string(parameters, "profile", &profile_name) < 0) {
-		return varlink_call_reply_invalid_parameter(call, "profile");
+		if (varlink_object_get_array(parameters, "profiles", &array) < 0) {
+			return varlink_call_reply_invalid_parameter(call, "profile");
+		}
+		names_len = varlink_array_get_n_elements(array);
+		if (names_len == 0) {
+			return varlink_call_reply_invalid_parameter(call, "profiles");
+		}
+		names = calloc(names_len, sizeof(*names));
+		if (names == NULL) {
+			return -ENOMEM;
+		}
+		for (size_t i = 0; i < names_len; i++) {
+			if (varlink_array_get_string(array, i, &names[i]) < 0) {
+				free(names);
+				return varlink_call_reply_invalid_parameter(call, "profiles");
+			}
+		}
+	}
+
+	// Profiles sharing a name are all candidates, in config order
+	struct kanshi_profile **candidates;
+	size_t candidates_len;
+	bool ok = find_profile_list(state->ctx->config, names, names_len,
+		&candidates, &candidates_len);
+	if (names != &profile_name) {
+		free(names);
 	}
+	if (!ok) {
+		return -ENOMEM;
+	}
+	if (candidates_len == 0) {
+		return reply_error(call, "fr.emersion.kanshi.ProfileNotFound");
+	}
+
+	bool matched = kanshi_switch_any(state, candidates, candidates_len,
+		switch_done, call);
+	free(candidates);
+	if (!matched) {
+		return reply_error(call, "fr.emersion.kanshi.ProfileNotMatched");
+	}
+	return 0;
+}
 
-	struct kanshi_profile *profile;
-	bool found = false;
-	bool matched = false;
-	wl_list_for_each(profile, &state->config->profiles, link) {
-		if (strcmp(profile->name, profile_name) != 0) {
-			continue;
+static bool add_param(struct scfg_directive *dir, const char *value) {
+	char **params = realloc(dir->params,
+		(dir->params_len + 1) * sizeof(*params));
+	if (params == NULL) {
+		return false;
+	}
+	dir->params = params;
+	char *param = strdup(value);
+	if (param == NULL) {
+		return false;
+	}
+	dir->params[dir->params_len++] = param;
+	return true;
+}
+
+// Translate an Output object to the equivalent config file directive
+static bool build_output_directive(struct scfg_directive *dir,
+		VarlinkObject *output) {
+	dir->name = strdup("output");
+	if (dir->name == NULL) {
+		return false;
+	}
+
+	VarlinkArray *criteria;
+	if (varlink_object_get_array(output, "criteria", &criteria) < 0) {
+		return false;
+	}
+	unsigned long criteria_len = varlink_array_get_n_elements(criteria);
+	if (criteria_len == 0) {
+		return false;
+	}
+	for (unsigned long i = 0; i < criteria_len; i++) {
+		const char *criterion;
+		if (varlink_array_get_string(criteria, i, &criterion) < 0 ||
+				!add_param(dir, criterion)) {
+			return false;
 		}
+	}
 
-		found = true;
-		if (kanshi_switch(state, profile, apply_profile_done, call)) {
-			matched = true;
-			break;
+	bool enabled, custom = false, adaptive_sync;
+	const char *str;
+	double scale;
+	if (varlink_object_get_bool(output, "enabled", &enabled) == 0 &&
+			!add_param(dir, enabled ? "enable" : "disable")) {
+		return false;
+	}
+	if (varlink_object_get_string(output, "mode", &str) == 0) {
+		varlink_object_get_bool(output, "custom_mode", &custom);
+		if (!add_param(dir, "mode") ||
+				(custom && !add_param(dir, "--custom")) ||
+				!add_param(dir, str)) {
+			return false;
 		}
 	}
-	if (!found) {
-		return reply_error(call, "fr.emersion.kanshi.ProfileNotFound");
+	if (varlink_object_get_string(output, "position", &str) == 0 &&
+			(!add_param(dir, "position") || !add_param(dir, str))) {
+		return false;
 	}
-	if (!matched) {
-			return reply_error(call, "fr.emersion.kanshi.ProfileNotMatched");
+	if (varlink_object_get_float(output, "scale", &scale) == 0) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%f", scale);
+		if (!add_param(dir, "scale") || !add_param(dir, buf)) {
+			return false;
+		}
+	}
+	if (varlink_object_get_string(output, "transform", &str) == 0 &&
+			(!add_param(dir, "transform") || !add_param(dir, str))) {
+		return false;
+	}
+	if (varlink_object_get_bool(output, "adaptive_sync", &adaptive_sync) == 0 &&
+			(!add_param(dir, "adaptive_sync") ||
+			!add_param(dir, adaptive_sync ? "on" : "off"))) {
+		return false;
 	}
+	return true;
+}
 
+static long handle_apply(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+
+	VarlinkArray *outputs;
+	if (varlink_object_get_array(parameters, "outputs", &outputs) < 0) {
+		return varlink_call_reply_invalid_parameter(call, "outputs");
+	}
+
+	// A profile with more outputs than heads can't match
+	unsigned long outputs_len = varlink_array_get_n_elements(outputs);
+	if (outputs_len == 0 || outputs_len > KANSHI_HEADS_MAX) {
+		return varlink_call_reply_invalid_parameter(call, "outputs");
+	}
+	struct scfg_block block = {
+		.directives = calloc(outputs_len, sizeof(struct scfg_directive)),
+	};
+	if (block.directives == NULL) {
+		return -ENOMEM;
+	}
+	for (unsigned long i = 0; i < outputs_len; i++) {
+		VarlinkObject *output;
+		struct scfg_directive *dir = &block.directives[block.directives_len++];
+		if (varlink_array_get_object(outputs, i, &output) < 0 ||
+				!build_output_directive(dir, output)) {
+			scfg_block_finish(&block);
+			return varlink_call_reply_invalid_parameter(call, "outputs");
+		}
+	}
+
+	static int adhoc_profile_num = 1;
+	char name[64];
+	snprintf(name, sizeof(name), "<applied profile %d>", adhoc_profile_num++);
+	struct kanshi_profile *profile =
+		parse_inline_profile(state->ctx->config, name, &block);
+	scfg_block_finish(&block);
+	if (profile == NULL) {
+		return reply_error(call, "fr.emersion.kanshi.InvalidProfile");
+	}
+
+	if (!kanshi_apply_adhoc_profile(state, profile, apply_profile_done, call)) {
+		return reply_error(call, "fr.emersion.kanshi.ProfileNotMatched");
+	}
 	return 0;
 }
 
+static long handle_log(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	VarlinkArray *entries = NULL;
+	long ret = varlink_array_new(&entries);
+	if (ret < 0) {
+		return ret;
+	}
+	for (size_t i = 0; i < kanshi_log_ring_len(); i++) {
+		const struct kanshi_log_entry *entry = kanshi_log_ring_get(i);
+		VarlinkObject *obj = NULL;
+		ret = varlink_object_new(&obj);
+		if (ret < 0) {
+			varlink_array_unref(entries);
+			return ret;
+		}
+		varlink_object_set_float(obj, "time",
+			(double)entry->time.tv_sec + (double)entry->time.tv_nsec / 1e9);
+		varlink_object_set_string(obj, "level",
+			kanshi_log_level_name(entry->level));
+		varlink_object_set_string(obj, "message", entry->message);
+		if (entry->profile[0] != '\0') {
+			varlink_object_set_string(obj, "profile", entry->profile);
+		}
+		if (entry->head[0] != '\0') {
+			varlink_object_set_string(obj, "head", entry->head);
+		}
+		if (entry->serial != 0) {
+			varlink_object_set_int(obj, "serial", entry->serial);
+		}
+		if (entry->line != 0) {
+			varlink_object_set_int(obj, "line", entry->line);
+		}
+		varlink_array_append_object(entries, obj);
+		varlink_object_unref(obj);
+	}
+
+	VarlinkObject *out = NULL;
+	ret = varlink_object_new(&out);
+	if (ret < 0) {
+		varlink_array_unref(entries);
+		return ret;
+	}
+	varlink_object_set_array(out, "entries", entries);
+	varlink_object_set_int(out, "dropped", (int64_t)kanshi_log_dropped());
+	ret = varlink_call_reply(call, out, 0);
+	varlink_array_unref(entries);
+	varlink_object_unref(out);
+	return ret;
+}
+
 static int set_cloexec(int fd) {
 	int flags = fcntl(fd, F_GETFD);
 	if (flags < 0) {
-		perror("fnctl(F_GETFD) failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl(F_GETFD) failed: %s", strerror(errno));
 		return -1;
 	}
 	if (fcntl(fd, F_SETFD, flags | O_CLOEXEC) < 0) {
-		perror("fnctl(F_SETFD) failed");
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fnctl(F_SETFD) failed: %s", strerror(errno));
 		return -1;
 	}
 	return 0;
@@ -90,30 +333,58 @@ int kanshi_init_ipc(struct kanshi_state *state, int listen_fd) {
 
 	VarlinkService *service;
 	char address[PATH_MAX];
-	if (get_ipc_address(address, sizeof(address)) < 0) {
+	if (get_ipc_address(address, sizeof(address), state->name) < 0) {
 		return -1;
 	}
 	if (varlink_service_new(&service,
 			"emersion", "kanshi", KANSHI_VERSION, "https://wayland.emersion.fr/kanshi/",
 			address, listen_fd) < 0) {
-		fprintf(stderr, "Couldn't start kanshi varlink service at %s.\n"
-				"Is the kanshi daemon already running?\n", address);
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "couldn't start kanshi varlink "
+			"service at %s, is the kanshi daemon already running?", address);
 		return -1;
 	}
 
 	const char *interface = "interface fr.emersion.kanshi\n"
 		"method Reload() -> ()\n"
-		"method Switch(profile: string) -> ()\n"
+		"method Switch(profile: ?string, profiles: ?[]string) -> "
+			"(profile: string)\n"
+		"type Output (\n"
+		"  criteria: []string,\n"
+		"  enabled: ?bool,\n"
+		"  mode: ?string,\n"
+		"  custom_mode: ?bool,\n"
+		"  position: ?string,\n"
+		"  scale: ?float,\n"
+		"  transform: ?string,\n"
+		"  adaptive_sync: ?bool\n"
+		")\n"
+		"method Apply(outputs: []Output) -> ()\n"
+		"type LogEntry (\n"
+		"  time: float,\n"
+		"  level: string,\n"
+		"  message: string,\n"
+		"  profile: ?string,\n"
+		"  head: ?string,\n"
+		"  serial: ?int,\n"
+		"  line: ?int\n"
+		")\n"
+		"method Log() -> (entries: []LogEntry, dropped: int)\n"
 		"error ProfileNotFound()\n"
 		"error ProfileNotMatched()\n"
-		"error ProfileNotApplied()\n";
+		"error ProfileNotApplied()\n"
+		"error ProfileSuperseded()\n"
+		"error ProfileTimedOut()\n"
+		"error InvalidProfile()\n";
 
 	long result = varlink_service_add_interface(service, interface,
 			"Reload", handle_reload, state,
 			"Switch", handle_switch, state,
+			"Apply", handle_apply, state,
+			"Log", handle_log, state,
 			NULL);
 	if (result != 0) {
-		fprintf(stderr, "varlink_service_add_interface failed: %s\n",
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"varlink_service_add_interface failed: %s",
 				varlink_error_string(-result));
 		varlink_service_free(service);
 		return -1;
@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static const char *level_names[] = {
+	[KANSHI_LOG_ERROR] = "error",
+	[KANSHI_LOG_WARNING] = "warning",
+	[KANSHI_LOG_INFO] = "info",
+	[KANSHI_LOG_DEBUG] = "debug",
+};
+
+static enum kanshi_log_level max_level = KANSHI_LOG_INFO;
+static int log_fd = STDERR_FILENO;
+static bool log_fd_owned = false;
+static bool log_fd_socket = false;
+// A line was only partially written, the next write must terminate it
+static bool need_newline = false;
+static uint64_t dropped_total = 0;
+// Dropped since the last message which made it out
+static uint64_t dropped_pending = 0;
+
+static struct kanshi_log_entry ring[KANSHI_LOG_RING_SIZE];
+static size_t ring_start = 0, ring_len = 0;
+
+void kanshi_log_init(enum kanshi_log_level level) {
+	max_level = level;
+
+	struct stat st;
+	if (fstat(STDERR_FILENO, &st) != 0) {
+		return;
+	}
+	if (S_ISSOCK(st.st_mode)) {
+		// e.g. the journal stream, send() can be made non-blocking per call
+		log_fd_socket = true;
+		return;
+	}
+	if (!S_ISFIFO(st.st_mode) && !S_ISCHR(st.st_mode)) {
+		return;
+	}
+	// Setting O_NONBLOCK on the inherited file description would affect
+	// every other process sharing it, open a new one instead
+	int fd = open("/dev/fd/2", O_WRONLY | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+	if (fd >= 0) {
+		log_fd = fd;
+		log_fd_owned = true;
+	}
+}
+
+void kanshi_log_finish(void) {
+	if (log_fd_owned) {
+		close(log_fd);
+	}
+	log_fd = STDERR_FILENO;
+	log_fd_owned = false;
+}
+
+bool kanshi_log_parse_level(const char *str, enum kanshi_log_level *level) {
+	for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+		if (strcmp(str, level_names[i]) == 0) {
+			*level = (enum kanshi_log_level)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *kanshi_log_level_name(enum kanshi_log_level level) {
+	return level_names[level];
+}
+
+uint64_t kanshi_log_dropped(void) {
+	return dropped_total;
+}
+
+size_t kanshi_log_ring_len(void) {
+	return ring_len;
+}
+
+const struct kanshi_log_entry *kanshi_log_ring_get(size_t index) {
+	if (index >= ring_len) {
+		return NULL;
+	}
+	return &ring[(ring_start + index) % KANSHI_LOG_RING_SIZE];
+}
+
+static struct kanshi_log_entry *ring_push(void) {
+	if (ring_len < KANSHI_LOG_RING_SIZE) {
+		return &ring[(ring_start + ring_len++) % KANSHI_LOG_RING_SIZE];
+	}
+	struct kanshi_log_entry *entry = &ring[ring_start];
+	ring_start = (ring_start + 1) % KANSHI_LOG_RING_SIZE;
+	return entry;
+}
+
+static bool write_raw(const char *buf, size_t len) {
+	ssize_t n;
+	do {
+		if (log_fd_socket) {
+			n = send(log_fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} else {
+			n = write(log_fd, buf, len);
+		}
+	} while (n < 0 && errno == EINTR);
+	if (n == (ssize_t)len) {
+		return true;
+	}
+	if (n > 0) {
+		need_newline = true;
+	}
+	return false;
+}
+
+static void write_line(const char *buf, size_t len) {
+	if (need_newline) {
+		if (!write_raw("\n", 1)) {
+			goto drop;
+		}
+		need_newline = false;
+	}
+	if (dropped_pending > 0) {
+		char note[64];
+		int n = snprintf(note, sizeof(note),
+			"warning: %" PRIu64 " log messages dropped\n", dropped_pending);
+		if (!write_raw(note, (size_t)n)) {
+			goto drop;
+		}
+		dropped_pending = 0;
+	}
+	if (write_raw(buf, len)) {
+		return;
+	}
+
+drop:
+	dropped_total++;
+	dropped_pending++;
+}
+
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+		__attribute__((format(printf, 4, 5)));
+
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+	if (*len >= size) {
+		return;
+	}
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+	if (n > 0) {
+		*len += (size_t)n;
+	}
+}
+
+static void append_string_field(char *buf, size_t size, size_t *len,
+		const char *key, const char *value) {
+	if (strcspn(value, " \"=") == strlen(value) && value[0] != '\0') {
+		append(buf, size, len, " %s=%s", key, value);
+		return;
+	}
+	append(buf, size, len, " %s=\"", key);
+	for (const char *p = value; *p != '\0'; p++) {
+		append(buf, size, len, "%s%c", *p == '"' || *p == '\\' ? "\\" : "", *p);
+	}
+	append(buf, size, len, "\"");
+}
+
+void kanshi_log(enum kanshi_log_level level,
+		const struct kanshi_log_fields *fields, const char *fmt, ...) {
+	char message[512];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	struct kanshi_log_fields empty = {0};
+	if (fields == NULL) {
+		fields = &empty;
+	}
+
+	struct kanshi_log_entry *entry = ring_push();
+	clock_gettime(CLOCK_REALTIME, &entry->time);
+	entry->level = level;
+	// Long messages are cut, the precision tells the compiler it's on purpose
+	snprintf(entry->message, sizeof(entry->message), "%.*s",
+		(int)sizeof(entry->message) - 1, message);
+	snprintf(entry->profile, sizeof(entry->profile), "%s",
+		fields->profile != NULL ? fields->profile : "");
+	snprintf(entry->head, sizeof(entry->head), "%s",
+		fields->head != NULL ? fields->head : "");
+	entry->serial = fields->serial;
+	entry->line = fields->line;
+
+	if (level > max_level) {
+		return;
+	}
+
+	// Keep room for the trailing newline
+	char buf[1024];
+	size_t size = sizeof(buf) - 1, len = 0;
+	append(buf, size, &len, "%s: %s", level_names[level], message);
+	if (fields->display != NULL) {
+		append_string_field(buf, size, &len, "display", fields->display);
+	}
+	if (fields->profile != NULL) {
+		append_string_field(buf, size, &len, "profile", fields->profile);
+	}
+	if (fields->head != NULL) {
+		append_string_field(buf, size, &len, "head", fields->head);
+	}
+	if (fields->serial != 0) {
+		append(buf, size, &len, " serial=%" PRIu32, fields->serial);
+	}
+	if (fields->line != 0) {
+		append(buf, size, &len, " line=%d", fields->line);
+	}
+	if (len > size - 1) {
+		len = size - 1;
+	}
+	buf[len++] = '\n';
+	write_line(buf, len);
+}
@@ -2,194 +2,444 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
 #include "config.h"
 #include "kanshi.h"
+#include "control.h"
+#include "exec.h"
 #include "ipc.h"
+#include "log.h"
+#include "match.h"
+#include "metrics.h"
+#include "notify.h"
+#include "replay.h"
+#include "status.h"
 #include "wlr-output-management-unstable-v1-client-protocol.h"
 
-#define HEADS_MAX 64
-
 static bool match_and_apply(struct kanshi_state *state,
 	kanshi_apply_done_func callback, void *data);
+static void drain_apply_queue(struct kanshi_state *state);
+static void check_ready(struct kanshi_state *state);
+static void send_staged_rest(struct kanshi_state *state, bool heads_changed);
 
-static bool match_profile_output(struct kanshi_profile_output *output,
-		struct kanshi_head *head) {
-	const char *make = head->make ? head->make : "Unknown";
-	const char *model = head->model ? head->model : "Unknown";
-	const char *serial_number =
-		head->serial_number ? head->serial_number : "Unknown";
-
-	char identifier[1024];
-	assert(sizeof(identifier) >= strlen(make) + strlen(model) + strlen(serial_number) + 3);
-	snprintf(identifier, sizeof(identifier), "%s %s %s", make, model, serial_number);
+static uint32_t object_id(struct kanshi_state *state, void *object) {
+	if (state->replay != NULL) {
+		return (uint32_t)(uintptr_t)object;
+	}
+	return wl_proxy_get_id(object);
+}
 
-	return strcmp(output->name, "*") == 0 ||
-		strcmp(output->name, head->name) == 0 ||
-		strcmp(output->name, identifier) == 0;
+// Describe the heads in the order of state->heads, without their modes
+static size_t get_head_infos(struct kanshi_state *state,
+		struct kanshi_head_info heads[static KANSHI_HEADS_MAX]) {
+	size_t heads_len = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		heads[heads_len++] = (struct kanshi_head_info){
+			.name = head->name,
+			.make = head->make,
+			.model = head->model,
+			.serial_number = head->serial_number,
+			.enabled = head->enabled,
+		};
+	}
+	return heads_len;
 }
 
 static bool match_profile(struct kanshi_state *state,
 		struct kanshi_profile *profile,
-		struct kanshi_profile_output *matches[static HEADS_MAX]) {
-	if (wl_list_length(&profile->outputs) != wl_list_length(&state->heads)) {
-		return false;
-	}
-
-	memset(matches, 0, HEADS_MAX * sizeof(struct kanshi_head *));
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	struct kanshi_head_info heads[KANSHI_HEADS_MAX];
+	size_t heads_len = get_head_infos(state, heads);
+	return kanshi_match_profile(profile, heads, heads_len, matches);
+}
 
-	// Wildcards are stored at the end of the list, so those will be matched
-	// last
-	struct kanshi_profile_output *profile_output;
-	wl_list_for_each(profile_output, &profile->outputs, link) {
-		bool output_matched = false;
-		ssize_t i = -1;
-		struct kanshi_head *head;
-		wl_list_for_each(head, &state->heads, link) {
-			i++;
+static struct kanshi_profile *match(struct kanshi_state *state,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	struct kanshi_head_info heads[KANSHI_HEADS_MAX];
+	size_t heads_len = get_head_infos(state, heads);
+	return kanshi_match(state->ctx->config, heads, heads_len, matches);
+}
 
-			if (matches[i] != NULL) {
-				continue; // already matched
-			}
+struct head_ref {
+	struct kanshi_head *head;
+	size_t index; // position in state->heads
+};
 
-			if (match_profile_output(profile_output, head)) {
-				matches[i] = profile_output;
-				output_matched = true;
-				break;
-			}
-		}
+static int compare_head_refs(const void *a, const void *b) {
+	const struct head_ref *ref_a = a, *ref_b = b;
+	return strcmp(ref_a->head->name, ref_b->head->name);
+}
 
-		if (!output_matched) {
-			return false;
-		}
+static uint64_t hash_fnv1a(const char *data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3;
 	}
+	return hash;
+}
 
-	return true;
+static void clear_match_cache(struct kanshi_state *state) {
+	for (size_t i = 0; i < KANSHI_MATCH_CACHE_SIZE; i++) {
+		struct kanshi_match_cache_entry *entry = &state->match_cache[i];
+		free(entry->key);
+		free(entry->outputs);
+		*entry = (struct kanshi_match_cache_entry){0};
+	}
 }
 
-static struct kanshi_profile *match(struct kanshi_state *state,
-		struct kanshi_profile_output *matches[static HEADS_MAX]) {
-	struct kanshi_profile *profile;
-	wl_list_for_each(profile, &state->config->profiles, link) {
-		if (match_profile(state, profile, matches)) {
-			return profile;
+// Builds a key from the identities of the connected heads, refs is filled
+// with the heads sorted by name
+static char *head_set_key(struct kanshi_state *state,
+		struct head_ref refs[static KANSHI_HEADS_MAX], size_t *heads_len_ptr,
+		size_t *key_size) {
+	// Names are unique, sorting by name gives a canonical head order
+	size_t heads_len = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		refs[heads_len] = (struct head_ref){ .head = head, .index = heads_len };
+		heads_len++;
+	}
+	qsort(refs, heads_len, sizeof(refs[0]), compare_head_refs);
+
+	char *key = NULL;
+	*key_size = 0;
+	FILE *f = open_memstream(&key, key_size);
+	for (size_t i = 0; i < heads_len; i++) {
+		head = refs[i].head;
+		const char *fields[] = {
+			head->name,
+			head->make ? head->make : "Unknown",
+			head->model ? head->model : "Unknown",
+			head->serial_number ? head->serial_number : "Unknown",
+		};
+		for (size_t j = 0; j < sizeof(fields) / sizeof(fields[0]); j++) {
+			fwrite(fields[j], 1, strlen(fields[j]) + 1, f);
 		}
 	}
-	return NULL;
+	fclose(f);
+	*heads_len_ptr = heads_len;
+	return key;
 }
 
+static uint64_t head_set_hash(struct kanshi_state *state) {
+	struct head_ref refs[KANSHI_HEADS_MAX];
+	size_t heads_len, key_size;
+	char *key = head_set_key(state, refs, &heads_len, &key_size);
+	uint64_t hash = hash_fnv1a(key, key_size);
+	free(key);
+	return hash;
+}
 
-static void exec_command(char *cmd) {
-	pid_t child, grandchild;
-	// Fork process
-	if ((child = fork()) == 0) {
-		// Fork child process again so we can unparent the process
-		setsid();
-		sigset_t set;
-		sigemptyset(&set);
-		sigprocmask(SIG_SETMASK, &set, NULL);
+// Same as match(), but memoized by the identities of the connected heads
+static struct kanshi_profile *match_cached(struct kanshi_state *state,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	struct head_ref refs[KANSHI_HEADS_MAX];
+	size_t heads_len, key_size;
+	char *key = head_set_key(state, refs, &heads_len, &key_size);
+	uint64_t hash = hash_fnv1a(key, key_size);
+
+	struct kanshi_match_cache_entry *victim = &state->match_cache[0];
+	for (size_t i = 0; i < KANSHI_MATCH_CACHE_SIZE; i++) {
+		struct kanshi_match_cache_entry *entry = &state->match_cache[i];
+		if (entry->key != NULL && entry->hash == hash &&
+				entry->config_generation == state->ctx->config_generation &&
+				entry->key_size == key_size &&
+				memcmp(entry->key, key, key_size) == 0) {
+			entry->last_used = ++state->match_cache_tick;
+			for (size_t j = 0; j < heads_len && entry->profile != NULL; j++) {
+				matches[refs[j].index] = entry->outputs[j];
+			}
+			free(key);
+			return entry->profile;
+		}
+		if (entry->last_used < victim->last_used) {
+			victim = entry;
+		}
+	}
 
-		struct sigaction action;
-		sigfillset(&action.sa_mask);
-		action.sa_flags = 0;
-		action.sa_handler = SIG_DFL;
-		sigaction(SIGINT, &action, NULL);
-		sigaction(SIGQUIT, &action, NULL);
-		sigaction(SIGTERM, &action, NULL);
-		sigaction(SIGHUP, &action, NULL);
+	struct kanshi_profile *profile = match(state, matches);
 
-		if ((grandchild = fork()) == 0) {
-			execl("/bin/sh", "/bin/sh", "-c", cmd, (void *)NULL);
-			fprintf(stderr, "Executing command '%s' failed: %s\n", cmd, strerror(errno));
-			_exit(-1);
+	free(victim->key);
+	free(victim->outputs);
+	*victim = (struct kanshi_match_cache_entry){
+		.key = key,
+		.key_size = key_size,
+		.hash = hash,
+		.config_generation = state->ctx->config_generation,
+		.last_used = ++state->match_cache_tick,
+		.profile = profile,
+	};
+	if (profile != NULL) {
+		victim->outputs = calloc(heads_len, sizeof(victim->outputs[0]));
+		if (victim->outputs == NULL) {
+			// Leave the entry unused, the result is still valid
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			free(victim->key);
+			*victim = (struct kanshi_match_cache_entry){0};
+			return profile;
 		}
-		if (grandchild < 0) {
-			fprintf(stderr, "Impossible to fork a new process to execute"
-					" command '%s': %s\n", cmd, strerror(errno));
-			_exit(1);
+		for (size_t i = 0; i < heads_len; i++) {
+			victim->outputs[i] = matches[refs[i].index];
 		}
-		_exit(0); // Close child process
 	}
+	return profile;
+}
 
-	if (child < 0) {
-		perror("Impossible to fork a new process");
-		return;
-	}
+static double elapsed_since(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-	// cleanup child process
-	if (waitpid(child, NULL, 0) < 0) {
-		perror("Impossible to clean up child process");
-	}
+static void destroy_pending(struct kanshi_pending_profile *pending) {
+	kanshi_timer_disarm(&pending->timeout);
+	kanshi_exec_layout_destroy(pending->layout);
+	free(pending);
+}
+
+static struct kanshi_log_fields pending_log_fields(
+		const struct kanshi_pending_profile *pending) {
+	return (struct kanshi_log_fields){
+		.display = pending->state->name,
+		.profile = pending->profile != NULL ? pending->profile->name : NULL,
+		.serial = pending->serial,
+	};
 }
 
 static void config_handle_succeeded(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
-	zwlr_output_configuration_v1_destroy(config);
+	// config is NULL when replaying
+	if (config != NULL) {
+		zwlr_output_configuration_v1_destroy(config);
+	}
 
 	struct kanshi_state *state = pending->state;
 	struct kanshi_profile *profile = pending->profile;
+	kanshi_record(state, "succeeded");
+	struct kanshi_log_fields fields = pending_log_fields(pending);
+	if (pending->modeset) {
+		pending->blank_time += elapsed_since(&pending->sent);
+	}
+	if (pending->stage == KANSHI_STAGE_DISABLE) {
+		// The rest of the profile is sent with the serial of the next done
+		// event, the configuration stays in flight until then
+		kanshi_log(KANSHI_LOG_DEBUG, &fields, "outgoing outputs disabled");
+		pending->config = NULL;
+		pending->stage = KANSHI_STAGE_WAIT;
+		if (state->serial != pending->serial) {
+			// The done event for the new state came first
+			send_staged_rest(state, false);
+			check_ready(state);
+		}
+		return;
+	}
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_APPLIES_SUCCEEDED);
+	kanshi_metrics_observe_since(&state->ctx->metrics,
+		KANSHI_HISTOGRAM_APPLY_LATENCY, &pending->start);
+	if (pending->blank_time > 0) {
+		kanshi_metrics_observe(&state->ctx->metrics,
+			KANSHI_HISTOGRAM_BLANK_TIME, pending->blank_time);
+		kanshi_log(KANSHI_LOG_DEBUG, &fields,
+			"outputs changed modes for %.1f ms", pending->blank_time * 1000);
+	}
+	state->inflight = NULL;
 
-	struct kanshi_profile_command *command;
-	wl_list_for_each(command, &profile->commands, link) {
-		fprintf(stderr, "running command '%s'\n", command->command);
-		exec_command(command->command);
+	if (profile == NULL) {
+		kanshi_log(KANSHI_LOG_INFO, &fields,
+			"configuration from the previous config applied");
+		goto out;
 	}
 
-	fprintf(stderr, "configuration for profile '%s' applied\n", profile->name);
+	kanshi_exec_layout_destroy(state->exec_layout);
+	state->exec_layout = pending->layout;
+	pending->layout = NULL;
+	kanshi_exec_profile_commands(state, profile, &fields);
+
+	kanshi_log(KANSHI_LOG_INFO, &fields, "configuration applied");
+	state->retry_backoff = 0;
+	state->retry_attempts = 0;
 	state->current_profile = profile;
 	if (profile == state->pending_profile) {
 		state->pending_profile = NULL;
 	}
+	kanshi_publish_status(state);
+
+out:
 	if (pending->callback != NULL) {
-		pending->callback(pending->callback_data, true);
+		pending->callback(pending->callback_data, KANSHI_APPLY_SUCCEEDED,
+			pending->profile);
 	}
-	free(pending);
+	destroy_pending(pending);
+	drain_apply_queue(state);
+	check_ready(state);
 }
 
 static void config_handle_failed(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
-	zwlr_output_configuration_v1_destroy(config);
-	fprintf(stderr, "failed to apply configuration for profile '%s'\n",
-			pending->profile->name);
-	if (pending->profile == pending->state->pending_profile) {
-		pending->state->pending_profile = NULL;
+	struct kanshi_state *state = pending->state;
+	if (config != NULL) {
+		zwlr_output_configuration_v1_destroy(config);
+	}
+	kanshi_record(state, "failed");
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_APPLIES_FAILED);
+	kanshi_metrics_observe_since(&state->ctx->metrics,
+		KANSHI_HISTOGRAM_APPLY_LATENCY, &pending->start);
+	struct kanshi_log_fields fields = pending_log_fields(pending);
+	kanshi_log(KANSHI_LOG_ERROR, &fields, "failed to apply configuration");
+	state->inflight = NULL;
+	if (pending->profile == state->pending_profile) {
+		state->pending_profile = NULL;
 	}
+	kanshi_publish_status(state);
 	if (pending->callback != NULL) {
-		pending->callback(pending->callback_data, false);
+		pending->callback(pending->callback_data, KANSHI_APPLY_FAILED, NULL);
 	}
-	free(pending);
+	destroy_pending(pending);
+	drain_apply_queue(state);
+	check_ready(state);
+}
+
+static void state_handle_retry(void *data) {
+	struct kanshi_state *state = data;
+	if (state->serial == state->retry_serial) {
+		// The compositor hasn't sent its new state yet
+		state->needs_match = true;
+	} else {
+		match_and_apply(state, NULL, NULL);
+	}
+	check_ready(state);
+}
+
+// Retry a cancelled configuration after an exponential backoff delay, so that
+// a compositor whose outputs keep changing isn't flooded with configurations.
+// Retries with the same heads are capped, past that kanshi waits for the
+// outputs to change.
+static void schedule_retry(struct kanshi_state *state, uint32_t serial) {
+	struct kanshi_log_fields fields = {
+		.display = state->name,
+		.serial = serial,
+	};
+
+	uint64_t head_set = head_set_hash(state);
+	if (head_set != state->retry_head_set) {
+		state->retry_head_set = head_set;
+		state->retry_attempts = 0;
+	}
+	if (state->retry_attempts >= KANSHI_RETRY_ATTEMPTS_MAX) {
+		state->retries_exhausted++;
+		kanshi_metrics_inc(&state->ctx->metrics,
+			KANSHI_COUNTER_RETRIES_EXHAUSTED);
+		kanshi_log(KANSHI_LOG_WARNING, &fields, "configuration cancelled %u "
+			"times, waiting for the outputs to change", state->retry_attempts);
+		return;
+	}
+
+	int delay_ms = KANSHI_RETRY_DELAY_MIN_MS;
+	for (unsigned int i = 0; i < state->retry_backoff &&
+			delay_ms < KANSHI_RETRY_DELAY_MAX_MS; i++) {
+		delay_ms *= 2;
+	}
+	if (delay_ms > KANSHI_RETRY_DELAY_MAX_MS) {
+		delay_ms = KANSHI_RETRY_DELAY_MAX_MS;
+	} else {
+		state->retry_backoff++;
+	}
+	// Jitter, so that several clients cancelled together don't retry together
+	delay_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);
+
+	state->retry_attempts++;
+	state->retry_serial = serial;
+	state->retries++;
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_RETRIES);
+	kanshi_log(KANSHI_LOG_DEBUG, &fields, "retrying in %d ms", delay_ms);
+	kanshi_timer_arm(state->ctx, &state->retry_timer, delay_ms);
 }
 
 static void config_handle_cancelled(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
-	zwlr_output_configuration_v1_destroy(config);
-	// Wait for new serial
-	fprintf(stderr, "configuration for profile '%s' cancelled, retrying\n",
-			pending->profile->name);
-	if (pending->profile == pending->state->pending_profile) {
-		pending->state->pending_profile = NULL;
-	}
-	if (pending->serial != pending->state->serial) {
-		// We've already received a new serial, try re-applying the profile
-		// immediately
-		match_and_apply(pending->state, NULL, NULL);
+	struct kanshi_state *state = pending->state;
+	if (config != NULL) {
+		zwlr_output_configuration_v1_destroy(config);
+	}
+	kanshi_record(state, "cancelled");
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_APPLIES_CANCELLED);
+	kanshi_metrics_observe_since(&state->ctx->metrics,
+		KANSHI_HISTOGRAM_APPLY_LATENCY, &pending->start);
+	struct kanshi_log_fields fields = pending_log_fields(pending);
+	kanshi_log(KANSHI_LOG_WARNING, &fields, "configuration cancelled, retrying");
+	state->inflight = NULL;
+	if (pending->profile == state->pending_profile) {
+		state->pending_profile = NULL;
 	}
+	kanshi_publish_status(state);
 	if (pending->callback != NULL) {
-		pending->callback(pending->callback_data, false);
+		pending->callback(pending->callback_data, KANSHI_APPLY_FAILED, NULL);
 	}
-	free(pending);
+	uint32_t serial = pending->serial;
+	destroy_pending(pending);
+
+	if (state->queued.queued) {
+		// A newer request replaces the retry
+		drain_apply_queue(state);
+	} else if (state->replay == NULL) {
+		schedule_retry(state, serial);
+	} else if (serial != state->serial) {
+		// Timers don't run while replaying. We've already received a new
+		// serial, try re-applying the profile immediately.
+		match_and_apply(state, NULL, NULL);
+	} else {
+		// Wait for new serial
+		state->needs_match = true;
+	}
+	check_ready(state);
+}
+
+static void pending_handle_timeout(void *data) {
+	struct kanshi_pending_profile *pending = data;
+	struct kanshi_state *state = pending->state;
+	// The compositor may still answer, but nobody is listening anymore
+	if (pending->config != NULL) {
+		zwlr_output_configuration_v1_destroy(pending->config);
+	}
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_APPLIES_TIMED_OUT);
+	kanshi_metrics_observe_since(&state->ctx->metrics,
+		KANSHI_HISTOGRAM_APPLY_LATENCY, &pending->start);
+	struct kanshi_log_fields fields = pending_log_fields(pending);
+	kanshi_log(KANSHI_LOG_WARNING, &fields,
+		"compositor didn't answer the configuration in %d ms, retrying",
+		state->ctx->apply_timeout_ms);
+	state->inflight = NULL;
+	if (pending->profile == state->pending_profile) {
+		state->pending_profile = NULL;
+	}
+	kanshi_publish_status(state);
+	if (pending->callback != NULL) {
+		pending->callback(pending->callback_data, KANSHI_APPLY_TIMED_OUT,
+			NULL);
+	}
+	destroy_pending(pending);
+
+	if (state->queued.queued) {
+		drain_apply_queue(state);
+	} else {
+		match_and_apply(state, NULL, NULL);
+	}
+	check_ready(state);
 }
 
 static const struct zwlr_output_configuration_v1_listener config_listener = {
@@ -198,146 +448,351 @@ static const struct zwlr_output_configuration_v1_listener config_listener = {
 	.cancelled = config_handle_cancelled,
 };
 
-static bool match_refresh(const struct kanshi_mode *mode, int refresh, int *delta) {
-	int v = refresh - mode->refresh;
-	int mode_delta = abs(v);
-	/* If we have a refresh, pick one with the lowest delta from our target.
-	 * Doing a simple fuzzy match that picks the greatest (due to ordering) here can lead us to picking a refresh
-	 * such as 120.01 or 60.01, which is problematic for two reasons:
-	 *  - Modes such as 4K 120.01Hz is too much for link bandwidth of DP 1.4 without DSC.
-	 *  - It becomes out of phase with the majority of content being displayed.
-	 */
-	if (mode_delta < 50 && mode_delta < *delta) {
-		*delta = mode_delta;
+// Whether applying config turns the head on or off or changes its mode
+static bool head_needs_modeset(const struct kanshi_head *head,
+		const struct kanshi_head_config *config) {
+	if (head->enabled != config->enabled) {
 		return true;
 	}
+	if (!config->enabled) {
+		return false;
+	}
+	if (config->fields & KANSHI_HEAD_CONFIG_CUSTOM_MODE) {
+		return head->mode != NULL ||
+			head->custom_mode.width != config->custom_mode.width ||
+			head->custom_mode.height != config->custom_mode.height ||
+			head->custom_mode.refresh != config->custom_mode.refresh;
+	}
+	if (config->fields & KANSHI_HEAD_CONFIG_MODE) {
+		return head->mode != &head->modes[config->mode];
+	}
 	return false;
 }
 
-static struct kanshi_mode *match_mode(struct kanshi_head *head,
-		int width, int height, int refresh) {
-	struct kanshi_mode *mode;
-	struct kanshi_mode *last_match = NULL;
-	int mode_delta = INT32_MAX;
+// Whether the head is already in the state described by config
+static bool head_matches_config(const struct kanshi_head *head,
+		const struct kanshi_head_config *config) {
+	if (head_needs_modeset(head, config)) {
+		return false;
+	}
+	if (!config->enabled) {
+		return true;
+	}
+	if ((config->fields & KANSHI_HEAD_CONFIG_POSITION) &&
+			(head->x != config->x || head->y != config->y)) {
+		return false;
+	}
+	if ((config->fields & KANSHI_HEAD_CONFIG_SCALE) &&
+			wl_fixed_from_double(head->scale) !=
+			wl_fixed_from_double(config->scale)) {
+		return false;
+	}
+	if ((config->fields & KANSHI_HEAD_CONFIG_TRANSFORM) &&
+			head->transform != (enum wl_output_transform)config->transform) {
+		return false;
+	}
+	if ((config->fields & KANSHI_HEAD_CONFIG_ADAPTIVE_SYNC) &&
+			head->adaptive_sync != config->adaptive_sync) {
+		return false;
+	}
+	return true;
+}
+
+// Keep the head in its current state
+static void leave_head(struct zwlr_output_configuration_v1 *config,
+		struct kanshi_head *head) {
+	if (config == NULL) {
+		return;
+	}
+	if (head->enabled) {
+		zwlr_output_configuration_head_v1_destroy(
+			zwlr_output_configuration_v1_enable_head(config, head->wlr_head));
+	} else {
+		zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
+	}
+}
 
-	wl_list_for_each(mode, &head->modes, link) {
-		if (mode->width != width || mode->height != height) {
-			continue;
+// A staged apply first disables the outgoing heads on their own, if other
+// heads change too
+static bool needs_disable_stage(struct kanshi_state *state,
+		const struct kanshi_head_config *configs) {
+	bool disables = false, changes = false;
+	size_t i = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		const struct kanshi_head_config *config = &configs[i++];
+		if (head->enabled && !config->enabled) {
+			disables = true;
+		} else if (!head_matches_config(head, config)) {
+			changes = true;
 		}
+	}
+	return disables && changes;
+}
 
-		if (refresh) {
-			if (match_refresh(mode, refresh, &mode_delta)) {
-				last_match = mode;
-			}
-		} else {
-			if (!last_match || mode->refresh > last_match->refresh) {
-				last_match = mode;
-			}
-		}
+// Returns NULL when replaying, the configuration is then only described by
+// the debug messages
+static struct zwlr_output_configuration_v1 *create_configuration(
+		struct kanshi_state *state, struct kanshi_pending_profile *pending) {
+	if (state->replay != NULL) {
+		return NULL;
 	}
+	struct zwlr_output_configuration_v1 *config =
+		zwlr_output_manager_v1_create_configuration(state->output_manager,
+		state->serial);
+	zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+	return config;
+}
 
-	return last_match;
+// Returns false if the replay can't take the configuration
+static bool submit_configuration(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	if (state->replay != NULL) {
+		return kanshi_replay_submit(state, pending);
+	}
+	zwlr_output_configuration_v1_apply(pending->config);
+	if (state->ctx->apply_timeout_ms > 0) {
+		kanshi_timer_arm(state->ctx, &pending->timeout,
+			state->ctx->apply_timeout_ms);
+	}
+	return true;
 }
 
-static bool apply_profile(struct kanshi_state *state,
-		struct kanshi_profile *profile, struct kanshi_profile_output **matches,
-		kanshi_apply_done_func callback, void *data) {
-	if (state->pending_profile == profile || state->current_profile == profile) {
-		if (callback != NULL) {
-			callback(data, true);
+static bool send_disable_stage(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending,
+		const struct kanshi_head_config *configs) {
+	struct zwlr_output_configuration_v1 *config =
+		create_configuration(state, pending);
+	pending->config = config;
+	pending->stage = KANSHI_STAGE_DISABLE;
+	pending->modeset = true;
+	clock_gettime(CLOCK_MONOTONIC, &pending->sent);
+
+	size_t i = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		const struct kanshi_head_config *head_config = &configs[i++];
+		if (head->enabled && !head_config->enabled) {
+			kanshi_log(KANSHI_LOG_DEBUG, &(struct kanshi_log_fields){
+				.profile = pending->profile->name,
+				.head = head->name,
+				.serial = pending->serial,
+			}, "disabling output first");
+			if (config != NULL) {
+				zwlr_output_configuration_v1_disable_head(config,
+					head->wlr_head);
+			}
+		} else {
+			leave_head(config, head);
 		}
-		return true;
 	}
 
-	fprintf(stderr, "applying profile '%s'\n", profile->name);
-
-	struct kanshi_pending_profile *pending = calloc(1, sizeof(*pending));
-	pending->serial = state->serial;
-	pending->state = state;
-	pending->profile = profile;
-	pending->callback = callback;
-	pending->callback_data = data;
-	state->pending_profile = profile;
+	return submit_configuration(state, pending);
+}
 
+static bool send_configuration(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending,
+		struct kanshi_profile_output **matches,
+		struct kanshi_head_config *configs) {
 	struct zwlr_output_configuration_v1 *config =
-		zwlr_output_manager_v1_create_configuration(state->output_manager,
-		state->serial);
-	zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+		create_configuration(state, pending);
+	pending->config = config;
+	pending->stage = KANSHI_STAGE_FINAL;
+	pending->modeset = false;
+	clock_gettime(CLOCK_MONOTONIC, &pending->sent);
 
 	ssize_t i = -1;
 	struct kanshi_head *head;
 	wl_list_for_each(head, &state->heads, link) {
 		i++;
-		struct kanshi_profile_output *profile_output = matches[i];
-
-		fprintf(stderr, "applying profile output '%s' on connected head '%s'\n",
-			profile_output->name, head->name);
-
-		bool enabled = head->enabled;
-		if (profile_output->fields & KANSHI_OUTPUT_ENABLED) {
-			enabled = profile_output->enabled;
+		struct kanshi_head_config *head_config = &configs[i];
+
+		struct kanshi_log_fields fields = {
+			.profile = pending->profile->name,
+			.head = head->name,
+			.serial = pending->serial,
+		};
+		if (head_needs_modeset(head, head_config)) {
+			pending->modeset = true;
+		}
+		if (pending->staged && head_matches_config(head, head_config)) {
+			kanshi_log(KANSHI_LOG_DEBUG, &fields, "leaving profile output '%s' "
+				"as it is", matches[i]->name);
+			leave_head(config, head);
+			continue;
+		}
+		kanshi_log(KANSHI_LOG_DEBUG, &fields, "applying profile output '%s'",
+			matches[i]->name);
+		if (config == NULL) {
+			continue;
 		}
 
-		if (!enabled) {
+		if (!head_config->enabled) {
 			zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
 			continue;
 		}
 
 		struct zwlr_output_configuration_head_v1 *config_head =
 			zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
-		if (profile_output->fields & KANSHI_OUTPUT_MODE) {
-			if (profile_output->mode.custom) {
-				fprintf(stderr, "applying the custom mode %s\n", profile_output->name);
-				zwlr_output_configuration_head_v1_set_custom_mode(config_head,
-					profile_output->mode.width, profile_output->mode.height, profile_output->mode.refresh);
-			} else {
-				struct kanshi_mode *mode = match_mode(head,
-					profile_output->mode.width, profile_output->mode.height,
-					profile_output->mode.refresh);
-				if (mode == NULL) {
-					fprintf(stderr,
-						"output '%s' doesn't support mode '%dx%d@%fHz'\n",
-						head->name,
-						profile_output->mode.width, profile_output->mode.height,
-						(float)profile_output->mode.refresh / 1000);
-					goto error;
-				}
-				zwlr_output_configuration_head_v1_set_mode(config_head,
-						mode->wlr_mode);
-			}
+		if (head_config->fields & KANSHI_HEAD_CONFIG_CUSTOM_MODE) {
+			kanshi_log(KANSHI_LOG_DEBUG, &fields, "applying custom mode");
+			zwlr_output_configuration_head_v1_set_custom_mode(config_head,
+				head_config->custom_mode.width, head_config->custom_mode.height,
+				head_config->custom_mode.refresh);
+		}
+		if (head_config->fields & KANSHI_HEAD_CONFIG_MODE) {
+			zwlr_output_configuration_head_v1_set_mode(config_head,
+				head->modes[head_config->mode].wlr_mode);
 		}
-		if (profile_output->fields & KANSHI_OUTPUT_POSITION) {
+		if (head_config->fields & KANSHI_HEAD_CONFIG_POSITION) {
 			zwlr_output_configuration_head_v1_set_position(config_head,
-				profile_output->position.x, profile_output->position.y);
+				head_config->x, head_config->y);
 		}
-		if (profile_output->fields & KANSHI_OUTPUT_SCALE) {
+		if (head_config->fields & KANSHI_HEAD_CONFIG_SCALE) {
 			zwlr_output_configuration_head_v1_set_scale(config_head,
-				wl_fixed_from_double(profile_output->scale));
+				wl_fixed_from_double(head_config->scale));
 		}
-		if (profile_output->fields & KANSHI_OUTPUT_TRANSFORM) {
+		if (head_config->fields & KANSHI_HEAD_CONFIG_TRANSFORM) {
 			zwlr_output_configuration_head_v1_set_transform(config_head,
-				profile_output->transform);
+				head_config->transform);
 		}
-		if (profile_output->fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+		if (head_config->fields & KANSHI_HEAD_CONFIG_ADAPTIVE_SYNC) {
 			zwlr_output_configuration_head_v1_set_adaptive_sync(config_head,
-				profile_output->adaptive_sync);
+				head_config->adaptive_sync);
 		}
 		zwlr_output_configuration_head_v1_destroy(config_head);
 	}
 
-	zwlr_output_configuration_v1_apply(config);
+	return submit_configuration(state, pending);
+}
+
+// Compute the desired state of a head, see kanshi_resolve_head()
+static bool resolve_head(struct kanshi_head *head,
+		const struct kanshi_profile_output *output,
+		struct kanshi_head_config *config) {
+	struct kanshi_head_mode *modes = NULL;
+	if (head->modes_len > 0) {
+		modes = malloc(head->modes_len * sizeof(modes[0]));
+		if (modes == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			return false;
+		}
+	}
+	for (size_t i = 0; i < head->modes_len; i++) {
+		modes[i] = (struct kanshi_head_mode){
+			.width = head->modes[i].width,
+			.height = head->modes[i].height,
+			.refresh = head->modes[i].refresh,
+			.preferred = head->modes[i].preferred,
+		};
+	}
+	struct kanshi_head_info info = {
+		.name = head->name,
+		.make = head->make,
+		.model = head->model,
+		.serial_number = head->serial_number,
+		.enabled = head->enabled,
+		.modes = modes,
+		.modes_len = head->modes_len,
+	};
+	bool ok = kanshi_resolve_head(&info, output, config);
+	free(modes);
+	return ok;
+}
+
+// Resolve modes before building the configuration, so that we don't have to
+// tear down a half-built one
+static bool resolve_heads(struct kanshi_state *state,
+		struct kanshi_profile *profile, struct kanshi_profile_output **matches,
+		struct kanshi_head_config configs[static KANSHI_HEADS_MAX]) {
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		struct kanshi_profile_output *profile_output = matches[i];
+		if (!resolve_head(head, profile_output, &configs[i])) {
+			struct kanshi_log_fields fields = {
+				.profile = profile->name,
+				.head = head->name,
+			};
+			if (profile_output->mode.policy != KANSHI_MODE_EXACT) {
+				kanshi_log(KANSHI_LOG_ERROR, &fields,
+					"output doesn't advertise any mode");
+			} else {
+				kanshi_log(KANSHI_LOG_ERROR, &fields,
+					"output doesn't support mode '%dx%d@%fHz'",
+					profile_output->mode.width, profile_output->mode.height,
+					(float)profile_output->mode.refresh / 1000);
+			}
+			return false;
+		}
+	}
 	return true;
+}
 
-error:
-	free(pending);
-	zwlr_output_configuration_v1_destroy(config);
-	return false;
+static bool apply_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile, struct kanshi_profile_output **matches,
+		kanshi_apply_done_func callback, void *data) {
+	if (state->pending_profile == profile || state->current_profile == profile) {
+		if (callback != NULL) {
+			callback(data, KANSHI_APPLY_SUCCEEDED, profile);
+		}
+		return true;
+	}
+
+	struct kanshi_head_config configs[KANSHI_HEADS_MAX];
+	if (!resolve_heads(state, profile, matches, configs)) {
+		return false;
+	}
+
+	kanshi_log(KANSHI_LOG_INFO, &(struct kanshi_log_fields){
+		.display = state->name,
+		.profile = profile->name,
+		.serial = state->serial,
+	}, "applying profile");
+
+	struct kanshi_pending_profile *pending = calloc(1, sizeof(*pending));
+	pending->serial = state->serial;
+	pending->state = state;
+	pending->profile = profile;
+	pending->callback = callback;
+	pending->callback_data = data;
+	clock_gettime(CLOCK_MONOTONIC, &pending->start);
+	kanshi_timer_init(&pending->timeout, pending_handle_timeout, pending);
+	// The new configuration replaces any scheduled retry
+	kanshi_timer_disarm(&state->retry_timer);
+	state->pending_profile = profile;
+	state->inflight = pending;
+	kanshi_publish_status(state);
+
+	kanshi_record(state, "apply %" PRIu32, state->serial);
+	// Commands don't run while replaying, they don't need the layout
+	if (state->replay == NULL) {
+		pending->layout = kanshi_exec_layout_create(state, profile, configs);
+	}
+	pending->staged = state->ctx->config->apply_strategy == KANSHI_APPLY_STAGED;
+	bool sent;
+	if (pending->staged && needs_disable_stage(state, configs)) {
+		sent = send_disable_stage(state, pending, configs);
+	} else {
+		sent = send_configuration(state, pending, matches, configs);
+	}
+	if (!sent) {
+		state->inflight = NULL;
+		state->pending_profile = NULL;
+		destroy_pending(pending);
+		return false;
+	}
+	return true;
 }
 
 
 static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
 		int32_t width, int32_t height) {
 	struct kanshi_mode *mode = data;
+	struct kanshi_state *state = mode->head->state;
+	kanshi_record(state, "size %" PRIu32 " %" PRId32 " %" PRId32,
+		object_id(state, wlr_mode), width, height);
 	mode->width = width;
 	mode->height = height;
 }
@@ -345,25 +800,56 @@ static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
 static void mode_handle_refresh(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode, int32_t refresh) {
 	struct kanshi_mode *mode = data;
+	struct kanshi_state *state = mode->head->state;
+	kanshi_record(state, "refresh %" PRIu32 " %" PRId32,
+		object_id(state, wlr_mode), refresh);
 	mode->refresh = refresh;
 }
 
 static void mode_handle_preferred(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_mode *mode = data;
+	struct kanshi_state *state = mode->head->state;
+	kanshi_record(state, "preferred %" PRIu32, object_id(state, wlr_mode));
 	mode->preferred = true;
 }
 
+// Point the listeners of the modes starting at start to their new location
+static void relink_modes(struct kanshi_head *head, size_t start) {
+	if (head->state->replay != NULL) {
+		return;
+	}
+	for (size_t i = start; i < head->modes_len; i++) {
+		zwlr_output_mode_v1_set_user_data(head->modes[i].wlr_mode,
+			&head->modes[i]);
+	}
+}
+
 static void mode_handle_finished(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_mode *mode = data;
-	wl_list_remove(&mode->link);
-	if (zwlr_output_mode_v1_get_version(mode->wlr_mode) >= 3) {
-		zwlr_output_mode_v1_release(mode->wlr_mode);
-	} else {
-		zwlr_output_mode_v1_destroy(mode->wlr_mode);
+	struct kanshi_head *head = mode->head;
+	struct kanshi_state *state = head->state;
+	kanshi_record(state, "mode_finished %" PRIu32, object_id(state, wlr_mode));
+	head->dirty |= KANSHI_HEAD_MODES;
+	if (state->replay == NULL) {
+		if (zwlr_output_mode_v1_get_version(mode->wlr_mode) >= 3) {
+			zwlr_output_mode_v1_release(mode->wlr_mode);
+		} else {
+			zwlr_output_mode_v1_destroy(mode->wlr_mode);
+		}
+	}
+
+	if (head->mode == mode) {
+		head->mode = NULL;
+	} else if (head->mode > mode) {
+		head->mode--;
 	}
-	free(mode);
+	size_t index = mode - head->modes;
+	head->modes_len--;
+	memmove(&head->modes[index], &head->modes[index + 1],
+		(head->modes_len - index) * sizeof(head->modes[0]));
+	relink_modes(head, index);
 }
 
 static const struct zwlr_output_mode_v1_listener mode_listener = {
@@ -373,21 +859,85 @@ static const struct zwlr_output_mode_v1_listener mode_listener = {
 	.finished = mode_handle_finished,
 };
 
+static void update_head_string(struct kanshi_head *head, const char **dst,
+		const char *value, enum kanshi_head_field field) {
+	if (*dst != NULL && strcmp(*dst, value) == 0) {
+		return;
+	}
+
+	// Rebuild the string block with the new value
+	const char **fields[] = {
+		&head->name,
+		&head->description,
+		&head->make,
+		&head->model,
+		&head->serial_number,
+	};
+	const size_t fields_len = sizeof(fields) / sizeof(fields[0]);
+	const char *values[sizeof(fields) / sizeof(fields[0])];
+	size_t offsets[sizeof(fields) / sizeof(fields[0])];
+	size_t size = 0;
+	for (size_t i = 0; i < fields_len; i++) {
+		values[i] = fields[i] == dst ? value : *fields[i];
+		if (values[i] != NULL) {
+			offsets[i] = size;
+			size += strlen(values[i]) + 1;
+		}
+	}
+
+	char buf[KANSHI_HEAD_STRINGS_INLINE];
+	char *strings = size <= sizeof(buf) ? buf : malloc(size);
+	if (strings == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+			.head = head->name,
+		}, "allocation failed, ignoring head property");
+		return;
+	}
+	for (size_t i = 0; i < fields_len; i++) {
+		if (values[i] != NULL) {
+			memcpy(&strings[offsets[i]], values[i], strlen(values[i]) + 1);
+		}
+	}
+	if (head->strings != head->strings_inline) {
+		free(head->strings);
+	}
+	if (strings == buf) {
+		memcpy(head->strings_inline, buf, size);
+		strings = head->strings_inline;
+	}
+	head->strings = strings;
+	for (size_t i = 0; i < fields_len; i++) {
+		*fields[i] = values[i] != NULL ? &strings[offsets[i]] : NULL;
+	}
+
+	head->dirty |= field;
+}
+
 static void head_handle_name(void *data,
 		struct zwlr_output_head_v1 *wlr_head, const char *name) {
 	struct kanshi_head *head = data;
-	head->name = strdup(name);
+	kanshi_record_string(head->state, "name",
+		object_id(head->state, wlr_head), name);
+	update_head_string(head, &head->name, name, KANSHI_HEAD_NAME);
 }
 
 static void head_handle_description(void *data,
 		struct zwlr_output_head_v1 *wlr_head, const char *description) {
 	struct kanshi_head *head = data;
-	head->description = strdup(description);
+	kanshi_record_string(head->state, "description",
+		object_id(head->state, wlr_head), description);
+	update_head_string(head, &head->description, description,
+		KANSHI_HEAD_DESCRIPTION);
 }
 
 static void head_handle_physical_size(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t width, int32_t height) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "physical_size %" PRIu32 " %" PRId32 " %" PRId32,
+		object_id(head->state, wlr_head), width, height);
+	if (head->phys_width != width || head->phys_height != height) {
+		head->dirty |= KANSHI_HEAD_PHYSICAL_SIZE;
+	}
 	head->phys_width = width;
 	head->phys_height = height;
 }
@@ -396,18 +946,53 @@ static void head_handle_mode(void *data,
 		struct zwlr_output_head_v1 *wlr_head,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "mode %" PRIu32 " %" PRIu32,
+		object_id(head->state, wlr_head), object_id(head->state, wlr_mode));
+	head->dirty |= KANSHI_HEAD_MODES;
+
+	if (head->modes_len == head->modes_cap) {
+		size_t cap = head->modes_cap == 0 ? 16 : 2 * head->modes_cap;
+		ssize_t current = head->mode != NULL ? head->mode - head->modes : -1;
+		struct kanshi_mode *modes =
+			realloc(head->modes, cap * sizeof(head->modes[0]));
+		if (modes == NULL) {
+			// Later events refer to the mode, the state of the head can't be
+			// kept in sync anymore
+			kanshi_log(KANSHI_LOG_ERROR, &(struct kanshi_log_fields){
+				.display = head->state->name,
+				.head = head->name,
+			}, "failed to allocate modes, disconnecting");
+			if (head->state->replay == NULL) {
+				zwlr_output_mode_v1_destroy(wlr_mode);
+			}
+			head->state->failed = true;
+			return;
+		}
+		head->modes = modes;
+		head->modes_cap = cap;
+		head->mode = current >= 0 ? &head->modes[current] : NULL;
+		relink_modes(head, 0);
+	}
 
-	struct kanshi_mode *mode = calloc(1, sizeof(*mode));
-	mode->head = head;
-	mode->wlr_mode = wlr_mode;
-	wl_list_insert(head->modes.prev, &mode->link);
+	struct kanshi_mode *mode = &head->modes[head->modes_len++];
+	*mode = (struct kanshi_mode){
+		.head = head,
+		.wlr_mode = wlr_mode,
+	};
 
-	zwlr_output_mode_v1_add_listener(wlr_mode, &mode_listener, mode);
+	if (head->state->replay == NULL) {
+		zwlr_output_mode_v1_add_listener(wlr_mode, &mode_listener, mode);
+	}
 }
 
 static void head_handle_enabled(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t enabled) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "enabled %" PRIu32 " %" PRId32,
+		object_id(head->state, wlr_head), enabled);
+	if (head->enabled != !!enabled) {
+		head->dirty |= KANSHI_HEAD_ENABLED;
+	}
 	head->enabled = !!enabled;
 	if (!enabled) {
 		head->mode = NULL;
@@ -418,20 +1003,34 @@ static void head_handle_current_mode(void *data,
 		struct zwlr_output_head_v1 *wlr_head,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_head *head = data;
-	struct kanshi_mode *mode;
-	wl_list_for_each(mode, &head->modes, link) {
-		if (mode->wlr_mode == wlr_mode) {
-			head->mode = mode;
-			return;
+	kanshi_record(head->state, "current_mode %" PRIu32 " %" PRIu32,
+		object_id(head->state, wlr_head), object_id(head->state, wlr_mode));
+	struct kanshi_mode *current = NULL;
+	for (size_t i = 0; i < head->modes_len; i++) {
+		if (head->modes[i].wlr_mode == wlr_mode) {
+			current = &head->modes[i];
+			break;
 		}
 	}
-	fprintf(stderr, "received unknown current_mode\n");
-	head->mode = NULL;
+	if (current == NULL) {
+		kanshi_log(KANSHI_LOG_WARNING, &(struct kanshi_log_fields){
+			.head = head->name,
+		}, "received unknown current_mode");
+	}
+	if (head->mode != current) {
+		head->dirty |= KANSHI_HEAD_CURRENT_MODE;
+	}
+	head->mode = current;
 }
 
 static void head_handle_position(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t x, int32_t y) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "position %" PRIu32 " %" PRId32 " %" PRId32,
+		object_id(head->state, wlr_head), x, y);
+	if (head->x != x || head->y != y) {
+		head->dirty |= KANSHI_HEAD_POSITION;
+	}
 	head->x = x;
 	head->y = y;
 }
@@ -439,56 +1038,86 @@ static void head_handle_position(void *data,
 static void head_handle_transform(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t transform) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "transform %" PRIu32 " %" PRId32,
+		object_id(head->state, wlr_head), transform);
+	if (head->transform != (enum wl_output_transform)transform) {
+		head->dirty |= KANSHI_HEAD_TRANSFORM;
+	}
 	head->transform = transform;
 }
 
 static void head_handle_scale(void *data,
 		struct zwlr_output_head_v1 *wlr_head, wl_fixed_t scale) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "scale %" PRIu32 " %" PRId32,
+		object_id(head->state, wlr_head), scale);
+	if (wl_fixed_from_double(head->scale) != scale) {
+		head->dirty |= KANSHI_HEAD_SCALE;
+	}
 	head->scale = wl_fixed_to_double(scale);
 }
 
+static void free_head(struct kanshi_head *head) {
+	if (head->strings != head->strings_inline) {
+		free(head->strings);
+	}
+	free(head->modes);
+	free(head);
+}
+
 static void head_handle_finished(void *data,
 		struct zwlr_output_head_v1 *wlr_head) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "head_finished %" PRIu32,
+		object_id(head->state, wlr_head));
+	head->state->needs_match = true;
 	wl_list_remove(&head->link);
-	if (zwlr_output_head_v1_get_version(head->wlr_head) >= 3) {
-		zwlr_output_head_v1_release(head->wlr_head);
-	} else {
-		zwlr_output_head_v1_destroy(head->wlr_head);
+	if (head->state->replay == NULL) {
+		if (zwlr_output_head_v1_get_version(head->wlr_head) >= 3) {
+			zwlr_output_head_v1_release(head->wlr_head);
+		} else {
+			zwlr_output_head_v1_destroy(head->wlr_head);
+		}
 	}
-	free(head->name);
-	free(head->description);
-	free(head->make);
-	free(head->model);
-	free(head->serial_number);
-	free(head);
+	free_head(head);
 }
 
 void head_handle_make(void *data,
 		struct zwlr_output_head_v1 *zwlr_output_head_v1,
 		const char *make) {
 	struct kanshi_head *head = data;
-	head->make = strdup(make);
+	kanshi_record_string(head->state, "make",
+		object_id(head->state, zwlr_output_head_v1), make);
+	update_head_string(head, &head->make, make, KANSHI_HEAD_MAKE);
 }
 
 void head_handle_model(void *data,
 		struct zwlr_output_head_v1 *zwlr_output_head_v1,
 		const char *model) {
 	struct kanshi_head *head = data;
-	head->model = strdup(model);
+	kanshi_record_string(head->state, "model",
+		object_id(head->state, zwlr_output_head_v1), model);
+	update_head_string(head, &head->model, model, KANSHI_HEAD_MODEL);
 }
 
 void head_handle_serial_number(void *data,
 		struct zwlr_output_head_v1 *zwlr_output_head_v1,
 		const char *serial_number) {
 	struct kanshi_head *head = data;
-	head->serial_number = strdup(serial_number);
+	kanshi_record_string(head->state, "serial_number",
+		object_id(head->state, zwlr_output_head_v1), serial_number);
+	update_head_string(head, &head->serial_number, serial_number,
+		KANSHI_HEAD_SERIAL_NUMBER);
 }
 
 static void head_handle_adaptive_sync(void *data,
 		struct zwlr_output_head_v1 *zwlr_output_head_v1, uint32_t state) {
 	struct kanshi_head *head = data;
+	kanshi_record(head->state, "adaptive_sync %" PRIu32 " %" PRIu32,
+		object_id(head->state, zwlr_output_head_v1), state);
+	if (head->adaptive_sync != !!state) {
+		head->dirty |= KANSHI_HEAD_ADAPTIVE_SYNC;
+	}
 	head->adaptive_sync = state;
 }
 
@@ -513,37 +1142,118 @@ static void output_manager_handle_head(void *data,
 		struct zwlr_output_manager_v1 *manager,
 		struct zwlr_output_head_v1 *wlr_head) {
 	struct kanshi_state *state = data;
+	kanshi_record(state, "head %" PRIu32, object_id(state, wlr_head));
+	state->needs_match = true;
 
 	struct kanshi_head *head = calloc(1, sizeof(*head));
 	head->state = state;
 	head->wlr_head = wlr_head;
 	head->scale = 1.0;
-	wl_list_init(&head->modes);
+	head->strings = head->strings_inline;
 	wl_list_insert(&state->heads, &head->link);
 
-	zwlr_output_head_v1_add_listener(wlr_head, &head_listener, head);
+	if (state->replay == NULL) {
+		zwlr_output_head_v1_add_listener(wlr_head, &head_listener, head);
+	}
+}
+
+static void supersede_queued_request(struct kanshi_state *state) {
+	struct kanshi_apply_request request = state->queued;
+	if (!request.queued) {
+		return;
+	}
+	state->queued = (struct kanshi_apply_request){0};
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_REQUESTS_SUPERSEDED);
+	kanshi_log(KANSHI_LOG_DEBUG, &(struct kanshi_log_fields){
+		.profile = request.profiles_len > 0 ? request.profiles[0]->name : NULL,
+	}, "queued request superseded");
+	free(request.profiles);
+	if (request.callback != NULL) {
+		request.callback(request.callback_data, KANSHI_APPLY_SUPERSEDED, NULL);
+	}
+}
+
+// Hold a request until the configuration in flight completes, so that the
+// compositor doesn't go through every intermediate configuration
+static bool queue_request(struct kanshi_state *state,
+		struct kanshi_profile **profiles, size_t profiles_len,
+		kanshi_apply_done_func callback, void *data) {
+	struct kanshi_profile **copy = NULL;
+	if (profiles_len > 0) {
+		copy = malloc(profiles_len * sizeof(*copy));
+		if (copy == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			return false;
+		}
+		memcpy(copy, profiles, profiles_len * sizeof(*copy));
+	}
+
+	supersede_queued_request(state);
+	state->queued = (struct kanshi_apply_request){
+		.queued = true,
+		.profiles = copy,
+		.profiles_len = profiles_len,
+		.callback = callback,
+		.callback_data = data,
+	};
+	kanshi_log(KANSHI_LOG_DEBUG, &(struct kanshi_log_fields){
+		.profile = profiles_len > 0 ? profiles[0]->name : NULL,
+		.serial = state->inflight->serial,
+	}, "request queued behind the configuration in flight");
+	return true;
+}
+
+static void drain_apply_queue(struct kanshi_state *state) {
+	struct kanshi_apply_request request = state->queued;
+	if (!request.queued || state->inflight != NULL) {
+		return;
+	}
+	state->queued = (struct kanshi_apply_request){0};
+
+	bool ok;
+	if (request.profiles_len == 0) {
+		ok = match_and_apply(state, request.callback, request.callback_data);
+	} else {
+		ok = kanshi_switch_any(state, request.profiles, request.profiles_len,
+			request.callback, request.callback_data);
+	}
+	free(request.profiles);
+	// The request was accepted when queued, report the outcome through the
+	// callback
+	if (!ok && request.callback != NULL) {
+		request.callback(request.callback_data, KANSHI_APPLY_NOT_MATCHED, NULL);
+	}
 }
 
 static bool match_and_apply(struct kanshi_state *state,
 		kanshi_apply_done_func callback, void *data) {
-	assert(wl_list_length(&state->heads) <= HEADS_MAX);
+	if (state->inflight != NULL) {
+		return queue_request(state, NULL, 0, callback, data);
+	}
+
+	assert(wl_list_length(&state->heads) <= KANSHI_HEADS_MAX);
 	// matches[i] gives the kanshi_profile_output for the i-th head
-	struct kanshi_profile_output *matches[HEADS_MAX];
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
 	if (state->current_profile != NULL &&
 			match_profile(state, state->current_profile, matches)) {
 		// keep the current profile if it still matches
 		if (callback != NULL) {
-			callback(data, true);
+			callback(data, KANSHI_APPLY_SUCCEEDED, state->current_profile);
 		}
 		return true;
 	}
-	struct kanshi_profile *profile = match(state, matches);
+	struct kanshi_profile *profile = match_cached(state, matches);
 	if (profile != NULL) {
+		kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_PROFILE_MATCHES);
 		if (apply_profile(state, profile, matches, callback, data)) {
 			return true;
 		}
 	} else {
-		fprintf(stderr, "no profile matched\n");
+		kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_PROFILE_MISSES);
+		kanshi_log(KANSHI_LOG_INFO, &(struct kanshi_log_fields){
+			.display = state->name,
+			.serial = state->serial,
+		}, "no profile matched");
 	}
 
 	// If a profile failed to match or apply, forget the current profile.
@@ -552,30 +1262,178 @@ static bool match_and_apply(struct kanshi_state *state,
 	// No profile will be matched in the intermediary state where only DP-1 is
 	// connected, however the profile needs to be re-applied for the final
 	// state.
-	state->current_profile = NULL;
+	if (state->current_profile != NULL) {
+		state->current_profile = NULL;
+		kanshi_publish_status(state);
+	}
+	return false;
+}
+
+bool kanshi_switch_any(struct kanshi_state *state,
+		struct kanshi_profile **profiles, size_t profiles_len,
+		kanshi_apply_done_func callback, void *data) {
+	if (state->inflight != NULL) {
+		return queue_request(state, profiles, profiles_len, callback, data);
+	}
+
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
+	for (size_t i = 0; i < profiles_len; i++) {
+		if (match_profile(state, profiles[i], matches) &&
+				apply_profile(state, profiles[i], matches, callback, data)) {
+			return true;
+		}
+	}
 	return false;
 }
 
 bool kanshi_switch(struct kanshi_state *state, struct kanshi_profile *profile,
 		kanshi_apply_done_func callback, void *data) {
-	struct kanshi_profile_output *matches[HEADS_MAX];
-	if (!match_profile(state, profile, matches)) {
-		return false;
+	return kanshi_switch_any(state, &profile, 1, callback, data);
+}
+
+static bool adhoc_profile_in_use(struct kanshi_state *state,
+		struct kanshi_profile *profile) {
+	if (profile == state->current_profile ||
+			profile == state->pending_profile ||
+			(state->inflight != NULL && state->inflight->profile == profile)) {
+		return true;
+	}
+	for (size_t i = 0; i < state->queued.profiles_len; i++) {
+		if (state->queued.profiles[i] == profile) {
+			return true;
+		}
 	}
+	return false;
+}
 
-	return apply_profile(state, profile, matches, callback, data);
+bool kanshi_apply_adhoc_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile,
+		kanshi_apply_done_func callback, void *data) {
+	struct kanshi_profile *other, *tmp;
+	wl_list_for_each_safe(other, tmp, &state->adhoc_profiles, link) {
+		if (!adhoc_profile_in_use(state, other)) {
+			destroy_profile(other);
+		}
+	}
+
+	wl_list_insert(&state->adhoc_profiles, &profile->link);
+	return kanshi_switch(state, profile, callback, data);
+}
+
+// Second stage of a staged apply, once the outgoing heads are disabled
+static void send_staged_rest(struct kanshi_state *state, bool heads_changed) {
+	struct kanshi_pending_profile *pending = state->inflight;
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
+	struct kanshi_head_config configs[KANSHI_HEADS_MAX];
+	if (!heads_changed && pending->profile != NULL &&
+			match_profile(state, pending->profile, matches) &&
+			resolve_heads(state, pending->profile, matches, configs)) {
+		pending->serial = state->serial;
+		if (state->replay == NULL) {
+			kanshi_exec_layout_destroy(pending->layout);
+			pending->layout =
+				kanshi_exec_layout_create(state, pending->profile, configs);
+		}
+		kanshi_record(state, "apply %" PRIu32, state->serial);
+		// A failed replay stops, the configuration in flight is destroyed
+		// with the display
+		send_configuration(state, pending, matches, configs);
+		return;
+	}
+
+	// The outputs or the config changed in the meantime
+	struct kanshi_log_fields fields = pending_log_fields(pending);
+	kanshi_log(KANSHI_LOG_WARNING, &fields,
+		"staged configuration interrupted, matching again");
+	state->inflight = NULL;
+	if (pending->profile == state->pending_profile) {
+		state->pending_profile = NULL;
+	}
+	// The outgoing outputs are disabled, the current profile doesn't
+	// describe the outputs anymore and has to be applied again
+	state->current_profile = NULL;
+	kanshi_publish_status(state);
+	if (pending->callback != NULL) {
+		pending->callback(pending->callback_data, KANSHI_APPLY_FAILED, NULL);
+	}
+	destroy_pending(pending);
+	if (state->queued.queued) {
+		drain_apply_queue(state);
+	} else {
+		match_and_apply(state, NULL, NULL);
+	}
 }
 
 static void output_manager_handle_done(void *data,
 		struct zwlr_output_manager_v1 *manager, uint32_t serial) {
 	struct kanshi_state *state = data;
+	kanshi_record(state, "done %" PRIu32, serial);
+	kanshi_metrics_inc(&state->ctx->metrics, KANSHI_COUNTER_DONE_EVENTS);
 	state->serial = serial;
-	match_and_apply(state, NULL, NULL);
+	state->initialized = true;
+
+	// Properties set by our own configurations don't affect matching, only
+	// re-match if the head set or the identity of a head has changed
+	bool needs_match = state->needs_match;
+	bool changed = state->needs_match;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (head->dirty & KANSHI_HEAD_MATCH_FIELDS) {
+			needs_match = true;
+		}
+		if (head->dirty != 0) {
+			changed = true;
+		}
+		head->dirty = 0;
+	}
+	state->needs_match = false;
+	if (changed) {
+		kanshi_publish_status(state);
+	}
+	if (state->inflight != NULL &&
+			state->inflight->stage == KANSHI_STAGE_WAIT) {
+		send_staged_rest(state, needs_match);
+	} else if (needs_match && !state->retry_timer.armed) {
+		// A scheduled retry matches the outputs again once its delay is over
+		match_and_apply(state, NULL, NULL);
+	}
+	check_ready(state);
+}
+
+// Readiness is notified once every display has settled its initial
+// configuration, so that clients started afterwards only see the final
+// output layout
+static void check_ready(struct kanshi_state *state) {
+	if (state->settled || state->replay != NULL || !state->initialized ||
+			state->needs_match || state->inflight != NULL ||
+			state->queued.queued || state->retry_timer.armed) {
+		return;
+	}
+	state->settled = true;
+	kanshi_check_ready(state->ctx);
+}
+
+void kanshi_check_ready(struct kanshi_context *ctx) {
+	if (ctx->ready || wl_list_empty(&ctx->displays)) {
+		return;
+	}
+	struct kanshi_state *display;
+	wl_list_for_each(display, &ctx->displays, link) {
+		if (!display->settled) {
+			return;
+		}
+	}
+	ctx->ready = true;
+	kanshi_notify_ready(ctx->ready_fd, ctx->notify_socket);
+	ctx->ready_fd = -1;
+	free(ctx->notify_socket);
+	ctx->notify_socket = NULL;
 }
 
 static void output_manager_handle_finished(void *data,
 		struct zwlr_output_manager_v1 *manager) {
-	// This space is intentionally left blank
+	struct kanshi_state *state = data;
+	kanshi_record(state, "finished");
 }
 
 static const struct zwlr_output_manager_v1_listener output_manager_listener = {
@@ -584,6 +1442,21 @@ static const struct zwlr_output_manager_v1_listener output_manager_listener = {
 	.finished = output_manager_handle_finished,
 };
 
+static void replay_handle_abandoned(struct kanshi_pending_profile *pending) {
+	if (pending->state->inflight == pending) {
+		pending->state->inflight = NULL;
+	}
+	destroy_pending(pending);
+}
+
+static const struct kanshi_replay_listeners replay_listeners = {
+	.output_manager = &output_manager_listener,
+	.head = &head_listener,
+	.mode = &mode_listener,
+	.config = &config_listener,
+	.abandoned = replay_handle_abandoned,
+};
+
 static void registry_handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct kanshi_state *state = data;
@@ -628,7 +1501,7 @@ static struct kanshi_config *read_config(const char *config) {
 		snprintf(config_path, sizeof(config_path), "%s/.config/%s",
 			home, config_filename);
 	} else {
-		fprintf(stderr, "HOME not set\n");
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "HOME not set");
 		return NULL;
 	}
 
@@ -637,50 +1510,304 @@ static struct kanshi_config *read_config(const char *config) {
 
 bool kanshi_reload_config(struct kanshi_state *state,
 		kanshi_apply_done_func callback, void *data) {
-	fprintf(stderr, "reloading config\n");
-	struct kanshi_config *config = read_config(state->config_arg);
+	struct kanshi_context *ctx = state->ctx;
+	kanshi_log(KANSHI_LOG_INFO, NULL, "reloading config");
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct kanshi_config *config = read_config(ctx->config_arg);
+	kanshi_metrics_observe_since(&ctx->metrics,
+		KANSHI_HISTOGRAM_RELOAD_DURATION, &start);
 	if (config == NULL) {
+		kanshi_metrics_inc(&ctx->metrics, KANSHI_COUNTER_RELOADS_FAILED);
 		return false;
 	}
-	destroy_config(state->config);
-	state->config = config;
-	state->pending_profile = NULL;
-	state->current_profile = NULL;
+	kanshi_metrics_inc(&ctx->metrics, KANSHI_COUNTER_RELOADS_SUCCEEDED);
+
+	struct kanshi_config *old_config = ctx->config;
+	ctx->config = config;
+	ctx->config_generation++;
+	struct kanshi_state *display;
+	wl_list_for_each(display, &ctx->displays, link) {
+		clear_match_cache(display);
+		if (display->inflight != NULL) {
+			display->inflight->profile = NULL;
+		}
+		display->pending_profile = NULL;
+		display->current_profile = NULL;
+		kanshi_publish_status(display);
+	}
+	// Queued requests refer to profiles of the old config. Their callbacks
+	// may send new requests, so only run them once the new config is in place.
+	wl_list_for_each(display, &ctx->displays, link) {
+		supersede_queued_request(display);
+	}
+	destroy_config(old_config);
+
+	wl_list_for_each(display, &ctx->displays, link) {
+		if (display != state) {
+			match_and_apply(display, NULL, NULL);
+		}
+	}
 	return match_and_apply(state, callback, data);
 }
 
+static void destroy_head(struct kanshi_head *head) {
+	wl_list_remove(&head->link);
+	// Replayed heads have no Wayland objects
+	if (head->state->display != NULL) {
+		for (size_t i = 0; i < head->modes_len; i++) {
+			zwlr_output_mode_v1_destroy(head->modes[i].wlr_mode);
+		}
+		zwlr_output_head_v1_destroy(head->wlr_head);
+	}
+	free_head(head);
+}
+
+void kanshi_destroy_display(struct kanshi_state *state) {
+	// The IPC clients are about to be disconnected, drop the requests without
+	// running their callbacks
+	if (state->queued.queued) {
+		free(state->queued.profiles);
+		state->queued = (struct kanshi_apply_request){0};
+	}
+	if (state->inflight != NULL) {
+		if (state->inflight->config != NULL) {
+			zwlr_output_configuration_v1_destroy(state->inflight->config);
+		}
+		destroy_pending(state->inflight);
+		state->inflight = NULL;
+	}
+	kanshi_timer_disarm(&state->retry_timer);
+	kanshi_finish_exec(state);
+
+	kanshi_finish_status(state);
+	kanshi_finish_control(state);
+#if KANSHI_HAS_VARLINK
+	kanshi_finish_ipc(state);
+#endif
+
+	struct kanshi_profile *profile, *tmp_profile;
+	wl_list_for_each_safe(profile, tmp_profile, &state->adhoc_profiles, link) {
+		destroy_profile(profile);
+	}
+	clear_match_cache(state);
+
+	struct kanshi_head *head, *tmp_head;
+	wl_list_for_each_safe(head, tmp_head, &state->heads, link) {
+		destroy_head(head);
+	}
+	if (state->output_manager != NULL) {
+		zwlr_output_manager_v1_destroy(state->output_manager);
+	}
+	if (state->registry != NULL) {
+		wl_registry_destroy(state->registry);
+	}
+	if (state->display != NULL) {
+		wl_display_disconnect(state->display);
+	}
+	wl_list_remove(&state->link);
+	free(state);
+}
+
+static const char *display_name(const char *name) {
+	return name != NULL ? name : "default display";
+}
+
+static struct kanshi_state *connect_display(struct kanshi_context *ctx,
+		const char *name, int listen_fd, struct kanshi_recorder *recorder) {
+	struct kanshi_state *state = calloc(1, sizeof(*state));
+	if (state == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+		return NULL;
+	}
+	state->ctx = ctx;
+	state->name = name;
+	state->needs_match = true;
+	state->recorder = recorder;
+	wl_list_init(&state->heads);
+	wl_list_init(&state->adhoc_profiles);
+	wl_list_init(&state->command_runs);
+	kanshi_timer_init(&state->retry_timer, state_handle_retry, state);
+	wl_list_insert(ctx->displays.prev, &state->link);
+
+	state->display = wl_display_connect(name);
+	if (state->display == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to connect to %s",
+			display_name(name));
+		goto error;
+	}
+
+#if KANSHI_HAS_VARLINK
+	if (kanshi_init_ipc(state, listen_fd) != 0) {
+		goto error;
+	}
+#else
+	(void)listen_fd;
+#endif
+	if (kanshi_init_control(state) != 0) {
+		goto error;
+	}
+	kanshi_init_status(state);
+
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	if (wl_display_roundtrip(state->display) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "wl_display_roundtrip() failed "
+			"on %s", display_name(name));
+		goto error;
+	}
+
+	if (state->output_manager == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "compositor doesn't support "
+			"wlr-output-management-unstable-v1 on %s", display_name(name));
+		goto error;
+	}
+
+	return state;
+
+error:
+	kanshi_destroy_display(state);
+	return NULL;
+}
+
 static const char usage[] = "Usage: %s [options...]\n"
 "  -h, --help           Show help message and quit\n"
-"  -c, --config <path>  Path to config file.\n";
+"  -c, --config <path>  Path to config file.\n"
+"  -d, --display <name> Connect to a Wayland display instead of\n"
+"                       $WAYLAND_DISPLAY, can be repeated.\n"
+"  --record <path>      Record output manager events to a file.\n"
+"  --replay <path>      Replay recorded events instead of connecting to\n"
+"                       the compositor.\n"
+"  --replay-speed <factor>  Speed up replayed delays, 0 to disable them.\n"
+"  --metrics <path>     Serve Prometheus metrics on a Unix socket.\n"
+"  --apply-timeout <ms> Give up on configurations the compositor doesn't\n"
+"                       answer in time and retry, 0 to wait forever\n"
+"                       (default: 10000).\n"
+"  --max-commands <n>   Run at most n profile commands at once, 0 for no\n"
+"                       limit (default: 8).\n"
+"  --ready-fd <fd>      Write a newline to a file descriptor once the\n"
+"                       initial output configuration is applied.\n"
+"  --log-level <level>  Set the log level: error, warning, info (default)\n"
+"                       or debug.\n";
 
 static const struct option long_options[] = {
 	{"help", no_argument, 0, 'h'},
 	{"config", required_argument, 0, 'c'},
+	{"display", required_argument, 0, 'd'},
 	{"listen-fd", required_argument, 0, 'l'},
+	{"record", required_argument, 0, 'r'},
+	{"replay", required_argument, 0, 'R'},
+	{"replay-speed", required_argument, 0, 'S'},
+	{"metrics", required_argument, 0, 'm'},
+	{"apply-timeout", required_argument, 0, 'T'},
+	{"max-commands", required_argument, 0, 'C'},
+	{"ready-fd", required_argument, 0, 'F'},
+	{"log-level", required_argument, 0, 'L'},
 	{0},
 };
 
 int main(int argc, char *argv[]) {
 	const char *config_arg = NULL;
-#if KANSHI_HAS_VARLINK
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	double replay_speed = 1;
+	const char *metrics_path = NULL;
+	enum kanshi_log_level log_level = KANSHI_LOG_INFO;
 	int listen_fd = -1;
-#endif
+	int ready_fd = -1;
+	int apply_timeout_ms = 10000;
+	int max_commands = 8;
+	// Points into argv, empty for the default display
+	const char **display_names = NULL;
+	size_t display_names_len = 0;
 
 	int opt;
-	while ((opt = getopt_long(argc, argv, "hc:l:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hc:d:l:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'c':
 			config_arg = optarg;
 			break;
+		case 'd': {
+			const char **names = realloc(display_names,
+				(display_names_len + 1) * sizeof(*names));
+			if (names == NULL) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+				return EXIT_FAILURE;
+			}
+			display_names = names;
+			display_names[display_names_len++] = optarg;
+			break;
+		}
 		case 'l':
 #if KANSHI_HAS_VARLINK
 			listen_fd = strtol(optarg, NULL, 10);
 #else
-			fprintf(stderr, "IPC support is disabled, "
-				"-l/--listen-fd is not supported\n");
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "IPC support is disabled, "
+				"-l/--listen-fd is not supported");
 			return EXIT_FAILURE;
 #endif
 			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'S': {
+			char *end;
+			replay_speed = strtod(optarg, &end);
+			if (end[0] != '\0' || optarg[0] == '\0' || replay_speed < 0) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid replay speed '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'T': {
+			char *end;
+			long timeout = strtol(optarg, &end, 10);
+			if (end[0] != '\0' || optarg[0] == '\0' || timeout < 0 ||
+					timeout > INT_MAX) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid apply timeout '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			apply_timeout_ms = timeout;
+			break;
+		}
+		case 'C': {
+			char *end;
+			long max = strtol(optarg, &end, 10);
+			if (end[0] != '\0' || optarg[0] == '\0' || max < 0 ||
+					max > INT_MAX) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid command limit '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			max_commands = max;
+			break;
+		}
+		case 'F': {
+			char *end;
+			ready_fd = strtol(optarg, &end, 10);
+			if (end[0] != '\0' || optarg[0] == '\0' || ready_fd < 0 ||
+					fcntl(ready_fd, F_SETFD, FD_CLOEXEC) == -1) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid readiness fd '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case 'L':
+			if (!kanshi_log_parse_level(optarg, &log_level)) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"invalid log level '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'h':
 			fprintf(stderr, usage, argv[0]);
 			return EXIT_SUCCESS;
@@ -690,52 +1817,112 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	kanshi_log_init(log_level);
+
+	if (display_names_len > 1 && (record_path != NULL || listen_fd >= 0)) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "--record and --listen-fd "
+			"can't be used with several displays");
+		return EXIT_FAILURE;
+	}
+
 	struct kanshi_config *config = read_config(config_arg);
 	if (config == NULL) {
 		return EXIT_FAILURE;
 	}
 
-	struct wl_display *display = wl_display_connect(NULL);
-	if (display == NULL) {
-		fprintf(stderr, "failed to connect to display\n");
-		return EXIT_FAILURE;
+	struct kanshi_recorder *recorder = NULL;
+	if (record_path != NULL) {
+		recorder = kanshi_recorder_create(record_path);
+		if (recorder == NULL) {
+			return EXIT_FAILURE;
+		}
 	}
 
-	struct kanshi_state state = {
+	// Commands run from profiles, including the ones of the initial
+	// configuration, must not notify on our behalf
+	char *notify_socket = NULL;
+	const char *notify_env = getenv("NOTIFY_SOCKET");
+	if (notify_env != NULL && notify_env[0] != '\0') {
+		notify_socket = strdup(notify_env);
+		if (notify_socket == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			return EXIT_FAILURE;
+		}
+	}
+	unsetenv("NOTIFY_SOCKET");
+
+	struct kanshi_context ctx = {
 		.running = true,
-		.display = display,
 		.config = config,
 		.config_arg = config_arg,
+		.ready_fd = ready_fd,
+		.notify_socket = notify_socket,
+		.apply_timeout_ms = apply_timeout_ms,
+		.max_commands = max_commands,
 	};
-#if KANSHI_HAS_VARLINK
-	if (kanshi_init_ipc(&state, listen_fd) != 0) {
-		return EXIT_FAILURE;
+	wl_list_init(&ctx.displays);
+	wl_list_init(&ctx.timers);
+	wl_list_init(&ctx.command_jobs);
+	srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
+	if (replay_path != NULL) {
+		struct kanshi_state *state = calloc(1, sizeof(*state));
+		if (state == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "allocation failed");
+			return EXIT_FAILURE;
+		}
+		state->ctx = &ctx;
+		state->needs_match = true;
+		state->recorder = recorder;
+		wl_list_init(&state->heads);
+		wl_list_init(&state->adhoc_profiles);
+		wl_list_init(&state->command_runs);
+		kanshi_timer_init(&state->retry_timer, state_handle_retry, state);
+		wl_list_insert(&ctx.displays, &state->link);
+		int ret = kanshi_replay(state, replay_path, replay_speed,
+			&replay_listeners);
+		// The display has no Wayland objects, see destroy_head()
+		kanshi_destroy_display(state);
+		free(ctx.notify_socket);
+		free(display_names);
+		kanshi_recorder_destroy(recorder);
+		destroy_config(ctx.config);
+		kanshi_log_finish();
+		return ret;
 	}
-#endif
-	wl_list_init(&state.heads);
 
-	struct wl_registry *registry = wl_display_get_registry(display);
-	wl_registry_add_listener(registry, &registry_listener, &state);
-	if (wl_display_roundtrip(display) < 0) {
-		fprintf(stderr, "wl_display_roundtrip() failed\n");
-		return EXIT_FAILURE;
+	int ret = EXIT_FAILURE;
+	if (metrics_path != NULL && kanshi_init_metrics(&ctx, metrics_path) != 0) {
+		goto out;
 	}
 
-	if (state.output_manager == NULL) {
-		fprintf(stderr, "compositor doesn't support "
-			"wlr-output-management-unstable-v1\n");
-		return EXIT_FAILURE;
+	if (display_names_len == 0) {
+		if (connect_display(&ctx, NULL, listen_fd, recorder) == NULL) {
+			goto out;
+		}
+	}
+	for (size_t i = 0; i < display_names_len; i++) {
+		if (connect_display(&ctx, display_names[i], listen_fd,
+				recorder) == NULL) {
+			goto out;
+		}
 	}
 
-	int ret = kanshi_main_loop(&state);
+	ret = kanshi_main_loop(&ctx);
 
-#if KANSHI_HAS_VARLINK
-	kanshi_finish_ipc(&state);
-#endif
-	destroy_config(state.config);
-	zwlr_output_manager_v1_destroy(state.output_manager);
-	wl_registry_destroy(registry);
-	wl_display_disconnect(display);
+out:;
+	struct kanshi_state *state, *tmp;
+	wl_list_for_each_safe(state, tmp, &ctx.displays, link) {
+		kanshi_destroy_display(state);
+	}
+	kanshi_exec_destroy_jobs(&ctx);
+	kanshi_finish_metrics(&ctx);
+	free(ctx.fd_handlers);
+	free(ctx.notify_socket);
+	free(display_names);
+	destroy_config(ctx.config);
+	kanshi_recorder_destroy(recorder);
+	kanshi_log_finish();
 
 	return ret;
 }
@@ -0,0 +1,409 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "libkanshi.h"
+#include "match.h"
+
+static const char *head_pattern_value(const struct kanshi_head_info *head,
+		enum kanshi_output_pattern_field field) {
+	const char *value = NULL;
+	switch (field) {
+	case KANSHI_PATTERN_NAME:
+		value = head->name;
+		break;
+	case KANSHI_PATTERN_MAKE:
+		value = head->make;
+		break;
+	case KANSHI_PATTERN_MODEL:
+		value = head->model;
+		break;
+	case KANSHI_PATTERN_SERIAL:
+		value = head->serial_number;
+		break;
+	}
+	return value != NULL ? value : "Unknown";
+}
+
+// Same as comparing name with "make model serial", without building the
+// identifier
+static bool match_identifier(const char *name,
+		const struct kanshi_head_info *head) {
+	const char *parts[] = {
+		head->make != NULL ? head->make : "Unknown",
+		head->model != NULL ? head->model : "Unknown",
+		head->serial_number != NULL ? head->serial_number : "Unknown",
+	};
+	for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (i > 0) {
+			if (name[0] != ' ') {
+				return false;
+			}
+			name++;
+		}
+		size_t len = strlen(parts[i]);
+		if (strncmp(name, parts[i], len) != 0) {
+			return false;
+		}
+		name += len;
+	}
+	return name[0] == '\0';
+}
+
+static bool match_output_patterns(const struct kanshi_profile_output *output,
+		const struct kanshi_head_info *head) {
+	for (size_t i = 0; i < output->patterns_len; i++) {
+		const struct kanshi_output_pattern *pattern = &output->patterns[i];
+		const char *value = head_pattern_value(head, pattern->field);
+		if (pattern->literal != NULL) {
+			if (strcmp(pattern->literal, value) != 0) {
+				return false;
+			}
+		} else if (regexec(&pattern->regex, value, 0, NULL, 0) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool match_profile_output(const struct kanshi_profile_output *output,
+		const struct kanshi_head_info *head) {
+	if (output->patterns_len > 0) {
+		return match_output_patterns(output, head);
+	}
+
+	return strcmp(output->name, "*") == 0 ||
+		strcmp(output->name, head->name) == 0 ||
+		match_identifier(output->name, head);
+}
+
+struct profile_match {
+	const struct kanshi_head_info *heads;
+	size_t heads_len;
+	struct kanshi_profile_output *outputs[KANSHI_HEADS_MAX];
+	// Whether outputs[i] matches heads[j], computed on demand: 0 if unknown,
+	// 1 if it does, -1 if it doesn't
+	signed char matrix[KANSHI_HEADS_MAX][KANSHI_HEADS_MAX];
+	// Index of the output assigned to each head, -1 if none
+	ssize_t assigned[KANSHI_HEADS_MAX];
+	bool visited[KANSHI_HEADS_MAX];
+};
+
+static bool profile_match_test(struct profile_match *m, size_t output,
+		size_t head) {
+	signed char *v = &m->matrix[output][head];
+	if (*v == 0) {
+		*v = match_profile_output(m->outputs[output], &m->heads[head]) ? 1 : -1;
+	}
+	return *v > 0;
+}
+
+// Assigns a head to the output, moving the outputs of already assigned heads
+// to other heads if needed
+static bool profile_match_assign(struct profile_match *m, size_t output) {
+	// Free heads first, so that the assignment is first-fit when possible
+	for (size_t i = 0; i < m->heads_len; i++) {
+		if (m->assigned[i] < 0 && profile_match_test(m, output, i)) {
+			m->assigned[i] = output;
+			return true;
+		}
+	}
+	for (size_t i = 0; i < m->heads_len; i++) {
+		if (m->visited[i] || !profile_match_test(m, output, i)) {
+			continue;
+		}
+		m->visited[i] = true;
+		if (profile_match_assign(m, m->assigned[i])) {
+			m->assigned[i] = output;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool kanshi_match_profile(struct kanshi_profile *profile,
+		const struct kanshi_head_info *heads, size_t heads_len,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	if ((size_t)wl_list_length(&profile->outputs) != heads_len ||
+			heads_len > KANSHI_HEADS_MAX) {
+		return false;
+	}
+
+	struct profile_match m = {
+		.heads = heads,
+		.heads_len = heads_len,
+	};
+	size_t outputs_len = 0;
+	struct kanshi_profile_output *profile_output;
+	wl_list_for_each(profile_output, &profile->outputs, link) {
+		m.outputs[outputs_len++] = profile_output;
+	}
+	for (size_t i = 0; i < heads_len; i++) {
+		m.assigned[i] = -1;
+	}
+
+	// Wildcards are stored at the end of the list, so those will be matched
+	// last. Patterns can match heads in several ways, if an output doesn't
+	// find a head the previous outputs are moved along augmenting paths.
+	for (size_t i = 0; i < outputs_len; i++) {
+		memset(m.visited, 0, sizeof(m.visited));
+		if (!profile_match_assign(&m, i)) {
+			return false;
+		}
+	}
+
+	memset(matches, 0, KANSHI_HEADS_MAX * sizeof(matches[0]));
+	for (size_t i = 0; i < heads_len; i++) {
+		matches[i] = m.outputs[m.assigned[i]];
+	}
+	return true;
+}
+
+static int match_score(const struct kanshi_head_info *heads, size_t heads_len,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	int score = 0;
+	for (size_t i = 0; i < heads_len; i++) {
+		struct kanshi_profile_output *output = matches[i];
+		if (strcmp(output->name, "*") == 0) {
+			score += KANSHI_MATCH_WILDCARD;
+		} else if (output->patterns_len > 0) {
+			score += KANSHI_MATCH_PATTERN;
+		} else if (strcmp(output->name, heads[i].name) == 0) {
+			score += KANSHI_MATCH_NAME;
+		} else {
+			score += KANSHI_MATCH_IDENTIFIER;
+		}
+	}
+	return score;
+}
+
+static struct kanshi_profile *match_best(struct kanshi_config *config,
+		const struct kanshi_head_info *heads, size_t heads_len,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	// Only profiles with as many outputs as there are heads can match
+	if (heads_len >= config->buckets_len) {
+		return NULL;
+	}
+	struct kanshi_profile_bucket *bucket = &config->buckets[heads_len];
+
+	struct kanshi_profile *best = NULL;
+	int best_score = 0;
+	struct kanshi_profile_output *candidate[KANSHI_HEADS_MAX];
+	for (size_t i = 0; i < bucket->len; i++) {
+		struct kanshi_profile *profile = bucket->profiles[i];
+		// The bucket is sorted, no remaining profile can do better
+		if (best != NULL && (profile->priority < best->priority ||
+				profile->max_score <= best_score)) {
+			break;
+		}
+
+		if (!kanshi_match_profile(profile, heads, heads_len, candidate)) {
+			continue;
+		}
+		int score = match_score(heads, heads_len, candidate);
+		if (best == NULL || score > best_score) {
+			best = profile;
+			best_score = score;
+			memcpy(matches, candidate, sizeof(candidate));
+		}
+	}
+	return best;
+}
+
+struct kanshi_profile *kanshi_match(struct kanshi_config *config,
+		const struct kanshi_head_info *heads, size_t heads_len,
+		struct kanshi_profile_output *matches[static KANSHI_HEADS_MAX]) {
+	if (config->profile_selection == KANSHI_SELECTION_BEST) {
+		return match_best(config, heads, heads_len, matches);
+	}
+
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &config->profiles, link) {
+		if (kanshi_match_profile(profile, heads, heads_len, matches)) {
+			return profile;
+		}
+	}
+	return NULL;
+}
+
+static bool match_refresh(const struct kanshi_head_mode *mode, int refresh,
+		int tolerance, int *delta) {
+	int v = refresh - mode->refresh;
+	int mode_delta = abs(v);
+	/* If we have a refresh, pick one with the lowest delta from our target.
+	 * Doing a simple fuzzy match that picks the greatest (due to ordering) here can lead us to picking a refresh
+	 * such as 120.01 or 60.01, which is problematic for two reasons:
+	 *  - Modes such as 4K 120.01Hz is too much for link bandwidth of DP 1.4 without DSC.
+	 *  - It becomes out of phase with the majority of content being displayed.
+	 */
+	if (mode_delta < tolerance && mode_delta < *delta) {
+		*delta = mode_delta;
+		return true;
+	}
+	return false;
+}
+
+static int64_t mode_area(const struct kanshi_head_mode *mode) {
+	return (int64_t)mode->width * mode->height;
+}
+
+// Whether a has more pixels than b, or as many and a higher refresh rate
+static bool mode_larger(const struct kanshi_head_mode *a,
+		const struct kanshi_head_mode *b) {
+	int64_t area_a = mode_area(a), area_b = mode_area(b);
+	return area_a > area_b || (area_a == area_b && a->refresh > b->refresh);
+}
+
+// Whether a has a higher refresh rate than b, or the same and more pixels
+static bool mode_faster(const struct kanshi_head_mode *a,
+		const struct kanshi_head_mode *b) {
+	return a->refresh > b->refresh ||
+		(a->refresh == b->refresh && mode_area(a) > mode_area(b));
+}
+
+ssize_t kanshi_match_mode(const struct kanshi_head_mode *modes,
+		size_t modes_len, const struct kanshi_output_mode *output_mode) {
+	// Heads without a preferred mode fall back to their largest one, both are
+	// looked for in the same pass
+	ssize_t last_match = -1, largest = -1;
+	int mode_delta = INT32_MAX;
+
+	for (size_t i = 0; i < modes_len; i++) {
+		const struct kanshi_head_mode *mode = &modes[i];
+		switch (output_mode->policy) {
+		case KANSHI_MODE_EXACT:
+			if (mode->width != output_mode->width ||
+					mode->height != output_mode->height) {
+				break;
+			}
+			if (output_mode->refresh) {
+				if (match_refresh(mode, output_mode->refresh,
+						output_mode->refresh_tolerance, &mode_delta)) {
+					last_match = i;
+				}
+			} else {
+				if (last_match < 0 || mode->refresh > modes[last_match].refresh) {
+					last_match = i;
+				}
+			}
+			break;
+		case KANSHI_MODE_PREFERRED:
+			if (mode->preferred) {
+				return i;
+			}
+			if (largest < 0 || mode_larger(mode, &modes[largest])) {
+				largest = i;
+			}
+			break;
+		case KANSHI_MODE_MAX_RESOLUTION:
+			if (last_match < 0 || mode_larger(mode, &modes[last_match])) {
+				last_match = i;
+			}
+			break;
+		case KANSHI_MODE_MAX_REFRESH:
+			if (last_match < 0 || mode_faster(mode, &modes[last_match])) {
+				last_match = i;
+			}
+			break;
+		}
+	}
+
+	if (output_mode->policy == KANSHI_MODE_PREFERRED) {
+		return largest;
+	}
+	return last_match;
+}
+
+bool kanshi_resolve_head(const struct kanshi_head_info *head,
+		const struct kanshi_profile_output *output,
+		struct kanshi_head_config *config) {
+	*config = (struct kanshi_head_config){
+		.enabled = head->enabled,
+	};
+	if (output->fields & KANSHI_OUTPUT_ENABLED) {
+		config->enabled = output->enabled;
+	}
+	if (!config->enabled) {
+		return true;
+	}
+
+	if (output->fields & KANSHI_OUTPUT_MODE) {
+		if (output->mode.custom) {
+			config->fields |= KANSHI_HEAD_CONFIG_CUSTOM_MODE;
+			config->custom_mode.width = output->mode.width;
+			config->custom_mode.height = output->mode.height;
+			config->custom_mode.refresh = output->mode.refresh;
+		} else {
+			ssize_t mode = kanshi_match_mode(head->modes, head->modes_len,
+				&output->mode);
+			if (mode < 0) {
+				return false;
+			}
+			config->fields |= KANSHI_HEAD_CONFIG_MODE;
+			config->mode = mode;
+		}
+	}
+	if (output->fields & KANSHI_OUTPUT_POSITION) {
+		config->fields |= KANSHI_HEAD_CONFIG_POSITION;
+		config->x = output->position.x;
+		config->y = output->position.y;
+	}
+	if (output->fields & KANSHI_OUTPUT_SCALE) {
+		config->fields |= KANSHI_HEAD_CONFIG_SCALE;
+		config->scale = output->scale;
+	}
+	if (output->fields & KANSHI_OUTPUT_TRANSFORM) {
+		config->fields |= KANSHI_HEAD_CONFIG_TRANSFORM;
+		config->transform = output->transform;
+	}
+	if (output->fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+		config->fields |= KANSHI_HEAD_CONFIG_ADAPTIVE_SYNC;
+		config->adaptive_sync = output->adaptive_sync;
+	}
+	return true;
+}
+
+struct kanshi_config *kanshi_config_load(const char *path) {
+	return parse_config(path);
+}
+
+void kanshi_config_destroy(struct kanshi_config *config) {
+	destroy_config(config);
+}
+
+enum kanshi_resolve_result kanshi_config_resolve(struct kanshi_config *config,
+		const struct kanshi_head_info *heads, size_t heads_len,
+		struct kanshi_head_config *configs,
+		const struct kanshi_profile **profile) {
+	if (heads_len > KANSHI_HEADS_MAX) {
+		return KANSHI_RESOLVE_TOO_MANY_HEADS;
+	}
+
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
+	struct kanshi_profile *matched =
+		kanshi_match(config, heads, heads_len, matches);
+	if (matched == NULL) {
+		return KANSHI_RESOLVE_NO_PROFILE;
+	}
+	for (size_t i = 0; i < heads_len; i++) {
+		if (!kanshi_resolve_head(&heads[i], matches[i], &configs[i])) {
+			return KANSHI_RESOLVE_UNSUPPORTED_MODE;
+		}
+	}
+	*profile = matched;
+	return KANSHI_RESOLVE_OK;
+}
+
+const char *kanshi_profile_get_name(const struct kanshi_profile *profile) {
+	return profile->name;
+}
+
+void kanshi_profile_for_each_command(const struct kanshi_profile *profile,
+		void (*func)(void *data, const char *command), void *data) {
+	struct kanshi_profile_command *command;
+	wl_list_for_each(command, &profile->commands, link) {
+		func(data, command->command);
+	}
+}
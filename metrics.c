@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipc.h"
+#include "kanshi.h"
+#include "log.h"
+#include "metrics.h"
+
+#define MAX_CLIENTS 16
+#define MAX_REQUEST_SIZE 1024
+
+struct kanshi_metrics_server {
+	struct kanshi_context *ctx;
+	int listen_fd;
+	char *path;
+	struct wl_list clients;
+	size_t clients_len;
+};
+
+struct metrics_client {
+	struct kanshi_metrics_server *server;
+	struct wl_list link;
+	int fd;
+	char request[MAX_REQUEST_SIZE];
+	size_t request_len;
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	const char *labels; // NULL if none
+} counter_info[] = {
+	[KANSHI_COUNTER_DONE_EVENTS] = { "kanshi_done_events_total",
+		"Output configuration updates received from the compositor.", NULL },
+	[KANSHI_COUNTER_PROFILE_MATCHES] = { "kanshi_profile_matches_total",
+		"Output configuration updates which matched a profile.", NULL },
+	[KANSHI_COUNTER_PROFILE_MISSES] = { "kanshi_profile_misses_total",
+		"Output configuration updates which matched no profile.", NULL },
+	[KANSHI_COUNTER_APPLIES_SUCCEEDED] = { "kanshi_applies_total",
+		"Output configurations sent to the compositor, by result.",
+		"result=\"succeeded\"" },
+	[KANSHI_COUNTER_APPLIES_FAILED] = { "kanshi_applies_total", NULL,
+		"result=\"failed\"" },
+	[KANSHI_COUNTER_APPLIES_CANCELLED] = { "kanshi_applies_total", NULL,
+		"result=\"cancelled\"" },
+	[KANSHI_COUNTER_APPLIES_TIMED_OUT] = { "kanshi_applies_total", NULL,
+		"result=\"timed_out\"" },
+	[KANSHI_COUNTER_REQUESTS_SUPERSEDED] = {
+		"kanshi_apply_requests_superseded_total",
+		"Queued apply requests replaced by a newer one.", NULL },
+	[KANSHI_COUNTER_RETRIES] = { "kanshi_retries_total",
+		"Cancelled configurations retried after a backoff delay.", NULL },
+	[KANSHI_COUNTER_RETRIES_EXHAUSTED] = { "kanshi_retries_exhausted_total",
+		"Cancelled configurations left until the outputs change, after too "
+		"many retries.", NULL },
+	[KANSHI_COUNTER_COMMANDS] = { "kanshi_commands_total",
+		"Profile exec commands spawned.", NULL },
+	[KANSHI_COUNTER_COMMANDS_DEFERRED] = { "kanshi_commands_deferred_total",
+		"Profile exec commands postponed to the end of their --once-per "
+		"window.", NULL },
+	[KANSHI_COUNTER_COMMANDS_COALESCED] = { "kanshi_commands_coalesced_total",
+		"Profile exec commands merged into an already postponed run.", NULL },
+	[KANSHI_COUNTER_RELOADS_SUCCEEDED] = { "kanshi_reloads_total",
+		"Configuration reloads, by result.", "result=\"succeeded\"" },
+	[KANSHI_COUNTER_RELOADS_FAILED] = { "kanshi_reloads_total", NULL,
+		"result=\"failed\"" },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} histogram_info[] = {
+	[KANSHI_HISTOGRAM_APPLY_LATENCY] = { "kanshi_apply_latency_seconds",
+		"Time between sending an output configuration and the compositor "
+		"reply." },
+	[KANSHI_HISTOGRAM_RELOAD_DURATION] = { "kanshi_reload_duration_seconds",
+		"Time spent reading and parsing the configuration file." },
+	[KANSHI_HISTOGRAM_BLANK_TIME] = { "kanshi_apply_blank_seconds",
+		"Time spent by the configurations changing output modes of a profile, "
+		"during which outputs may be blank." },
+};
+
+static const double histogram_bounds[KANSHI_HISTOGRAM_BUCKETS] = {
+	KANSHI_HISTOGRAM_BOUNDS
+};
+
+void kanshi_metrics_inc(struct kanshi_metrics *metrics,
+		enum kanshi_counter counter) {
+	metrics->counters[counter]++;
+}
+
+void kanshi_metrics_observe(struct kanshi_metrics *metrics,
+		enum kanshi_histogram histogram, double value) {
+	struct kanshi_histogram_data *data = &metrics->histograms[histogram];
+	for (size_t i = 0; i < KANSHI_HISTOGRAM_BUCKETS; i++) {
+		if (value <= histogram_bounds[i]) {
+			data->buckets[i]++;
+			break;
+		}
+	}
+	data->count++;
+	data->sum += value;
+}
+
+void kanshi_metrics_observe_since(struct kanshi_metrics *metrics,
+		enum kanshi_histogram histogram, const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1e9;
+	kanshi_metrics_observe(metrics, histogram, elapsed);
+}
+
+static char *format_metrics(const struct kanshi_metrics *metrics,
+		size_t *size) {
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, size);
+	if (f == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < KANSHI_COUNTER_COUNT; i++) {
+		// Labelled series of the same metric follow each other, only the
+		// first one carries the help text
+		if (counter_info[i].help != NULL) {
+			fprintf(f, "# HELP %s %s\n", counter_info[i].name,
+				counter_info[i].help);
+			fprintf(f, "# TYPE %s counter\n", counter_info[i].name);
+		}
+		if (counter_info[i].labels != NULL) {
+			fprintf(f, "%s{%s} %llu\n", counter_info[i].name,
+				counter_info[i].labels,
+				(unsigned long long)metrics->counters[i]);
+		} else {
+			fprintf(f, "%s %llu\n", counter_info[i].name,
+				(unsigned long long)metrics->counters[i]);
+		}
+	}
+
+	fprintf(f, "# HELP kanshi_log_messages_dropped_total Log messages not "
+		"written because stderr would have blocked.\n");
+	fprintf(f, "# TYPE kanshi_log_messages_dropped_total counter\n");
+	fprintf(f, "kanshi_log_messages_dropped_total %llu\n",
+		(unsigned long long)kanshi_log_dropped());
+
+	for (size_t i = 0; i < KANSHI_HISTOGRAM_COUNT; i++) {
+		const char *name = histogram_info[i].name;
+		const struct kanshi_histogram_data *data = &metrics->histograms[i];
+		fprintf(f, "# HELP %s %s\n", name, histogram_info[i].help);
+		fprintf(f, "# TYPE %s histogram\n", name);
+		uint64_t cumulative = 0;
+		for (size_t j = 0; j < KANSHI_HISTOGRAM_BUCKETS; j++) {
+			cumulative += data->buckets[j];
+			fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name,
+				histogram_bounds[j], (unsigned long long)cumulative);
+		}
+		fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+			(unsigned long long)data->count);
+		fprintf(f, "%s_sum %.9g\n", name, data->sum);
+		fprintf(f, "%s_count %llu\n", name, (unsigned long long)data->count);
+	}
+
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static int set_nonblock_cloexec(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFD);
+	if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_client(struct metrics_client *client) {
+	kanshi_remove_fd(client->server->ctx, client->fd);
+	close(client->fd);
+	wl_list_remove(&client->link);
+	client->server->clients_len--;
+	free(client);
+}
+
+static void send_all(int fd, const char *data, size_t size) {
+	// The response is small enough to fit in the socket buffer, give up on
+	// clients which don't keep up rather than blocking the main loop
+	while (size > 0) {
+		ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += n;
+		size -= (size_t)n;
+	}
+}
+
+static void send_response(struct metrics_client *client) {
+	const char *status = "200 OK";
+	char *body = NULL;
+	size_t body_size = 0;
+	if (strncmp(client->request, "GET ", 4) != 0) {
+		status = "405 Method Not Allowed";
+	} else {
+		body = format_metrics(&client->server->ctx->metrics, &body_size);
+		if (body == NULL) {
+			status = "500 Internal Server Error";
+		}
+	}
+
+	char header[256];
+	int header_size = snprintf(header, sizeof(header),
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, body_size);
+	send_all(client->fd, header, (size_t)header_size);
+	if (body != NULL) {
+		send_all(client->fd, body, body_size);
+	}
+	free(body);
+}
+
+static bool request_complete(const struct metrics_client *client) {
+	// Only the request line matters, wait for the end of the headers so
+	// that closing the socket doesn't discard unread data and reset the
+	// connection
+	for (size_t i = 0; i + 1 < client->request_len; i++) {
+		if (client->request[i] != '\n') {
+			continue;
+		}
+		if (client->request[i + 1] == '\n' || (i + 2 < client->request_len &&
+				client->request[i + 1] == '\r' &&
+				client->request[i + 2] == '\n')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void handle_client(void *data, int fd, short revents) {
+	struct metrics_client *client = data;
+
+	while (client->request_len < sizeof(client->request) - 1) {
+		ssize_t n = read(fd, client->request + client->request_len,
+			sizeof(client->request) - 1 - client->request_len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return;
+			}
+			destroy_client(client);
+			return;
+		}
+		if (n == 0) {
+			break;
+		}
+		client->request_len += (size_t)n;
+		client->request[client->request_len] = '\0';
+		if (request_complete(client)) {
+			break;
+		}
+	}
+
+	send_response(client);
+	destroy_client(client);
+}
+
+static void handle_listen(void *data, int fd, short revents) {
+	struct kanshi_metrics_server *server = data;
+
+	while (true) {
+		int client_fd = accept(fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				kanshi_log(KANSHI_LOG_ERROR, NULL,
+					"accept on metrics socket failed: %s", strerror(errno));
+			}
+			return;
+		}
+		if (server->clients_len >= MAX_CLIENTS ||
+				set_nonblock_cloexec(client_fd) < 0) {
+			close(client_fd);
+			continue;
+		}
+
+		struct metrics_client *client = calloc(1, sizeof(*client));
+		if (client == NULL) {
+			close(client_fd);
+			continue;
+		}
+		client->server = server;
+		client->fd = client_fd;
+		if (!kanshi_add_fd(server->ctx, client_fd, POLLIN,
+				handle_client, client)) {
+			close(client_fd);
+			free(client);
+			continue;
+		}
+		wl_list_insert(&server->clients, &client->link);
+		server->clients_len++;
+	}
+}
+
+int kanshi_init_metrics(struct kanshi_context *ctx, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "metrics socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (socket_in_use(&addr)) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL, "couldn't listen on metrics "
+				"socket %s, is another process using it?", path);
+			return -1;
+		}
+		// Remove a stale socket left behind by a previous instance
+		unlink(path);
+	}
+
+	struct kanshi_metrics_server *server = calloc(1, sizeof(*server));
+	if (server == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "calloc: %s", strerror(errno));
+		return -1;
+	}
+	server->ctx = ctx;
+	wl_list_init(&server->clients);
+	server->path = strdup(path);
+	if (server->path == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "strdup: %s", strerror(errno));
+		goto error;
+	}
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->listen_fd < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to create metrics socket: %s", strerror(errno));
+		goto error;
+	}
+	if (set_nonblock_cloexec(server->listen_fd) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"fcntl failed on metrics socket: %s", strerror(errno));
+		goto error_fd;
+	}
+
+	if (bind(server->listen_fd, (void *)&addr, sizeof(addr)) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to bind metrics socket %s: %s", path,
+			strerror(errno));
+		goto error_fd;
+	}
+	if (listen(server->listen_fd, MAX_CLIENTS) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"failed to listen on metrics socket: %s", strerror(errno));
+		goto error_unlink;
+	}
+	if (!kanshi_add_fd(ctx, server->listen_fd, POLLIN, handle_listen,
+			server)) {
+		goto error_unlink;
+	}
+
+	ctx->metrics_server = server;
+	return 0;
+
+error_unlink:
+	unlink(path);
+error_fd:
+	close(server->listen_fd);
+error:
+	free(server->path);
+	free(server);
+	return -1;
+}
+
+void kanshi_finish_metrics(struct kanshi_context *ctx) {
+	struct kanshi_metrics_server *server = ctx->metrics_server;
+	if (server == NULL) {
+		return;
+	}
+
+	struct metrics_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &server->clients, link) {
+		destroy_client(client);
+	}
+	kanshi_remove_fd(ctx, server->listen_fd);
+	close(server->listen_fd);
+	unlink(server->path);
+	free(server->path);
+	free(server);
+	ctx->metrics_server = NULL;
+}
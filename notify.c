@@ -0,0 +1,63 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "notify.h"
+
+static void notify_socket(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t len = strlen(path);
+	if (path[0] != '/' && path[0] != '@') {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"unsupported NOTIFY_SOCKET address: %s", path);
+		return;
+	}
+	if (len >= sizeof(addr.sun_path)) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"NOTIFY_SOCKET path too long: %s", path);
+		return;
+	}
+	memcpy(addr.sun_path, path, len);
+	// Abstract socket
+	if (addr.sun_path[0] == '@') {
+		addr.sun_path[0] = '\0';
+	}
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to create notification socket: %s", strerror(errno));
+		return;
+	}
+	static const char message[] = "READY=1";
+	if (sendto(fd, message, sizeof(message) - 1, 0, (void *)&addr,
+			offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to send readiness notification: %s", strerror(errno));
+	}
+	close(fd);
+}
+
+void kanshi_notify_ready(int ready_fd, const char *notify_socket_path) {
+	kanshi_log(KANSHI_LOG_DEBUG, NULL, "notifying readiness");
+
+	if (ready_fd >= 0) {
+		ssize_t n;
+		do {
+			n = write(ready_fd, "\n", 1);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			kanshi_log(KANSHI_LOG_WARNING, NULL,
+				"failed to write to the readiness fd: %s", strerror(errno));
+		}
+		close(ready_fd);
+	}
+
+	if (notify_socket_path != NULL) {
+		notify_socket(notify_socket_path);
+	}
+}
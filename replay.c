@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kanshi.h"
+#include "log.h"
+#include "replay.h"
+
+#define PENDING_MAX 16
+
+struct kanshi_recorder {
+	FILE *f;
+	struct timespec start;
+};
+
+struct kanshi_replay {
+	const struct kanshi_replay_listeners *listeners;
+
+	// Configurations submitted by kanshi, waiting for a recorded reply
+	struct kanshi_pending_profile *pending[PENDING_MAX];
+	size_t pending_len;
+	bool failed;
+
+	size_t events, dones, applies;
+	uint64_t done_total_us, done_max_us;
+};
+
+static uint64_t timespec_to_us(const struct timespec *ts) {
+	return (uint64_t)ts->tv_sec * 1000000 + (uint64_t)ts->tv_nsec / 1000;
+}
+
+static uint64_t elapsed_us(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_us(&now) - timespec_to_us(start);
+}
+
+struct kanshi_recorder *kanshi_recorder_create(const char *path) {
+	struct kanshi_recorder *recorder = calloc(1, sizeof(*recorder));
+	if (recorder == NULL) {
+		return NULL;
+	}
+	recorder->f = fopen(path, "w");
+	if (recorder->f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to open recording '%s': %s",
+			path, strerror(errno));
+		free(recorder);
+		return NULL;
+	}
+	// Keep the recording usable if kanshi crashes
+	setvbuf(recorder->f, NULL, _IOLBF, 0);
+	clock_gettime(CLOCK_MONOTONIC, &recorder->start);
+	return recorder;
+}
+
+void kanshi_recorder_destroy(struct kanshi_recorder *recorder) {
+	if (recorder == NULL) {
+		return;
+	}
+	fclose(recorder->f);
+	free(recorder);
+}
+
+void kanshi_record(struct kanshi_state *state, const char *fmt, ...) {
+	struct kanshi_recorder *recorder = state->recorder;
+	if (recorder == NULL) {
+		return;
+	}
+
+	fprintf(recorder->f, "%" PRIu64 " ", elapsed_us(&recorder->start));
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(recorder->f, fmt, args);
+	va_end(args);
+	fputc('\n', recorder->f);
+}
+
+void kanshi_record_string(struct kanshi_state *state, const char *event,
+		uint32_t id, const char *value) {
+	struct kanshi_recorder *recorder = state->recorder;
+	if (recorder == NULL) {
+		return;
+	}
+
+	// Strings are stored until the end of the line, only backslashes and
+	// newlines need escaping
+	fprintf(recorder->f, "%" PRIu64 " %s %" PRIu32 " ",
+		elapsed_us(&recorder->start), event, id);
+	for (size_t i = 0; value[i] != '\0'; i++) {
+		if (value[i] == '\n') {
+			fputs("\\n", recorder->f);
+		} else if (value[i] == '\\') {
+			fputs("\\\\", recorder->f);
+		} else {
+			fputc(value[i], recorder->f);
+		}
+	}
+	fputc('\n', recorder->f);
+}
+
+static void unescape_string(char *str) {
+	char *dst = str;
+	for (const char *src = str; *src != '\0'; src++) {
+		if (src[0] == '\\' && src[1] == 'n') {
+			*dst++ = '\n';
+			src++;
+		} else if (src[0] == '\\' && src[1] == '\\') {
+			*dst++ = '\\';
+			src++;
+		} else {
+			*dst++ = *src;
+		}
+	}
+	*dst = '\0';
+}
+
+bool kanshi_replay_submit(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	struct kanshi_replay *replay = state->replay;
+	if (replay->pending_len == PENDING_MAX) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL,
+			"replay: too many pending configurations");
+		replay->failed = true;
+		return false;
+	}
+	replay->applies++;
+	replay->pending[replay->pending_len++] = pending;
+	return true;
+}
+
+static struct kanshi_pending_profile *replay_pop_pending(
+		struct kanshi_replay *replay) {
+	if (replay->pending_len == 0) {
+		return NULL;
+	}
+	struct kanshi_pending_profile *pending = replay->pending[0];
+	replay->pending_len--;
+	memmove(&replay->pending[0], &replay->pending[1],
+		replay->pending_len * sizeof(replay->pending[0]));
+	return pending;
+}
+
+static struct kanshi_head *replay_find_head(struct kanshi_state *state,
+		uint32_t id) {
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (head->wlr_head == kanshi_replay_object(id)) {
+			return head;
+		}
+	}
+	return NULL;
+}
+
+static struct kanshi_mode *replay_find_mode(struct kanshi_state *state,
+		uint32_t id) {
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		for (size_t i = 0; i < head->modes_len; i++) {
+			if (head->modes[i].wlr_mode == kanshi_replay_object(id)) {
+				return &head->modes[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+static bool replay_head_event(struct kanshi_replay *replay,
+		struct kanshi_state *state, const char *event, char *args) {
+	const struct zwlr_output_head_v1_listener *listener =
+		replay->listeners->head;
+
+	uint32_t id;
+	int n = 0;
+	if (sscanf(args, "%" SCNu32 " %n", &id, &n) < 1) {
+		return false;
+	}
+	args += n;
+
+	struct kanshi_head *head = replay_find_head(state, id);
+	if (head == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "replay: unknown head %" PRIu32, id);
+		return false;
+	}
+	struct zwlr_output_head_v1 *wlr_head = head->wlr_head;
+
+	int32_t a, b;
+	uint32_t obj;
+	if (strcmp(event, "name") == 0 || strcmp(event, "description") == 0 ||
+			strcmp(event, "make") == 0 || strcmp(event, "model") == 0 ||
+			strcmp(event, "serial_number") == 0) {
+		unescape_string(args);
+		if (strcmp(event, "name") == 0) {
+			listener->name(head, wlr_head, args);
+		} else if (strcmp(event, "description") == 0) {
+			listener->description(head, wlr_head, args);
+		} else if (strcmp(event, "make") == 0) {
+			listener->make(head, wlr_head, args);
+		} else if (strcmp(event, "model") == 0) {
+			listener->model(head, wlr_head, args);
+		} else {
+			listener->serial_number(head, wlr_head, args);
+		}
+	} else if (strcmp(event, "physical_size") == 0) {
+		if (sscanf(args, "%" SCNd32 " %" SCNd32, &a, &b) != 2) {
+			return false;
+		}
+		listener->physical_size(head, wlr_head, a, b);
+	} else if (strcmp(event, "mode") == 0) {
+		if (sscanf(args, "%" SCNu32, &obj) != 1) {
+			return false;
+		}
+		listener->mode(head, wlr_head, kanshi_replay_object(obj));
+	} else if (strcmp(event, "enabled") == 0) {
+		if (sscanf(args, "%" SCNd32, &a) != 1) {
+			return false;
+		}
+		listener->enabled(head, wlr_head, a);
+	} else if (strcmp(event, "current_mode") == 0) {
+		if (sscanf(args, "%" SCNu32, &obj) != 1) {
+			return false;
+		}
+		listener->current_mode(head, wlr_head, kanshi_replay_object(obj));
+	} else if (strcmp(event, "position") == 0) {
+		if (sscanf(args, "%" SCNd32 " %" SCNd32, &a, &b) != 2) {
+			return false;
+		}
+		listener->position(head, wlr_head, a, b);
+	} else if (strcmp(event, "transform") == 0) {
+		if (sscanf(args, "%" SCNd32, &a) != 1) {
+			return false;
+		}
+		listener->transform(head, wlr_head, a);
+	} else if (strcmp(event, "scale") == 0) {
+		if (sscanf(args, "%" SCNd32, &a) != 1) {
+			return false;
+		}
+		listener->scale(head, wlr_head, a);
+	} else if (strcmp(event, "adaptive_sync") == 0) {
+		if (sscanf(args, "%" SCNu32, &obj) != 1) {
+			return false;
+		}
+		listener->adaptive_sync(head, wlr_head, obj);
+	} else if (strcmp(event, "head_finished") == 0) {
+		listener->finished(head, wlr_head);
+	} else {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "replay: unknown event '%s'", event);
+		return false;
+	}
+	return true;
+}
+
+static bool replay_mode_event(struct kanshi_replay *replay,
+		struct kanshi_state *state, const char *event, const char *args) {
+	const struct zwlr_output_mode_v1_listener *listener =
+		replay->listeners->mode;
+
+	uint32_t id;
+	int n = 0;
+	if (sscanf(args, "%" SCNu32 " %n", &id, &n) < 1) {
+		return false;
+	}
+	args += n;
+
+	struct kanshi_mode *mode = replay_find_mode(state, id);
+	if (mode == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "replay: unknown mode %" PRIu32, id);
+		return false;
+	}
+	struct zwlr_output_mode_v1 *wlr_mode = mode->wlr_mode;
+
+	int32_t a, b;
+	if (strcmp(event, "size") == 0) {
+		if (sscanf(args, "%" SCNd32 " %" SCNd32, &a, &b) != 2) {
+			return false;
+		}
+		listener->size(mode, wlr_mode, a, b);
+	} else if (strcmp(event, "refresh") == 0) {
+		if (sscanf(args, "%" SCNd32, &a) != 1) {
+			return false;
+		}
+		listener->refresh(mode, wlr_mode, a);
+	} else if (strcmp(event, "preferred") == 0) {
+		listener->preferred(mode, wlr_mode);
+	} else {
+		listener->finished(mode, wlr_mode);
+	}
+	return true;
+}
+
+static bool replay_config_event(struct kanshi_replay *replay,
+		const char *event) {
+	const struct zwlr_output_configuration_v1_listener *listener =
+		replay->listeners->config;
+
+	struct kanshi_pending_profile *pending = replay_pop_pending(replay);
+	if (pending == NULL) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL, "replay: recorded '%s' without a "
+			"pending configuration, ignoring", event);
+		return true;
+	}
+
+	if (strcmp(event, "succeeded") == 0) {
+		listener->succeeded(pending, NULL);
+	} else if (strcmp(event, "failed") == 0) {
+		listener->failed(pending, NULL);
+	} else {
+		listener->cancelled(pending, NULL);
+	}
+	return true;
+}
+
+static bool replay_event(struct kanshi_replay *replay,
+		struct kanshi_state *state, const char *event, char *args) {
+	const struct zwlr_output_manager_v1_listener *manager_listener =
+		replay->listeners->output_manager;
+
+	if (strcmp(event, "head") == 0) {
+		uint32_t id;
+		if (sscanf(args, "%" SCNu32, &id) != 1) {
+			return false;
+		}
+		manager_listener->head(state, NULL, kanshi_replay_object(id));
+	} else if (strcmp(event, "done") == 0) {
+		uint32_t serial;
+		if (sscanf(args, "%" SCNu32, &serial) != 1) {
+			return false;
+		}
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		manager_listener->done(state, NULL, serial);
+		uint64_t duration = elapsed_us(&start);
+		replay->dones++;
+		replay->done_total_us += duration;
+		if (duration > replay->done_max_us) {
+			replay->done_max_us = duration;
+		}
+	} else if (strcmp(event, "finished") == 0) {
+		manager_listener->finished(state, NULL);
+	} else if (strcmp(event, "apply") == 0) {
+		// Informational only: kanshi decides itself what to apply
+	} else if (strcmp(event, "succeeded") == 0 ||
+			strcmp(event, "failed") == 0 ||
+			strcmp(event, "cancelled") == 0) {
+		return replay_config_event(replay, event);
+	} else if (strcmp(event, "size") == 0 || strcmp(event, "refresh") == 0 ||
+			strcmp(event, "preferred") == 0 ||
+			strcmp(event, "mode_finished") == 0) {
+		return replay_mode_event(replay, state, event, args);
+	} else {
+		return replay_head_event(replay, state, event, args);
+	}
+	return true;
+}
+
+int kanshi_replay(struct kanshi_state *state, const char *path, double speed,
+		const struct kanshi_replay_listeners *listeners) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, NULL, "failed to open recording '%s': %s",
+			path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct kanshi_replay replay = { .listeners = listeners };
+	state->replay = &replay;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t lineno = 0;
+	while (getline(&line, &line_size, f) >= 0) {
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+
+		uint64_t timestamp;
+		char event[32];
+		int n = 0;
+		if (sscanf(line, "%" SCNu64 " %31s %n", &timestamp, event, &n) < 2) {
+			kanshi_log(KANSHI_LOG_WARNING, NULL,
+				"replay: malformed line %zu", lineno);
+			continue;
+		}
+
+		if (speed > 0) {
+			uint64_t target = timespec_to_us(&start) + timestamp / speed;
+			struct timespec ts = {
+				.tv_sec = target / 1000000,
+				.tv_nsec = (target % 1000000) * 1000,
+			};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL) == EINTR) {
+				// Retry
+			}
+		}
+
+		if (!replay_event(&replay, state, event, line + n)) {
+			kanshi_log(KANSHI_LOG_ERROR, NULL,
+				"replay: failed to replay line %zu", lineno);
+		}
+		replay.events++;
+		if (replay.failed) {
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	kanshi_log(KANSHI_LOG_INFO, NULL, "replayed %zu events in %" PRIu64 "us: "
+		"%zu done events, %zu configurations applied", replay.events,
+		elapsed_us(&start), replay.dones, replay.applies);
+	if (replay.dones > 0) {
+		kanshi_log(KANSHI_LOG_INFO, NULL, "done handling latency: average %"
+			PRIu64 "us, max %" PRIu64 "us",
+			replay.done_total_us / replay.dones, replay.done_max_us);
+	}
+	if (replay.pending_len > 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"%zu configurations left without a recorded reply",
+			replay.pending_len);
+	}
+
+	for (size_t i = 0; i < replay.pending_len; i++) {
+		listeners->abandoned(replay.pending[i]);
+	}
+	state->replay = NULL;
+	return replay.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "status.h"
+
+#define READ_ATTEMPTS 64
+
+bool kanshi_status_read(const struct kanshi_status *shared,
+		struct kanshi_status *out) {
+	_Atomic uint32_t *seq_ptr = (_Atomic uint32_t *)&shared->seq;
+	for (int i = 0; i < READ_ATTEMPTS; i++) {
+		uint32_t seq = atomic_load_explicit(seq_ptr, memory_order_acquire);
+		if (seq & 1) {
+			continue; // being updated
+		}
+		// Only copy the heads in use, to keep the window for a concurrent
+		// update small
+		memcpy(out, shared, offsetof(struct kanshi_status, heads));
+		if (out->heads_len <= KANSHI_STATUS_HEADS_MAX) {
+			memcpy(out->heads, shared->heads,
+				out->heads_len * sizeof(out->heads[0]));
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(seq_ptr, memory_order_relaxed) != seq) {
+			continue;
+		}
+
+		if (out->magic != KANSHI_STATUS_MAGIC ||
+				out->version != KANSHI_STATUS_VERSION ||
+				out->heads_len > KANSHI_STATUS_HEADS_MAX) {
+			return false;
+		}
+		out->current_profile[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+		out->pending_profile[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+		for (uint32_t j = 0; j < out->heads_len; j++) {
+			struct kanshi_status_head *head = &out->heads[j];
+			head->name[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+			head->make[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+			head->model[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+			head->serial_number[KANSHI_STATUS_NAME_SIZE - 1] = '\0';
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ipc.h"
+#include "kanshi.h"
+#include "log.h"
+#include "status.h"
+
+struct kanshi_status_file {
+	char *path;
+	struct kanshi_status *status;
+};
+
+static void copy_name(char dst[static KANSHI_STATUS_NAME_SIZE],
+		const char *src) {
+	snprintf(dst, KANSHI_STATUS_NAME_SIZE, "%s", src != NULL ? src : "");
+}
+
+void kanshi_publish_status(struct kanshi_state *state) {
+	struct kanshi_status_file *file = state->status_file;
+	if (file == NULL) {
+		return;
+	}
+	struct kanshi_status *status = file->status;
+
+	uint32_t seq = atomic_load_explicit(&status->seq, memory_order_relaxed);
+	atomic_store_explicit(&status->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	copy_name(status->current_profile, state->current_profile != NULL ?
+		state->current_profile->name : NULL);
+	copy_name(status->pending_profile, state->pending_profile != NULL ?
+		state->pending_profile->name : NULL);
+
+	uint32_t heads_len = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (heads_len == KANSHI_STATUS_HEADS_MAX) {
+			break;
+		}
+		struct kanshi_status_head *out = &status->heads[heads_len++];
+		*out = (struct kanshi_status_head){
+			.enabled = head->enabled,
+			.adaptive_sync = head->adaptive_sync,
+			.x = head->x,
+			.y = head->y,
+			.transform = head->transform,
+			.scale = head->scale,
+		};
+		if (head->mode != NULL) {
+			out->width = head->mode->width;
+			out->height = head->mode->height;
+			out->refresh = head->mode->refresh;
+		}
+		copy_name(out->name, head->name);
+		copy_name(out->make, head->make);
+		copy_name(out->model, head->model);
+		copy_name(out->serial_number, head->serial_number);
+	}
+	status->heads_len = heads_len;
+
+	atomic_store_explicit(&status->seq, seq + 2, memory_order_release);
+}
+
+void kanshi_init_status(struct kanshi_state *state) {
+	char path[PATH_MAX];
+	if (get_status_address(path, sizeof(path), state->name) < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"status file disabled, kanshictl status won't be available");
+		return;
+	}
+
+	// Fill a new file and move it in place, so that readers never map a
+	// truncated one
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+			(int)sizeof(tmp_path)) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL, "status file path too long: %s",
+			path);
+		return;
+	}
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to create status file %s: %s", tmp_path, strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, sizeof(struct kanshi_status)) < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to resize status file: %s", strerror(errno));
+		goto error_fd;
+	}
+	struct kanshi_status *status = mmap(NULL, sizeof(*status),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (status == MAP_FAILED) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to map status file: %s", strerror(errno));
+		goto error_fd;
+	}
+	close(fd);
+	status->magic = KANSHI_STATUS_MAGIC;
+	status->version = KANSHI_STATUS_VERSION;
+
+	struct kanshi_status_file *file = calloc(1, sizeof(*file));
+	if (file == NULL) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL, "calloc: %s", strerror(errno));
+		goto error_map;
+	}
+	file->status = status;
+	file->path = strdup(path);
+	if (file->path == NULL) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL, "strdup: %s", strerror(errno));
+		goto error_file;
+	}
+	if (rename(tmp_path, path) < 0) {
+		kanshi_log(KANSHI_LOG_WARNING, NULL,
+			"failed to move status file to %s: %s", path, strerror(errno));
+		goto error_file;
+	}
+
+	state->status_file = file;
+	kanshi_publish_status(state);
+	return;
+
+error_file:
+	free(file->path);
+	free(file);
+error_map:
+	munmap(status, sizeof(*status));
+	unlink(tmp_path);
+	return;
+error_fd:
+	close(fd);
+	unlink(tmp_path);
+}
+
+void kanshi_finish_status(struct kanshi_state *state) {
+	struct kanshi_status_file *file = state->status_file;
+	if (file == NULL) {
+		return;
+	}
+
+	unlink(file->path);
+	munmap(file->status, sizeof(*file->status));
+	free(file->path);
+	free(file);
+	state->status_file = NULL;
+}
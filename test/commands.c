@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "exec.h"
+#include "kanshi.h"
+#include "log.h"
+#include "metrics.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// The event loop calls back into the daemon, which isn't linked in
+bool kanshi_reload_config(struct kanshi_state *state,
+		kanshi_apply_done_func callback, void *data) {
+	return false;
+}
+
+void kanshi_destroy_display(struct kanshi_state *state) {
+}
+
+void kanshi_check_ready(struct kanshi_context *ctx) {
+}
+
+// Waits for the running commands to exit, returns false after a second
+static bool wait_commands(struct kanshi_context *ctx) {
+	for (int i = 0; i < 100; i++) {
+		kanshi_exec_reap(ctx);
+		if (wl_list_empty(&ctx->command_jobs)) {
+			return true;
+		}
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	return false;
+}
+
+static int count_lines(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	int lines = 0, c;
+	while ((c = fgetc(f)) != EOF) {
+		if (c == '\n') {
+			lines++;
+		}
+	}
+	fclose(f);
+	return lines;
+}
+
+static void test_once_per(void) {
+	char path[] = "/tmp/kanshi-test.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	char command_line[64];
+	snprintf(command_line, sizeof(command_line), "echo >>%s", path);
+
+	struct kanshi_context ctx = { .ready_fd = -1 };
+	wl_list_init(&ctx.displays);
+	wl_list_init(&ctx.timers);
+	wl_list_init(&ctx.command_jobs);
+	struct kanshi_state state = { .ctx = &ctx };
+	wl_list_init(&state.heads);
+	wl_list_init(&state.command_runs);
+
+	struct kanshi_profile profile = { .name = "docked" };
+	wl_list_init(&profile.outputs);
+	wl_list_init(&profile.commands);
+	struct kanshi_profile_command command = {
+		.command = command_line,
+		.once_per_ms = 60000,
+	};
+	wl_list_insert(&profile.commands, &command.link);
+	state.current_profile = &profile;
+
+	// The first application runs the command right away
+	kanshi_exec_profile_commands(&state, &profile, NULL);
+	CHECK(wait_commands(&ctx));
+	CHECK(count_lines(path) == 1);
+	CHECK(wl_list_empty(&ctx.timers));
+
+	// Within the window, the command is deferred once
+	kanshi_exec_profile_commands(&state, &profile, NULL);
+	kanshi_exec_profile_commands(&state, &profile, NULL);
+	CHECK(ctx.metrics.counters[KANSHI_COUNTER_COMMANDS_DEFERRED] == 1);
+	CHECK(ctx.metrics.counters[KANSHI_COUNTER_COMMANDS_COALESCED] == 1);
+	CHECK(wl_list_length(&ctx.timers) == 1);
+	CHECK(wl_list_empty(&ctx.command_jobs));
+	if (wl_list_length(&ctx.timers) != 1) {
+		goto out;
+	}
+
+	struct kanshi_timer *timer =
+		wl_container_of(ctx.timers.next, timer, link);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t delay_ms = (int64_t)(timer->deadline.tv_sec - now.tv_sec) * 1000 +
+		(timer->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	CHECK(delay_ms > 0 && delay_ms <= 60000);
+
+	// Fire the timer as the event loop would, the command runs once more
+	kanshi_timer_disarm(timer);
+	timer->func(timer->data);
+	CHECK(wait_commands(&ctx));
+	CHECK(count_lines(path) == 2);
+	CHECK(ctx.metrics.counters[KANSHI_COUNTER_COMMANDS] == 2);
+
+	// A deferred command is dropped if its profile isn't applied anymore
+	kanshi_exec_profile_commands(&state, &profile, NULL);
+	CHECK(ctx.metrics.counters[KANSHI_COUNTER_COMMANDS_DEFERRED] == 2);
+	CHECK(wl_list_length(&ctx.timers) == 1);
+	if (wl_list_length(&ctx.timers) != 1) {
+		goto out;
+	}
+	state.current_profile = NULL;
+	timer = wl_container_of(ctx.timers.next, timer, link);
+	kanshi_timer_disarm(timer);
+	timer->func(timer->data);
+	CHECK(wait_commands(&ctx));
+	CHECK(count_lines(path) == 2);
+
+out:
+	kanshi_finish_exec(&state);
+	kanshi_exec_destroy_jobs(&ctx);
+	unlink(path);
+}
+
+int main(void) {
+	kanshi_log_init(KANSHI_LOG_WARNING);
+	test_once_per();
+	kanshi_log_finish();
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "libkanshi.h"
+#include "match.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			failures++; \
+		} \
+	} while (0)
+
+// Parses a config from a string, NULL if it's invalid
+static struct kanshi_config *load_config(const char *text) {
+	char path[] = "/tmp/kanshi-test.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	FILE *f = fdopen(fd, "w");
+	fputs(text, f);
+	fclose(f);
+	struct kanshi_config *config = parse_config(path);
+	unlink(path);
+	return config;
+}
+
+static struct kanshi_profile *first_profile(struct kanshi_config *config) {
+	return wl_container_of(config->profiles.next,
+		(struct kanshi_profile *)NULL, link);
+}
+
+static void test_patterns(void) {
+	struct kanshi_config *config = load_config(
+		"profile {\n"
+		"	output make=Dell enable\n"
+		"	output name=DP-1 enable\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	struct kanshi_profile *profile = first_profile(config);
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
+
+	// The first output could take DP-1, it has to move to DP-2
+	struct kanshi_head_info heads[] = {
+		{ .name = "DP-1", .make = "Dell" },
+		{ .name = "DP-2", .make = "Dell" },
+	};
+	CHECK(kanshi_match_profile(profile, heads, 2, matches));
+	CHECK(strcmp(matches[0]->name, "name=DP-1") == 0);
+	CHECK(strcmp(matches[1]->name, "make=Dell") == 0);
+
+	struct kanshi_head_info other_heads[] = {
+		{ .name = "DP-1", .make = "LG" },
+		{ .name = "DP-2", .make = "LG" },
+	};
+	CHECK(!kanshi_match_profile(profile, other_heads, 2, matches));
+	CHECK(!kanshi_match_profile(profile, heads, 1, matches));
+	kanshi_config_destroy(config);
+
+	// Named outputs are matched before wildcards
+	config = load_config(
+		"profile {\n"
+		"	output * disable\n"
+		"	output \"BOE 0x1234 Unknown\" enable\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	struct kanshi_head_info laptop_heads[] = {
+		{ .name = "DP-1", .make = "Dell" },
+		{ .name = "eDP-1", .make = "BOE", .model = "0x1234" },
+	};
+	CHECK(kanshi_match_profile(first_profile(config), laptop_heads, 2,
+		matches));
+	CHECK(strcmp(matches[0]->name, "*") == 0);
+	CHECK(strcmp(matches[1]->name, "BOE 0x1234 Unknown") == 0);
+	kanshi_config_destroy(config);
+}
+
+static void test_mode_policies(void) {
+	const struct kanshi_head_mode modes[] = {
+		{ .width = 1920, .height = 1080, .refresh = 60000 },
+		{ .width = 3840, .height = 2160, .refresh = 30000 },
+		{ .width = 2560, .height = 1440, .refresh = 144000 },
+		{ .width = 1920, .height = 1080, .refresh = 59940, .preferred = true },
+		{ .width = 3840, .height = 2160, .refresh = 60000 },
+		{ .width = 1920, .height = 1080, .refresh = 60010 },
+	};
+	const size_t modes_len = sizeof(modes) / sizeof(modes[0]);
+
+	struct kanshi_output_mode mode = { .policy = KANSHI_MODE_PREFERRED };
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 3);
+	// Without a preferred mode, the largest one is picked
+	CHECK(kanshi_match_mode(modes, 3, &mode) == 1);
+	CHECK(kanshi_match_mode(modes, 0, &mode) == -1);
+	mode.policy = KANSHI_MODE_MAX_RESOLUTION;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 4);
+	mode.policy = KANSHI_MODE_MAX_REFRESH;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 2);
+
+	mode = (struct kanshi_output_mode){
+		.width = 1920,
+		.height = 1080,
+		.refresh = 60000,
+		.refresh_tolerance = KANSHI_REFRESH_TOLERANCE,
+	};
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 0);
+	mode.refresh = 59880;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == -1);
+	mode.refresh_tolerance = 100;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 3);
+	mode.refresh = 60000;
+	mode.refresh_tolerance = 1;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 0);
+	mode.refresh = 0;
+	CHECK(kanshi_match_mode(modes, modes_len, &mode) == 5);
+
+	struct kanshi_config *config = load_config(
+		"profile {\n"
+		"	output * mode --tolerance 0.5Hz 1920x1080@60\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config != NULL) {
+		struct kanshi_profile_output *output = wl_container_of(
+			first_profile(config)->outputs.next, output, link);
+		CHECK(output->mode.refresh_tolerance == 500);
+		kanshi_config_destroy(config);
+	}
+	CHECK(load_config("profile {\n"
+		"	output * mode --tolerance 0 1920x1080@60\n"
+		"}\n") == NULL);
+	CHECK(load_config("profile {\n"
+		"	output * mode --custom preferred\n"
+		"}\n") == NULL);
+}
+
+static void test_wait_groups(void) {
+	struct kanshi_config *config = load_config(
+		"profile {\n"
+		"	output * enable\n"
+		"	exec a\n"
+		"	exec --wait b\n"
+		"	exec c\n"
+		"	exec d\n"
+		"	exec --wait e\n"
+		"	exec --wait f\n"
+		"}\n"
+		"profile {\n"
+		"	output * enable\n"
+		"	exec --wait a\n"
+		"	exec b\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+
+	const unsigned int groups[][6] = {
+		{ 0, 1, 2, 2, 3, 4 },
+		{ 0, 1 },
+	};
+	size_t i = 0;
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &config->profiles, link) {
+		size_t j = 0;
+		struct kanshi_profile_command *command;
+		wl_list_for_each(command, &profile->commands, link) {
+			CHECK(command->group == groups[i][j]);
+			j++;
+		}
+		i++;
+	}
+	kanshi_config_destroy(config);
+}
+
+static void test_output_defaults(void) {
+	struct kanshi_config *config = load_config(
+		"output \"Dell Inc. U2720Q ABC\" scale 2 alias $dell\n"
+		"output eDP-1 disable alias $laptop\n"
+		"profile {\n"
+		"	output $dell enable\n"
+		"	output $laptop\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	struct kanshi_profile_output *output;
+	wl_list_for_each(output, &first_profile(config)->outputs, link) {
+		if (strcmp(output->name, "Dell Inc. U2720Q ABC") == 0) {
+			CHECK(output->fields & KANSHI_OUTPUT_SCALE);
+			CHECK(output->enabled);
+		} else {
+			CHECK(strcmp(output->name, "eDP-1") == 0);
+			CHECK(!output->enabled);
+		}
+	}
+	kanshi_config_destroy(config);
+
+	CHECK(load_config("profile {\n\toutput $undefined enable\n}\n") == NULL);
+	CHECK(load_config("output DP-1 scale 2\noutput DP-1 scale 1\n") == NULL);
+	CHECK(load_config("profile {\n"
+		"	output DP-1 enable\n"
+		"	output DP-1 disable\n"
+		"}\n") == NULL);
+}
+
+static void test_profile_selection(void) {
+	const char *profiles =
+		"profile wildcard {\n"
+		"	output make=BOE enable\n"
+		"	output * enable\n"
+		"}\n"
+		"profile names {\n"
+		"	output DP-1 enable\n"
+		"	output eDP-1 enable\n"
+		"}\n"
+		"profile identifiers {\n"
+		"	output \"Dell Inc. U2720Q ABC\" enable\n"
+		"	output \"BOE 0x1234 Unknown\" enable\n"
+		"}\n"
+		"profile identifiers {\n"
+		"	output \"Dell Inc. U2720Q ABC\" disable\n"
+		"	output \"BOE 0x1234 Unknown\" disable\n"
+		"}\n"
+		"profile single {\n"
+		"	output \"Dell Inc. U2720Q ABC\" enable\n"
+		"}\n";
+	struct kanshi_head_info heads[] = {
+		{ .name = "DP-1", .make = "Dell Inc.", .model = "U2720Q",
+			.serial_number = "ABC" },
+		{ .name = "eDP-1", .make = "BOE", .model = "0x1234",
+			.serial_number = "Unknown" },
+	};
+	struct kanshi_profile_output *matches[KANSHI_HEADS_MAX];
+
+	char text[1024];
+	snprintf(text, sizeof(text), "%s", profiles);
+	struct kanshi_config *config = load_config(text);
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	struct kanshi_profile *profile = kanshi_match(config, heads, 2, matches);
+	CHECK(profile != NULL && strcmp(profile->name, "wildcard") == 0);
+	kanshi_config_destroy(config);
+
+	// The most specific profile wins, then the first one in the file
+	snprintf(text, sizeof(text), "profile_selection best\n%s", profiles);
+	config = load_config(text);
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	profile = kanshi_match(config, heads, 2, matches);
+	CHECK(profile != NULL && strcmp(profile->name, "identifiers") == 0);
+	CHECK(profile != NULL && matches[0]->enabled);
+	heads[0].serial_number = "DEF";
+	profile = kanshi_match(config, heads, 2, matches);
+	CHECK(profile != NULL && strcmp(profile->name, "names") == 0);
+	profile = kanshi_match(config, heads, 1, matches);
+	CHECK(profile == NULL);
+	kanshi_config_destroy(config);
+
+	// A higher priority beats a more specific profile
+	snprintf(text, sizeof(text), "profile_selection best\n%s"
+		"profile fallback {\n"
+		"	priority 1\n"
+		"	output make=BOE disable\n"
+		"	output * disable\n"
+		"}\n", profiles);
+	config = load_config(text);
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+	profile = kanshi_match(config, heads, 2, matches);
+	CHECK(profile != NULL && strcmp(profile->name, "fallback") == 0);
+	kanshi_config_destroy(config);
+}
+
+static void test_profile_lists(void) {
+	struct kanshi_config *config = load_config(
+		"profile docked {\n"
+		"	output DP-1 enable\n"
+		"}\n"
+		"profile laptop {\n"
+		"	output eDP-1 enable\n"
+		"}\n"
+		"profile docked {\n"
+		"	output DP-2 enable\n"
+		"}\n");
+	CHECK(config != NULL);
+	if (config == NULL) {
+		return;
+	}
+
+	// Profiles sharing a name are listed in config order
+	const char *names[] = { "laptop", "unknown", "docked" };
+	struct kanshi_profile **profiles;
+	size_t len;
+	CHECK(find_profile_list(config, names, 3, &profiles, &len));
+	CHECK(len == 3);
+	if (len == 3) {
+		CHECK(strcmp(profiles[0]->name, "laptop") == 0);
+		struct kanshi_profile_output *output = wl_container_of(
+			profiles[2]->outputs.next, output, link);
+		CHECK(strcmp(output->name, "DP-2") == 0);
+	}
+	free(profiles);
+
+	CHECK(find_profile_list(config, names + 1, 1, &profiles, &len));
+	CHECK(len == 0 && profiles == NULL);
+	kanshi_config_destroy(config);
+}
+
+int main(void) {
+	test_patterns();
+	test_mode_policies();
+	test_wait_groups();
+	test_output_defaults();
+	test_profile_selection();
+	test_profile_lists();
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,12 @@
+#!/bin/sh -eu
+# Replays <test>.trace with the config <test>.conf and compares the messages
+# logged by kanshi with <test>.log, leaving out timings
+
+kanshi="$1"
+test="$2"
+
+"$kanshi" --config "$test.conf" --replay "$test.trace" --replay-speed 0 \
+	--log-level debug 2>&1 |
+	sed -e '/done handling latency/d' -e '/outputs changed modes for/d' \
+		-e 's/\(replayed [0-9]* events\) in [0-9]*us/\1/' |
+	diff -u "$test.log" -